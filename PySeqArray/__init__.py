@@ -2,7 +2,9 @@
 import numpy as np
 # import os
 import os
-# import multiprocessing
+import tempfile
+# import multiprocessing and threading
+import threading
 import multiprocessing as mp
 import multiprocessing.pool as pl
 # import pygds
@@ -48,26 +50,162 @@ def seqExample(filename=None):
 
 
 
+def seqNumThread(num=None):
+	"""Number of threads
+
+	Get or set the default number of threads used in native computation, e.g., decoding genotypes.
+
+	Parameters
+	----------
+	num : int
+		if not None, set the default number of threads; 0 for all logical cores, 1 for no multithreading
+
+	Returns
+	-------
+	int, the default number of threads
+
+	Notes
+	-----
+	The reads and decompression from a GDS file are serialized by a global mutex, and only decoding
+	genotypes, selecting samples and counting run in parallel, so the speedup is bounded by the share
+	of time outside the GDS reads (see the 'nthread' group in benchmark/bench_throughput.py).
+
+	Examples
+	--------
+	>>> seqNumThread(4)
+	"""
+	return cc.num_thread(num)
+
+
+
 # ===========================================================================
 
+# create a file in shared memory for the results of all processes,
+# returning (file name, dtype, length)
+def _shm_create(n, dtype):
+	dtype = np.dtype(dtype)
+	d = '/dev/shm' if os.path.isdir('/dev/shm') else None
+	fd, fn = tempfile.mkstemp(prefix='pyseqarray_', suffix='.shm', dir=d)
+	try:
+		os.ftruncate(fd, max(n * dtype.itemsize, 1))
+	finally:
+		os.close(fd)
+	return (fn, dtype.str, n)
+
+# write the result of a process to its slice of the shared output
+def _shm_write(shm, sp, v):
+	dtype = np.dtype(shm[1]); st = sp[0]; cnt = sp[1]
+	v = np.asarray(v, dtype=dtype)
+	if v.shape != (cnt,):
+		raise ValueError('The returned value should be a vector of length %d.' % cnt)
+	if cnt > 0:
+		m = np.memmap(shm[0], dtype=dtype, mode='r+', offset=st*dtype.itemsize, shape=(cnt,))
+		m[:] = v
+		m.flush()
+		del m
+
+# return the shared output without copying, and remove its file name
+def _shm_result(shm):
+	fn = shm[0]; dtype = np.dtype(shm[1]); n = shm[2]
+	if n <= 0:
+		os.remove(fn)
+		return np.zeros(0, dtype=dtype)
+	v = np.memmap(fn, dtype=dtype, mode='r+', shape=(n,))
+	if os.name == 'nt':
+		# an opened file can not be removed
+		v = np.array(v)
+	os.remove(fn)
+	return v
+
 # define internal function using forking
 def _proc_fork_func(x):
 	i = x[0]; ncpu = x[1]
 	file = x[2]; fun = x[3]; param = x[4]; split = x[5]
-	cc.flt_split(file.fileid, i, ncpu, split)
-	return fun(file, param)
+	shm = x[6]
+	sp = cc.flt_split(file.fileid, i, ncpu, split)
+	v = fun(file, param)
+	if shm is None:
+		return v
+	_shm_write(shm, sp, v)
+
+# run without splitting, returning a vector of `shared` if it is not None
+def _serial_func(file, fun, param, shared, total):
+	v = fun(file, param)
+	if shared is None:
+		return v
+	v = np.asarray(v, dtype=shared)
+	if v.shape != (total,):
+		raise ValueError('The returned value should be a vector of length %d.' % total)
+	return v
+
+# define a thread function, with its own filter of the shared file
+def _thread_func(i, ncpu, file, fun, param, split, out, err, shared_out):
+	cc.flt_thread(file.fileid, True)
+	try:
+		sp = cc.flt_split(file.fileid, i, ncpu, split)
+		v = fun(file, param)
+		if shared_out is None:
+			out[i] = v
+		else:
+			v = np.asarray(v, dtype=shared_out.dtype)
+			if v.shape != (sp[1],):
+				raise ValueError('The returned value should be a vector of length %d.' % sp[1])
+			shared_out[sp[0]:(sp[0]+sp[1])] = v
+	except BaseException as e:
+		err[i] = e
+	finally:
+		cc.flt_thread(file.fileid, False)
 
 # define a process function
 def _proc_func(x):
 	i = x[0]; ncpu = x[1]
 	fn = x[2]; fun = x[3]; param = x[4]; sel = x[5]; split = x[6]
+	idx_cache = x[7]; shm = x[8]
 	import PySeqArray
 	import PySeqArray.ccall as cc
 	file = PySeqArray.SeqArrayFile()
-	file.open(fn, allow_dup=True)
+	file.open(fn, allow_dup=True, index_cache=idx_cache)
 	file.FilterSet2(sel[0], sel[1], verbose=False)
-	cc.flt_split(file.fileid, i, ncpu, split)
-	return fun(file, param)
+	sp = cc.flt_split(file.fileid, i, ncpu, split)
+	v = fun(file, param)
+	if shm is None:
+		return v
+	PySeqArray._shm_write(shm, sp, v)
+
+# the allele parameter passed to cc.calc_af and cc.calc_ac
+def _allele_ref(ref):
+	if ref is None or isinstance(ref, (int, np.integer)):
+		return ref
+	ref = np.asarray(ref)
+	if ref.dtype.kind in ('U', 'S'):
+		ref = ref.astype(object)
+	return ref
+
+# read the regions in a BED file, returning 1-based inclusive positions
+def _read_bed(fn):
+	import gzip
+	chrom = []; start = []; end = []
+	with (gzip.open(fn, 'rt') if fn.endswith('.gz') else open(fn, 'rt')) as f:
+		for ln in f:
+			if ln.startswith(('#', 'track', 'browser')) or not ln.strip():
+				continue
+			s = ln.split('\t') if '\t' in ln else ln.split()
+			chrom.append(s[0])
+			start.append(int(s[1]) + 1)
+			end.append(int(s[2]))
+	return chrom, start, end
+
+# combine the returned values from parallel workers
+def _combine(v, combine):
+	if combine is None or combine == 'none':
+		v = None
+	elif combine == 'unlist':
+		v = np.hstack(v)
+	elif callable(combine):
+		v = reduce(combine, v)
+	elif combine != 'list':
+		raise ValueError('`combine` is invalid.')
+	return v
 
 
 
@@ -80,6 +218,7 @@ class SeqArrayFile(pygds.gdsfile):
 
 	def __init__(self):
 		pygds.gdsfile.__init__(self)
+		self.index_cache = None
 
 	def __del__(self):
 		cc.file_done(self.fileid)
@@ -90,7 +229,7 @@ class SeqArrayFile(pygds.gdsfile):
 		raise Exception('not supported!')
 
 
-	def open(self, filename, readonly=True, allow_dup=False):
+	def open(self, filename, readonly=True, allow_dup=False, index_cache=False):
 		"""Open an SeqArray file
 
 		Open an existing file of SeqArray GDS for reading or writing.
@@ -103,6 +242,11 @@ class SeqArrayFile(pygds.gdsfile):
 			if True, the file is opened read-only; otherwise, it is allowed to write data to the file
 		allow_dup : bool
 			if True, it is allowed to open a GDS file with read-only mode when it has been opened in the same session
+		index_cache : bool, str
+			if True, cache the indexing of genotypes and annotations in the sidecar file 'filename.seqidx';
+			if a string, the file name of the sidecar file; the cache is rebuilt when the size or
+			modification time of the GDS file changes, and the new indices are written when
+			the file is closed
 
 		Returns
 		-------
@@ -113,7 +257,12 @@ class SeqArrayFile(pygds.gdsfile):
 		close: close a SeqArray file
 		"""
 		pygds.gdsfile.open(self, filename, readonly, allow_dup)
-		cc.file_init(self.fileid)
+		if index_cache is True:
+			index_cache = filename + '.seqidx'
+		elif not index_cache:
+			index_cache = None
+		self.index_cache = index_cache
+		cc.file_init(self.fileid, filename, index_cache)
 		# TODO: file checking
 
 
@@ -200,6 +349,91 @@ class SeqArrayFile(pygds.gdsfile):
 			cc.set_variant2(self.fileid, variant, intersect, verbose)
 
 
+	def FilterSetRange(self, chrom, start=None, end=None, intersect=False, verbose=True):
+		"""Set a filter by genomic ranges
+
+		Set a filter to variant with chromosomes and position ranges, using binary search on the
+		positions within each run of a chromosome, or a linear scan of the run if its positions are not sorted.
+
+		Parameters
+		----------
+		chrom : str, list
+			chromosome(s) to be selected
+		start : int, list
+			None for the whole chromosome(s), or the starting position(s) of the range(s), one per chromosome
+		end : int, list
+			None for the whole chromosome(s), or the ending position(s) of the range(s) (inclusive)
+		intersect : bool
+			if False, the candidate variants for selection are all possible variants (by default);
+			if True, the candidate variants are from the selected variants defined via the previous call
+		verbose : bool
+			if True, show information
+
+		Returns
+		-------
+		None
+
+		See Also
+		--------
+		FilterSet : set a filter
+		FilterReset : reset the filter
+		"""
+		chrom = [ str(c) for c in np.atleast_1d(chrom) ]
+		if start is not None:
+			start = np.atleast_1d(np.asarray(start, dtype=np.int32))
+		if end is not None:
+			end = np.atleast_1d(np.asarray(end, dtype=np.int32))
+		cc.set_chrom(self.fileid, chrom, start, end, intersect, verbose)
+
+
+	def FilterSetRegions(self, chrom=None, start=None, end=None, bed=None, intersect=False,
+		verbose=True, index=False):
+		"""Set a filter by many regions
+
+		Set a filter to variant with a large number of genomic regions, e.g., genes or exome intervals.
+		The regions are sorted and merged per chromosome, and the selection is set in one pass.
+
+		Parameters
+		----------
+		chrom : list
+			the chromosomes of regions
+		start : list
+			the starting positions of regions (1-based, inclusive)
+		end : list
+			the ending positions of regions (inclusive)
+		bed : str
+			the file name of a BED file (0-based starting and exclusive ending positions, the first three
+			columns used), instead of `chrom`, `start` and `end`; '.gz' for a gzip file
+		intersect : bool
+			if False, the candidate variants for selection are all possible variants (by default);
+			if True, the candidate variants are from the selected variants defined via the previous call
+		verbose : bool
+			if True, show information
+		index : bool
+			if True, return the selected variants in each region
+
+		Returns
+		-------
+		None, or a tuple (offset, idx) of int32 arrays if `index=True`: the selected variants in the
+		i-th region are `idx[offset[i]:offset[i+1]]`, the indices in the new selection
+
+		See Also
+		--------
+		FilterSetRange : set a filter by genomic ranges
+		FilterReset : reset the filter
+		"""
+		if bed is not None:
+			if chrom is not None or start is not None or end is not None:
+				raise ValueError("'chrom', 'start' and 'end' should be None if 'bed' is specified.")
+			chrom, start, end = _read_bed(bed)
+		elif chrom is None or start is None or end is None:
+			raise ValueError("'chrom', 'start' and 'end' should be specified.")
+		chrom = [ str(c) for c in np.atleast_1d(chrom) ]
+		start = np.atleast_1d(np.asarray(start, dtype=np.int32))
+		end = np.atleast_1d(np.asarray(end, dtype=np.int32))
+		return cc.set_regions(self.fileid, chrom, start, end, intersect, verbose, index)
+
+
 	def FilterReset(self, sample=True, variant=True, verbose=True):
 		"""Reset the filter
 
@@ -286,7 +520,7 @@ class SeqArrayFile(pygds.gdsfile):
 		return(cc.get_filter(self.fileid, sample))
 
 
-	def GetData(self, name):
+	def GetData(self, name, nthread=None):
 		"""Get data
 
 		Get data from a SeqArray file with a given variable name and a sample/variant filter
@@ -295,19 +529,36 @@ class SeqArrayFile(pygds.gdsfile):
 		----------
 		name : str
 			the variable name
+		nthread : int
+			the number of threads for decoding genotypes, or None for the default set by seqNumThread();
+			the reads from the GDS file are not parallel (see seqNumThread)
 
 		Returns
 		-------
 		a numpy array object
 
+		Notes
+		-----
+		'$genotype_packed' returns a uint8 matrix (# of variants, ceil(# of samples * ploidy / 4)):
+		each allele takes 2 bits and four alleles are stored in a byte from the lowest bits (like PLINK .bed),
+		where the allele j of the i-th sample is the k-th value with k = i*ploidy + j.
+		A 2-bit value is the allele index 0, 1 or 2, and 3 for a missing allele or an allele index >= 3.
+		'$chrom_code' returns a tuple (codes, levels), where codes is an int32 array of the indices in levels
+		and levels is a list of chromosomes in the order of first appearance in the file.
+		'$chrom_pos_key' returns a tuple (keys, levels), where keys is a numpy structured array with int32 fields
+		'chrom' (the index in levels), 'pos' and 'dup' (0 for the first occurrence of a chromosome and position,
+		and 1, 2, ... for its consecutive duplicates), an alternative to the strings of '$chrom_pos'.
+
 		See Also
 		--------
 		FilterSet : set a filter
 		"""
-		return cc.get_data(self.fileid, name)
+		if nthread is None:
+			nthread = 0
+		return cc.get_data(self.fileid, name, nthread)
 
 
-	def Apply(self, name, fun, param=None, asis='none', bsize=1024, verbose=False):
+	def Apply(self, name, fun, param=None, asis='none', bsize=1024, verbose=False, margin='by.variant', prefetch=0, reuse=False):
 		"""Apply function over array margins
 
 		Apply a user-defined function to margins of genotypes and annotations via blocking
@@ -327,6 +578,18 @@ class SeqArrayFile(pygds.gdsfile):
 			block size
 		verbose : bool
 			show progress information if True
+		margin : str
+			'by.variant', apply over blocks of variants; 'by.sample', apply over blocks of samples,
+			where genotype, $dosage and phase are passed with samples in the first dimension: the sample
+			blocks are grouped so that their arrays take at most 1GB, and the selected variants are read
+			once per group and transposed into the arrays of sample blocks
+		prefetch : int
+			the number of blocks decoded ahead in a background thread while 'fun' runs (margin='by.variant' only),
+			0 for no prefetching; it applies to genotype, $dosage and $genotype_packed; if 'fun' reads data from
+			the same file, the access is serialized with the background thread, and the file can not be closed
+		reuse : bool
+			without prefetching, the arrays of genotype, $dosage and $genotype_packed are reused by the next block
+			if 'fun' does not keep a reference to them; if True, always reuse them even if referenced
 
 		Returns
 		-------
@@ -336,13 +599,18 @@ class SeqArrayFile(pygds.gdsfile):
 		--------
 		FilterSet : set a filter
 		"""
-		v = cc.apply(self.fileid, name, fun, param, asis, bsize, verbose)
+		if margin == 'by.variant':
+			v = cc.apply(self.fileid, name, fun, param, asis, bsize, verbose, prefetch, reuse)
+		elif margin == 'by.sample':
+			v = cc.apply_sample(self.fileid, name, fun, param, asis, bsize, verbose)
+		else:
+			raise ValueError("'margin' should be 'by.variant' or 'by.sample'.")
 		if asis == 'unlist':
 			v = np.hstack(v)
 		return(v)
 
 
-	def RunParallel(self, fun, param=None, ncpu=0, split='by.variant', combine='unlist'):
+	def RunParallel(self, fun, param=None, ncpu=0, split='by.variant', combine='unlist', backend='processes', shared=None):
 		"""Apply Functions in Parallel
 
 		Apply a user-defined function in parallel over array margins
@@ -361,6 +629,15 @@ class SeqArrayFile(pygds.gdsfile):
 		combine : str, function
 			'none', no return; 'list', a list of the returned values from the user-defined function;
 			'unlist', flatten the returned values from the user-defined function
+		backend : str
+			'processes', run in forked or spawned processes; 'threads', run in the threads of this process
+			sharing the file and its indexing, each with its own filter, where genotypes are decoded
+			without the GIL and the access to the GDS file is serialized
+		shared : numpy dtype
+			if not None with combine='unlist' and split='by.variant' or 'by.sample', the output vector is preallocated
+			in shared memory, each worker should return a vector with the length of its selected variants or samples
+			which is written to its slice in place, and a numpy array without copying is returned; with one core,
+			the returned value of 'fun' is converted to a numpy array of `shared`
 
 		Returns
 		-------
@@ -371,6 +648,36 @@ class SeqArrayFile(pygds.gdsfile):
 			raise ValueError('`ncpu` should be a numeric value or `multiprocessing.pool.Pool`.')
 		if not (combine is None or isinstance(combine, str) or callable(combine)):
 			raise ValueError('`combine` should be None, a string or a function.')
+		if backend not in ('processes', 'threads'):
+			raise ValueError("`backend` should be 'processes' or 'threads'.")
+		if shared is not None:
+			if combine != 'unlist':
+				raise ValueError("`combine` should be 'unlist' if `shared` is used.")
+			if split not in ('by.variant', 'by.sample'):
+				raise ValueError("`split` should be 'by.variant' or 'by.sample' if `shared` is used.")
+			# the total number of selected variants or samples, without splitting
+			total = cc.flt_split(self.fileid, 0, 1, split)[2]
+		else:
+			total = None
+		# run in threads
+		if backend == 'threads':
+			if not isinstance(ncpu, (int, float)):
+				raise ValueError("`ncpu` should be a numeric value if backend='threads'.")
+			ncpu = int(ncpu)
+			if ncpu <= 0:
+				ncpu = max(mp.cpu_count() - 1, 1)
+			if ncpu <= 1:
+				return _serial_func(self, fun, param, shared, total)
+			v = [ None ] * ncpu
+			err = [ None ] * ncpu
+			out = None if shared is None else np.empty(total, dtype=shared)
+			th = [ threading.Thread(target=_thread_func,
+				args=(i, ncpu, self, fun, param, split, v, err, out)) for i in range(ncpu) ]
+			for t in th: t.start()
+			for t in th: t.join()
+			for e in err:
+				if e is not None: raise e
+			return _combine(v, combine) if out is None else out
 		# run
 		if isinstance(ncpu, (int, float)):
 			if ncpu <= 0:
@@ -389,33 +696,98 @@ class SeqArrayFile(pygds.gdsfile):
 			if isinstance(ncpu, (int, float)):
 				is_fork = (platform=="linux" or platform=="linux2" or
 					platform=="unix" or platform=="darwin")
-			if is_fork:
-				pm = [ [ i,ncpu,self,fun,param,split ] for i in range(ncpu) ]
-				v = pa.map(_proc_fork_func, pm)
-			else:
-				sel = [ self.FilterGet(True), self.FilterGet(False) ]
-				pm = [ [ i,ncpu,self.filename,fun,param,sel,split ] for i in range(ncpu) ]
-				v = pa.map(_proc_func, pm)
+			shm = None if shared is None else _shm_create(total, shared)
+			try:
+				if is_fork:
+					pm = [ [ i,ncpu,self,fun,param,split,shm ] for i in range(ncpu) ]
+					v = pa.map(_proc_fork_func, pm)
+				else:
+					sel = [ self.FilterGet(True), self.FilterGet(False) ]
+					pm = [ [ i,ncpu,self.filename,fun,param,sel,split,self.index_cache,shm ]
+						for i in range(ncpu) ]
+					v = pa.map(_proc_func, pm)
+			except BaseException:
+				if shm is not None: os.remove(shm[0])
+				raise
 			# output
-			if combine is None or combine == 'none':
-				v = None
-			elif combine == 'unlist':
-				v = np.hstack(v)
-			elif callable(combine):
-				v = reduce(combine, v)
-			elif combine != 'list':
-				raise ValueError('`combine` is invalid.')
-			return v
+			return _combine(v, combine) if shm is None else _shm_result(shm)
 		else:
-			return fun(self, param)
+			return _serial_func(self, fun, param, shared, total)
 
 
 	####  Methods  ####
 
-	def AlleleFreq(self, ref, ncpu, verbose=False):
-		if not (isinstance(ref, (int, float)) or ref is None):
-			raise ValueError('`ref` should be a numeric value or None.')
-		self.RunParallel((lambda file, param:
-				file.Apply('genotype', cc.calc_af, as_is='unlist')),
-			param=[ ref, verbose ], ncpu=ncpu)
+	def AlleleFreq(self, ref=None, nthread=None):
+		"""Allele frequencies
+
+		Calculate the allele frequencies of the selected variants natively
+
+		Parameters
+		----------
+		ref : None, int, list
+			None for the reference allele; an allele index for all variants; a vector of allele indices
+			or allele strings, one per selected variant
+		nthread : int
+			the number of threads, or None for the default set by seqNumThread(); the reads from the GDS
+			file are not parallel (see seqNumThread)
+
+		Returns
+		-------
+		a numpy array of float64, NaN if no non-missing allele or the allele is not found
+		"""
+		return cc.calc_af(self.fileid, _allele_ref(ref), 0 if nthread is None else nthread)
+
+
+	def AlleleCount(self, ref=None, nthread=None):
+		"""Allele counts
+
+		Count the alleles of the selected variants natively
+
+		Parameters
+		----------
+		ref : None, int, list
+			None for the reference allele; an allele index for all variants; a vector of allele indices
+			or allele strings, one per selected variant
+		nthread : int
+			the number of threads, or None for the default set by seqNumThread(); the reads from the GDS
+			file are not parallel (see seqNumThread)
+
+		Returns
+		-------
+		a numpy array of int32, 0 if the allele is not found
+		"""
+		return cc.calc_ac(self.fileid, _allele_ref(ref), 0 if nthread is None else nthread)
+
+
+	def Reduce(self, name, nthread=None):
+		"""Native reductions
+
+		Reduce the dosages (the numbers of reference alleles) of the selected variants without
+		Python callbacks, several reductions sharing one pass of decoding genotypes
+
+		Parameters
+		----------
+		name : str, list
+			'variant.dosage_count', 'variant.dosage_sum', 'variant.dosage_sqsum', 'variant.nonmiss',
+			'sample.dosage_count', 'sample.dosage_sum', 'sample.dosage_sqsum', 'sample.nonmiss'
+		nthread : int
+			the number of threads, or None for the default set by seqNumThread(); the reads from the GDS
+			file are not parallel (see seqNumThread)
+
+		Returns
+		-------
+		a numpy array if `name` is a string, otherwise a dictionary of numpy arrays with the keys in `name`
+
+		Notes
+		-----
+		'*.dosage_count' returns a int32 matrix with `ploidy + 2` columns, the counts of dosage 0, 1, ...,
+		ploidy and missing, so that the genotypes with the same number of reference alleles are counted
+		together (e.g., 0|1 and 1|0, or 1/1 and 1/2); '*.dosage_sum' and '*.dosage_sqsum' return int64
+		vectors, the exact sums of non-missing dosages and squared dosages; '*.nonmiss' returns int32
+		vectors, the numbers of non-missing dosages. The results do not depend on the number of threads.
+		"""
+		nt = 0 if nthread is None else nthread
+		if isinstance(name, str):
+			return cc.reduce(self.fileid, [ name ], nt)[name]
+		return cc.reduce(self.fileid, list(name), nt)
 
@@ -0,0 +1,87 @@
+# ===========================================================================
+#
+# bench_index.py: microbenchmark for the genotype indexing (CGenoIndex)
+#
+# Copyright (C) 2017    Xiuwen Zheng
+#
+# This file is part of PySeqArray.
+#
+# PySeqArray is free software: you can redistribute it and/or modify it
+# under the terms of the GNU General Public License Version 3 as
+# published by the Free Software Foundation.
+#
+# PySeqArray is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with PySeqArray.
+# If not, see <http://www.gnu.org/licenses/>.
+
+"""Time the resolution of variant positions in 'genotype/@data'
+
+Usage: python bench_index.py [gds_file] [num_variant] [repeat]
+
+A fixed selection of one sample and 'num_variant' variants is set once for
+each pattern, and then the genotypes are read by a single GetData() call
+(best of 'repeat' runs), so the Python overhead and the selection are out
+of the timing. The 'contiguous' pattern is the baseline, in which the
+cursor of CGenoIndex moves by one variant; in the 'strided' and 'random'
+patterns, the cursor jumps far forward through the skip table. The extra
+time per variant over the baseline is the cost of a seek. The number of
+seeks through the skip table is shown if the package is built with
+PYSEQARRAY_STATS=1.
+"""
+
+import sys
+import time
+import numpy as np
+import PySeqArray as ps
+import PySeqArray.ccall as cc
+
+
+def run(f, idx, repeat):
+	f.FilterSet2(variant=idx, verbose=False)
+	t = float('inf')
+	cc.stats_reset()
+	for i in range(repeat):
+		t0 = time.time()
+		f.GetData('genotype')
+		t = min(t, time.time() - t0)
+	st = cc.stats()
+	nseek = st['index_reset'] / repeat if st['enabled'] else None
+	return t, nseek
+
+
+if __name__ == '__main__':
+	fn = sys.argv[1] if len(sys.argv) > 1 else \
+		ps.seqExample('1KG_phase1_release_v3_chr22.gds')
+	num = int(sys.argv[2]) if len(sys.argv) > 2 else 2000
+	repeat = int(sys.argv[3]) if len(sys.argv) > 3 else 5
+
+	f = ps.SeqArrayFile()
+	f.open(fn)
+	nvar = len(f.FilterGet(False))
+	num = min(num, nvar)
+	step = max(nvar // num, 1)
+	f.FilterSet2(sample=np.array([0]), verbose=False)
+
+	rand = np.random.RandomState(1000).choice(nvar, num, replace=False)
+	lst = [
+		('contiguous', np.arange(num)),
+		('strided', np.arange(0, nvar, step)[:num]),
+		('random', np.sort(rand)) ]
+	t0 = None
+	for nm, idx in lst:
+		t, nseek = run(f, idx, repeat)
+		us = t / len(idx) * 1e6
+		if t0 is None: t0 = us
+		s = '%-12s %8d variants, %.1f us/variant, +%.2f us/variant' % (nm,
+			len(idx), us, us - t0)
+		if nseek is not None:
+			s += ', %d seeks' % nseek
+		print(s)
+
+	f.FilterReset(verbose=False)
+	f.close()
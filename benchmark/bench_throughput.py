@@ -0,0 +1,232 @@
+# ===========================================================================
+#
+# bench_throughput.py: end-to-end throughput benchmark of PySeqArray
+#
+# Copyright (C) 2017    Xiuwen Zheng
+#
+# This file is part of PySeqArray.
+#
+# PySeqArray is free software: you can redistribute it and/or modify it
+# under the terms of the GNU General Public License Version 3 as
+# published by the Free Software Foundation.
+#
+# PySeqArray is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with PySeqArray.
+# If not, see <http://www.gnu.org/licenses/>.
+
+"""Measure the throughput of reading, filtering and parallel processing
+
+Usage: python bench_throughput.py [-o result.json] [-r repeat] [-n max_cpu]
+	[--skip group,...] [gds_file]
+
+The groups are 'get_data' (genotype, $dosage and $genotype_packed),
+'apply' (a bsize sweep), 'filter' (FilterSet, FilterSet2, FilterSetRange,
+FilterSetRegions and FilterReset), 'nthread' (the native multithreading of
+GetData, AlleleFreq and Reduce from 1 to max_cpu threads) and 'parallel'
+(RunParallel from 1 to max_cpu cores with both backends).
+
+In the 'nthread' group, the reads from the GDS file are serialized by a
+global mutex, and only the decoding, selection and counting run in
+parallel. The speedup over 1 thread is reported, and if the package is
+built with PYSEQARRAY_STATS=1, 'read_share' is the share of time in the
+GDS reads with 1 thread, so that 1/read_share bounds the speedup. Each timing is the best of 'repeat'
+runs, and the random selections use a fixed seed. Use gen_synthetic.py for
+a larger file. The results are written as JSON, e.g.,
+
+	{ "version": ..., "file": ..., "results": [
+		{ "group": "get_data", "name": "genotype", "seconds": ...,
+		  "rate": ..., "unit": "genotype/s" }, ... ] }
+"""
+
+import os
+import sys
+import time
+import json
+import platform
+import argparse
+import multiprocessing as mp
+import numpy as np
+import PySeqArray as ps
+import PySeqArray.ccall as cc
+
+
+def best_time(fun, repeat):
+	t = float('inf')
+	for i in range(repeat):
+		t0 = time.time()
+		fun()
+		t = min(t, time.time() - t0)
+	return t
+
+
+def _apply_nop(x):
+	pass
+
+def _par_dosage(f, param):
+	d = f.GetData('$dosage', nthread=1)
+	return (d == 0).sum(axis=1)
+
+
+class Bench:
+	def __init__(self, fn, repeat):
+		self.fn = fn
+		self.repeat = repeat
+		self.results = []
+		self.f = ps.SeqArrayFile()
+		t0 = time.time()
+		self.f.open(fn)
+		self.add('file', 'open', time.time() - t0, None, None)
+		self.nsamp = len(self.f.FilterGet(True))
+		self.nvar = len(self.f.FilterGet(False))
+		g = self.f.GetData('genotype')
+		self.ploidy = g.shape[2] if g.ndim > 2 else 1
+		self.ncell = self.nsamp * self.nvar * self.ploidy
+		del g
+
+	def add(self, group, name, t, amount, unit, **kw):
+		r = { 'group': group, 'name': name, 'seconds': t }
+		if amount is not None:
+			r['rate'] = amount / t if t > 0 else None
+			r['unit'] = unit
+		r.update(kw)
+		self.results.append(r)
+		rate = '' if amount is None else ', %.4g %s' % (r['rate'], unit)
+		extra = ''.join(', %s=%s' % (k, v) for k, v in sorted(kw.items()))
+		print('%-10s %-28s %10.4fs%s%s' % (group, name, t, rate, extra))
+		sys.stdout.flush()
+
+	def get_data(self):
+		f = self.f
+		for nm in ('genotype', '$dosage', '$genotype_packed'):
+			for nt in sorted(set([ 1, ps.seqNumThread() ])):
+				t = best_time(lambda: f.GetData(nm, nthread=nt), self.repeat)
+				self.add('get_data', nm, t, self.ncell, 'genotype/s', nthread=nt)
+
+	def apply(self):
+		f = self.f
+		for bsize in (64, 256, 1024, 4096, 16384):
+			for nm in ('genotype', '$dosage'):
+				t = best_time(lambda: f.Apply(nm, _apply_nop, bsize=bsize),
+					self.repeat)
+				self.add('apply', nm, t, self.ncell, 'genotype/s', bsize=bsize)
+
+	def filter(self):
+		f = self.f
+		rs = np.random.RandomState(1000)
+		sid = f.GetData('sample.id')
+		vid = f.GetData('variant.id')
+		chrom = f.GetData('chromosome')
+		pos = f.GetData('position')
+		s_id = sid[np.sort(rs.choice(len(sid), len(sid)//2, replace=False))]
+		v_id = vid[np.sort(rs.choice(len(vid), len(vid)//2, replace=False))]
+		s_flag = rs.rand(len(sid)) < 0.5
+		v_flag = rs.rand(len(vid)) < 0.5
+		c = chrom[0] if len(chrom) > 0 else '1'
+		lo, hi = (int(pos.min()), int(pos.max())) if len(pos) > 0 else (1, 1)
+		mid = (lo + hi) // 2
+		st = np.sort(rs.randint(lo, hi + 1, 1000))
+		ed = st + rs.randint(0, max((hi - lo) // 2000, 1), 1000)
+
+		lst = [
+			('FilterSet(sample_id)', lambda: f.FilterSet(sample_id=s_id, verbose=False)),
+			('FilterSet(variant_id)', lambda: f.FilterSet(variant_id=v_id, verbose=False)),
+			('FilterSet2(sample)', lambda: f.FilterSet2(sample=s_flag, verbose=False)),
+			('FilterSet2(variant)', lambda: f.FilterSet2(variant=v_flag, verbose=False)),
+			('FilterSetRange', lambda: f.FilterSetRange(c, lo, mid, verbose=False)),
+			('FilterSetRegions(1000)', lambda: f.FilterSetRegions(
+				np.repeat(c, len(st)), st, ed, verbose=False)),
+			('FilterReset', lambda: f.FilterReset(verbose=False)) ]
+		for nm, fun in lst:
+			t = best_time(fun, self.repeat)
+			self.add('filter', nm, t, None, None)
+			f.FilterReset(verbose=False)
+
+	def nthread(self, max_cpu):
+		f = self.f
+		lst = [ 1 << i for i in range(max_cpu.bit_length()) ]
+		if lst[-1] != max_cpu: lst.append(max_cpu)
+		red = [ 'variant.dosage_sum', 'variant.nonmiss', 'sample.dosage_sum' ]
+		fun = [
+			('GetData(genotype)', lambda nt: f.GetData('genotype', nthread=nt)),
+			('AlleleFreq', lambda nt: f.AlleleFreq(nthread=nt)),
+			('Reduce', lambda nt: f.Reduce(red, nthread=nt)) ]
+		for nm, fc in fun:
+			t1 = None
+			for nt in lst:
+				t = best_time(lambda: fc(nt), self.repeat)
+				kw = { 'nthread': nt }
+				if t1 is None:
+					t1 = t
+					if cc.stats()['enabled']:
+						# the share of time in the GDS reads with 1 thread
+						cc.stats_reset()
+						t0 = time.time()
+						fc(nt)
+						tm = time.time() - t0
+						kw['read_share'] = round(
+							cc.stats()['geno_read']['ns'] * 1e-9 / tm, 3)
+				kw['speedup'] = round(t1 / t, 2)
+				self.add('nthread', nm, t, self.ncell, 'genotype/s', **kw)
+
+	def parallel(self, max_cpu):
+		f = self.f
+		# 1, 2, 4, ..., max_cpu
+		lst = [ 1 << i for i in range(max_cpu.bit_length()) ]
+		if lst[-1] != max_cpu: lst.append(max_cpu)
+		for ncpu in lst:
+			for be in ('processes', 'threads'):
+				t = best_time(lambda: f.RunParallel(_par_dosage, ncpu=ncpu,
+					backend=be), self.repeat)
+				self.add('parallel', '$dosage', t, self.ncell, 'genotype/s',
+					ncpu=ncpu, backend=be)
+
+	def json(self):
+		return {
+			'version': ps.__version__,
+			'python': platform.python_version(),
+			'numpy': np.__version__,
+			'platform': platform.platform(),
+			'machine': platform.machine(),
+			'cpu_count': mp.cpu_count(),
+			'time': time.strftime('%Y-%m-%dT%H:%M:%S'),
+			'file': os.path.abspath(self.fn),
+			'file_size': os.path.getsize(self.fn),
+			'num_sample': self.nsamp,
+			'num_variant': self.nvar,
+			'ploidy': self.ploidy,
+			'repeat': self.repeat,
+			'results': self.results }
+
+
+if __name__ == '__main__':
+	ap = argparse.ArgumentParser(description='PySeqArray throughput benchmark.')
+	ap.add_argument('file', nargs='?', default=None,
+		help='the GDS file (the bundled 1KG chr22 file by default)')
+	ap.add_argument('-o', '--output', default='bench_throughput.json',
+		help='the output JSON file')
+	ap.add_argument('-r', '--repeat', type=int, default=3)
+	ap.add_argument('-n', '--max_cpu', type=int, default=mp.cpu_count())
+	ap.add_argument('--skip', default='',
+		help="comma-separated groups to skip: get_data, apply, filter, nthread, parallel")
+	a = ap.parse_args()
+
+	fn = a.file if a.file else ps.seqExample('1KG_phase1_release_v3_chr22.gds')
+	skip = set(s for s in a.skip.split(',') if s)
+	b = Bench(fn, a.repeat)
+	print('# %s: %d samples, %d variants, ploidy %d' % (fn, b.nsamp, b.nvar,
+		b.ploidy))
+	if 'get_data' not in skip: b.get_data()
+	if 'apply' not in skip: b.apply()
+	if 'filter' not in skip: b.filter()
+	if 'nthread' not in skip: b.nthread(max(a.max_cpu, 1))
+	if 'parallel' not in skip: b.parallel(max(a.max_cpu, 1))
+	b.f.close()
+
+	with open(a.output, 'w') as fout:
+		json.dump(b.json(), fout, indent=1)
+	print('# saved to %s' % a.output)
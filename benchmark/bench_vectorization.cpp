@@ -0,0 +1,811 @@
+// ===========================================================
+//
+// bench_vectorization.cpp: microbenchmark for the kernels in vectorization.c
+//
+// Copyright (C) 2017    Xiuwen Zheng
+//
+// This file is part of PySeqArray.
+//
+// PySeqArray is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License Version 3 as
+// published by the Free Software Foundation.
+//
+// PySeqArray is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with PySeqArray.
+// If not, see <http://www.gnu.org/licenses/>.
+
+// Usage: bench_vectorization [--check] [--quick]
+//
+// Every kernel is first compared with a naive implementation over all
+// alignments and short lengths (SIMD headers and tails), and then timed on
+// aligned and misaligned inputs from L1 up to DRAM sizes, for each SIMD level
+// of runtime dispatch supported by the CPU. The throughput is the number of
+// bytes read and written per second.
+
+#include "vectorization.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <chrono>
+
+
+// =====================================================================
+// Buffers and random numbers
+
+/// a buffer of n elements starting at 'offset' bytes past a 64-byte boundary
+template<typename TYPE> class CBuffer
+{
+public:
+	void Reset(size_t n, size_t offset)
+	{
+		buf.assign(n*sizeof(TYPE) + offset + 128, 0);
+		size_t r = (size_t)&buf[0] & 63;
+		ptr = (TYPE*)(&buf[0] + (r ? (64 - r) : 0) + offset);
+	}
+	inline TYPE *get() { return ptr; }
+	inline TYPE &operator[] (size_t i) { return ptr[i]; }
+private:
+	std::vector<uint8_t> buf;
+	TYPE *ptr;
+};
+
+static uint64_t RandState = 0x9E3779B97F4A7C15ULL;
+
+/// xorshift64*
+inline static uint32_t Rand()
+{
+	RandState ^= RandState >> 12;
+	RandState ^= RandState << 25;
+	RandState ^= RandState >> 27;
+	return (uint32_t)((RandState * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+/// genotype-like values: -1 (missing), 0, 1, 2
+inline static int8_t RandGeno() { return (int8_t)(Rand() % 4) - 1; }
+
+
+
+// =====================================================================
+// Kernels
+
+/// the base class of a kernel to be checked and timed
+class CKernel
+{
+public:
+	virtual ~CKernel() { }
+	/// the name of kernel
+	virtual const char *Name() = 0;
+	/// whether the kernel has runtime dispatch
+	virtual bool Dispatch() { return true; }
+	/// the size of an input element, also the minimum alignment
+	virtual size_t ElmSize() { return 1; }
+	/// the number of bytes read and written in a call
+	virtual double Bytes(size_t n) = 0;
+	/// initialize n input elements starting at 'offset' bytes past 64 bytes
+	virtual void Init(size_t n, size_t offset) = 0;
+	/// run once and compare with the naive implementation
+	virtual bool Check() = 0;
+	/// run once for timing
+	virtual void Run() = 0;
+};
+
+/// the base class of kernels on an array of int8
+class CKernel_I8: public CKernel
+{
+protected:
+	CBuffer<int8_t> In;
+	size_t N;
+public:
+	virtual double Bytes(size_t n) { return n; }
+	virtual void Init(size_t n, size_t offset)
+	{
+		In.Reset(n, offset); N = n;
+		for (size_t i=0; i < n; i++) In[i] = RandGeno();
+	}
+};
+
+class CKernel_i8_cnt_nonzero: public CKernel_I8
+{
+public:
+	const char *Name() { return "vec_i8_cnt_nonzero"; }
+	bool Check()
+	{
+		size_t ans = 0;
+		for (size_t i=0; i < N; i++) ans += In[i] ? 1 : 0;
+		return vec_i8_cnt_nonzero(In.get(), N) == ans;
+	}
+	void Run() { vec_i8_cnt_nonzero(In.get(), N); }
+};
+
+class CKernel_i8_cnt_nonzero_ptr: public CKernel_I8
+{
+public:
+	const char *Name() { return "vec_i8_cnt_nonzero_ptr"; }
+	bool Dispatch() { return false; }
+	void Init(size_t n, size_t offset)
+	{
+		CKernel_I8::Init(n, offset);
+		memset(In.get(), 0, n/2);  // leading zeros
+	}
+	bool Check()
+	{
+		size_t i = 0, ans = 0;
+		for (; (i < N) && !In[i]; i++);
+		const int8_t *p = &In[i];
+		for (; i < N; i++) ans += In[i] ? 1 : 0;
+		size_t n = ~(size_t)0;
+		return (vec_i8_cnt_nonzero_ptr(In.get(), N, &n) == p) && (n == ans);
+	}
+	void Run() { size_t n; vec_i8_cnt_nonzero_ptr(In.get(), N, &n); }
+};
+
+class CKernel_i8_ptr_nonzero: public CKernel_I8
+{
+public:
+	const char *Name() { return "vec_i8_ptr_nonzero"; }
+	bool Dispatch() { return false; }
+	void Init(size_t n, size_t offset)
+	{
+		CKernel_I8::Init(n, offset);
+		memset(In.get(), 0, n);
+		if (n > 0) In[n - 1] = 1;
+	}
+	bool Check()
+	{
+		size_t i = 0;
+		for (; (i < N) && !In[i]; i++);
+		return vec_i8_ptr_nonzero((const char*)In.get(), N) ==
+			(const char*)&In[i];
+	}
+	void Run() { vec_i8_ptr_nonzero((const char*)In.get(), N); }
+};
+
+class CKernel_i8_count: public CKernel_I8
+{
+public:
+	const char *Name() { return "vec_i8_count"; }
+	bool Check()
+	{
+		size_t ans = 0;
+		for (size_t i=0; i < N; i++) ans += (In[i] == 1) ? 1 : 0;
+		return vec_i8_count((const char*)In.get(), N, 1) == ans;
+	}
+	void Run() { vec_i8_count((const char*)In.get(), N, 1); }
+};
+
+class CKernel_i8_count2: public CKernel_I8
+{
+public:
+	const char *Name() { return "vec_i8_count2"; }
+	bool Check()
+	{
+		size_t a1=0, a2=0, n1=1, n2=1;
+		for (size_t i=0; i < N; i++)
+			{ a1 += (In[i] == 0); a2 += (In[i] == -1); }
+		vec_i8_count2((const char*)In.get(), N, 0, -1, &n1, &n2);
+		return (n1 == a1) && (n2 == a2);
+	}
+	void Run()
+	{
+		size_t n1, n2;
+		vec_i8_count2((const char*)In.get(), N, 0, -1, &n1, &n2);
+	}
+};
+
+class CKernel_i8_count3: public CKernel_I8
+{
+public:
+	const char *Name() { return "vec_i8_count3"; }
+	bool Check()
+	{
+		size_t a1=0, a2=0, a3=0, n1=1, n2=1, n3=1;
+		for (size_t i=0; i < N; i++)
+			{ a1 += (In[i] == 0); a2 += (In[i] == 1); a3 += (In[i] == -1); }
+		vec_i8_count3((const char*)In.get(), N, 0, 1, -1, &n1, &n2, &n3);
+		return (n1 == a1) && (n2 == a2) && (n3 == a3);
+	}
+	void Run()
+	{
+		size_t n1, n2, n3;
+		vec_i8_count3((const char*)In.get(), N, 0, 1, -1, &n1, &n2, &n3);
+	}
+};
+
+class CKernel_i8_replace: public CKernel_I8
+{
+protected:
+	bool Flip;
+public:
+	const char *Name() { return "vec_i8_replace"; }
+	double Bytes(size_t n) { return 2.0*n; }
+	bool Check()
+	{
+		std::vector<int8_t> a(In.get(), In.get() + N);
+		vec_i8_replace(In.get(), N, -1, 3);
+		for (size_t i=0; i < N; i++)
+			if (In[i] != ((a[i] == -1) ? 3 : a[i])) return false;
+		Flip = true;
+		return true;
+	}
+	// swap -1 and 3 back and forth to keep the matches in the input
+	void Run()
+	{
+		if (Flip)
+			vec_i8_replace(In.get(), N, 3, -1);
+		else
+			vec_i8_replace(In.get(), N, -1, 3);
+		Flip = !Flip;
+	}
+};
+
+class CKernel_i8_cnt_dosage2: public CKernel
+{
+protected:
+	CBuffer<int8_t> In, Out;
+	size_t N;
+public:
+	const char *Name() { return "vec_i8_cnt_dosage2"; }
+	double Bytes(size_t n) { return 3.0*n; }
+	void Init(size_t n, size_t offset)
+	{
+		In.Reset(2*n, offset); Out.Reset(n, offset); N = n;
+		for (size_t i=0; i < 2*n; i++) In[i] = RandGeno();
+	}
+	bool Check()
+	{
+		vec_i8_cnt_dosage2(In.get(), Out.get(), N, 0, -1, 9);
+		for (size_t i=0; i < N; i++)
+		{
+			int8_t a = In[2*i], b = In[2*i+1];
+			int8_t v = ((a == -1) || (b == -1)) ? 9 : (a == 0) + (b == 0);
+			if (Out[i] != v) return false;
+		}
+		return true;
+	}
+	void Run() { vec_i8_cnt_dosage2(In.get(), Out.get(), N, 0, -1, 9); }
+};
+
+class CKernel_i8_cnt_dosage2_i32: public CKernel
+{
+protected:
+	CBuffer<int8_t> In;
+	CBuffer<int32_t> Out;
+	size_t N;
+public:
+	const char *Name() { return "vec_i8_cnt_dosage2_i32"; }
+	bool Dispatch() { return false; }
+	double Bytes(size_t n) { return 6.0*n; }
+	void Init(size_t n, size_t offset)
+	{
+		In.Reset(2*n, offset); Out.Reset(n, 0); N = n;
+		for (size_t i=0; i < 2*n; i++) In[i] = RandGeno();
+	}
+	bool Check()
+	{
+		vec_i8_cnt_dosage2_i32(In.get(), Out.get(), N, 0, -1, -9);
+		for (size_t i=0; i < N; i++)
+		{
+			int8_t a = In[2*i], b = In[2*i+1];
+			int32_t v = ((a == -1) || (b == -1)) ? -9 : (a == 0) + (b == 0);
+			if (Out[i] != v) return false;
+		}
+		return true;
+	}
+	void Run() { vec_i8_cnt_dosage2_i32(In.get(), Out.get(), N, 0, -1, -9); }
+};
+
+class CKernel_u8_shr_b2: public CKernel_I8
+{
+public:
+	const char *Name() { return "vec_u8_shr_b2"; }
+	double Bytes(size_t n) { return 2.0*n; }
+	bool Check()
+	{
+		for (size_t i=0; i < N; i++) In[i] = (int8_t)Rand();
+		std::vector<uint8_t> a((uint8_t*)In.get(), (uint8_t*)In.get() + N);
+		vec_u8_shr_b2((uint8_t*)In.get(), N);
+		for (size_t i=0; i < N; i++)
+			if ((uint8_t)In[i] != (a[i] >> 2)) return false;
+		return true;
+	}
+	void Run() { vec_u8_shr_b2((uint8_t*)In.get(), N); }
+};
+
+class CKernel_u8_pack_b2: public CKernel
+{
+protected:
+	CBuffer<uint8_t> In, Out;
+	size_t N;
+public:
+	const char *Name() { return "vec_u8_pack_b2"; }
+	bool Dispatch() { return false; }
+	double Bytes(size_t n) { return n + (n + 3) / 4; }
+	void Init(size_t n, size_t offset)
+	{
+		In.Reset(n, offset); Out.Reset((n + 3)/4, offset); N = n;
+		for (size_t i=0; i < n; i++) In[i] = Rand() % 5;
+	}
+	bool Check()
+	{
+		vec_u8_pack_b2(In.get(), N, Out.get());
+		for (size_t i=0; i < N; i++)
+		{
+			uint8_t v = (Out[i/4] >> (2*(i%4))) & 0x03;
+			if (v != ((In[i] < 3) ? In[i] : 3)) return false;
+		}
+		return true;
+	}
+	void Run() { vec_u8_pack_b2(In.get(), N, Out.get()); }
+};
+
+class CKernel_u8_pack_bool: public CKernel
+{
+protected:
+	CBuffer<uint8_t> In;
+	CBuffer<uint64_t> Out;
+	size_t N;
+public:
+	const char *Name() { return "vec_u8_pack_bool"; }
+	bool Dispatch() { return false; }
+	double Bytes(size_t n) { return n + n / 8.0; }
+	void Init(size_t n, size_t offset)
+	{
+		In.Reset(n, offset); Out.Reset((n + 63)/64, 0); N = n;
+		for (size_t i=0; i < n; i++) In[i] = (Rand() % 3) ? 1 : 0;
+	}
+	bool Check()
+	{
+		size_t cnt = vec_u8_pack_bool(In.get(), N, Out.get()), ans = 0;
+		for (size_t i=0; i < N; i++)
+		{
+			bool b = (Out[i/64] >> (i%64)) & 0x01;
+			if (b != (In[i] != 0)) return false;
+			ans += b;
+		}
+		return cnt == ans;
+	}
+	void Run() { vec_u8_pack_bool(In.get(), N, Out.get()); }
+};
+
+class CKernel_u8_unpack_bool: public CKernel
+{
+protected:
+	CBuffer<uint64_t> In;
+	CBuffer<uint8_t> Out;
+	size_t N;
+public:
+	const char *Name() { return "vec_u8_unpack_bool"; }
+	bool Dispatch() { return false; }
+	double Bytes(size_t n) { return n + n / 8.0; }
+	void Init(size_t n, size_t offset)
+	{
+		In.Reset((n + 63)/64, 0); Out.Reset(n, offset); N = n;
+		for (size_t i=0; i < (n + 63)/64; i++)
+		{
+			// mix all-zero, all-one and random words
+			switch (Rand() % 4)
+			{
+				case 0:  In[i] = 0; break;
+				case 1:  In[i] = ~(uint64_t)0; break;
+				default: In[i] = ((uint64_t)Rand() << 32) | Rand();
+			}
+		}
+	}
+	bool Check()
+	{
+		vec_u8_unpack_bool(In.get(), N, Out.get());
+		for (size_t i=0; i < N; i++)
+			if (Out[i] != ((In[i/64] >> (i%64)) & 0x01)) return false;
+		return true;
+	}
+	void Run() { vec_u8_unpack_bool(In.get(), N, Out.get()); }
+};
+
+class CKernel_u8_nonzero_index: public CKernel
+{
+protected:
+	CBuffer<uint8_t> In;
+	CBuffer<int32_t> Out;
+	size_t N, Cnt;
+public:
+	const char *Name() { return "vec_u8_nonzero_index"; }
+	bool Dispatch() { return false; }
+	double Bytes(size_t n) { return 2.0*n; }  // n bytes, ~n/4 indices
+	void Init(size_t n, size_t offset)
+	{
+		In.Reset(n, offset); Out.Reset(n, 0); N = n;
+		for (size_t i=0; i < n; i++) In[i] = (Rand() % 4) ? 0 : 1;
+	}
+	bool Check()
+	{
+		size_t cnt = vec_u8_nonzero_index(In.get(), N, Out.get()), k = 0;
+		for (size_t i=0; i < N; i++)
+			if (In[i] && ((k >= cnt) || (Out[k++] != (int32_t)i))) return false;
+		return k == cnt;
+	}
+	void Run() { vec_u8_nonzero_index(In.get(), N, Out.get()); }
+};
+
+class CKernel_u8_gather: public CKernel
+{
+protected:
+	CBuffer<uint8_t> In, Out;
+	CBuffer<int32_t> Idx;
+	size_t N;
+public:
+	const char *Name() { return "vec_u8_gather"; }
+	double Bytes(size_t n) { return 6.0*n; }
+	// one of every four entries is selected
+	void Init(size_t n, size_t offset)
+	{
+		In.Reset(4*n + 3, offset); Out.Reset(n, offset); Idx.Reset(n, 0);
+		N = n;
+		for (size_t i=0; i < 4*n; i++) In[i] = Rand();
+		for (size_t i=0; i < n; i++) Idx[i] = 4*i + Rand() % 4;
+	}
+	bool Check()
+	{
+		vec_u8_gather(In.get(), Idx.get(), N, Out.get());
+		for (size_t i=0; i < N; i++)
+			if (Out[i] != In[Idx[i]]) return false;
+		return true;
+	}
+	void Run() { vec_u8_gather(In.get(), Idx.get(), N, Out.get()); }
+};
+
+class CKernel_i16_shr_b2: public CKernel
+{
+protected:
+	CBuffer<int16_t> In;
+	size_t N;
+public:
+	const char *Name() { return "vec_i16_shr_b2"; }
+	size_t ElmSize() { return 2; }
+	double Bytes(size_t n) { return 4.0*n; }
+	void Init(size_t n, size_t offset)
+	{
+		In.Reset(n, offset); N = n;
+		for (size_t i=0; i < n; i++) In[i] = Rand() & 0x7FFF;
+	}
+	bool Check()
+	{
+		std::vector<int16_t> a(In.get(), In.get() + N);
+		vec_i16_shr_b2(In.get(), N);
+		for (size_t i=0; i < N; i++)
+			if (In[i] != (a[i] >> 2)) return false;
+		return true;
+	}
+	void Run() { vec_i16_shr_b2(In.get(), N); }
+};
+
+/// the base class of kernels on an array of int32
+class CKernel_I32: public CKernel
+{
+protected:
+	CBuffer<int32_t> In;
+	size_t N;
+public:
+	size_t ElmSize() { return 4; }
+	virtual double Bytes(size_t n) { return 4.0*n; }
+	virtual void Init(size_t n, size_t offset)
+	{
+		In.Reset(n, offset); N = n;
+		for (size_t i=0; i < n; i++) In[i] = RandGeno();
+	}
+};
+
+class CKernel_i32_count: public CKernel_I32
+{
+public:
+	const char *Name() { return "vec_i32_count"; }
+	bool Check()
+	{
+		size_t ans = 0;
+		for (size_t i=0; i < N; i++) ans += (In[i] == 1) ? 1 : 0;
+		return vec_i32_count(In.get(), N, 1) == ans;
+	}
+	void Run() { vec_i32_count(In.get(), N, 1); }
+};
+
+class CKernel_i32_count2: public CKernel_I32
+{
+public:
+	const char *Name() { return "vec_i32_count2"; }
+	bool Check()
+	{
+		size_t a1=0, a2=0, n1=1, n2=1;
+		for (size_t i=0; i < N; i++)
+			{ a1 += (In[i] == 0); a2 += (In[i] == -1); }
+		vec_i32_count2(In.get(), N, 0, -1, &n1, &n2);
+		return (n1 == a1) && (n2 == a2);
+	}
+	void Run()
+	{
+		size_t n1, n2;
+		vec_i32_count2(In.get(), N, 0, -1, &n1, &n2);
+	}
+};
+
+class CKernel_i32_count3: public CKernel_I32
+{
+public:
+	const char *Name() { return "vec_i32_count3"; }
+	bool Check()
+	{
+		size_t a1=0, a2=0, a3=0, n1=1, n2=1, n3=1;
+		for (size_t i=0; i < N; i++)
+			{ a1 += (In[i] == 0); a2 += (In[i] == 1); a3 += (In[i] == -1); }
+		vec_i32_count3(In.get(), N, 0, 1, -1, &n1, &n2, &n3);
+		return (n1 == a1) && (n2 == a2) && (n3 == a3);
+	}
+	void Run()
+	{
+		size_t n1, n2, n3;
+		vec_i32_count3(In.get(), N, 0, 1, -1, &n1, &n2, &n3);
+	}
+};
+
+class CKernel_int32_set: public CKernel_I32
+{
+public:
+	const char *Name() { return "vec_int32_set"; }
+	bool Dispatch() { return false; }
+	bool Check()
+	{
+		vec_int32_set(In.get(), N, 7);
+		for (size_t i=0; i < N; i++)
+			if (In[i] != 7) return false;
+		return true;
+	}
+	void Run() { vec_int32_set(In.get(), N, 7); }
+};
+
+class CKernel_i32_replace: public CKernel_I32
+{
+protected:
+	bool Flip;
+public:
+	const char *Name() { return "vec_i32_replace"; }
+	double Bytes(size_t n) { return 8.0*n; }
+	bool Check()
+	{
+		std::vector<int32_t> a(In.get(), In.get() + N);
+		vec_i32_replace(In.get(), N, -1, 3);
+		for (size_t i=0; i < N; i++)
+			if (In[i] != ((a[i] == -1) ? 3 : a[i])) return false;
+		Flip = true;
+		return true;
+	}
+	// swap -1 and 3 back and forth to keep the matches in the input
+	void Run()
+	{
+		if (Flip)
+			vec_i32_replace(In.get(), N, 3, -1);
+		else
+			vec_i32_replace(In.get(), N, -1, 3);
+		Flip = !Flip;
+	}
+};
+
+class CKernel_i32_cnt_dosage2: public CKernel
+{
+protected:
+	CBuffer<int32_t> In, Out;
+	size_t N;
+public:
+	const char *Name() { return "vec_i32_cnt_dosage2"; }
+	size_t ElmSize() { return 4; }
+	double Bytes(size_t n) { return 12.0*n; }
+	void Init(size_t n, size_t offset)
+	{
+		In.Reset(2*n, offset); Out.Reset(n, offset); N = n;
+		for (size_t i=0; i < 2*n; i++) In[i] = RandGeno();
+	}
+	bool Check()
+	{
+		vec_i32_cnt_dosage2(In.get(), Out.get(), N, 0, -1, -9);
+		for (size_t i=0; i < N; i++)
+		{
+			int32_t a = In[2*i], b = In[2*i+1];
+			int32_t v = ((a == -1) || (b == -1)) ? -9 : (a == 0) + (b == 0);
+			if (Out[i] != v) return false;
+		}
+		return true;
+	}
+	void Run() { vec_i32_cnt_dosage2(In.get(), Out.get(), N, 0, -1, -9); }
+};
+
+class CKernel_i32_shr_b2: public CKernel_I32
+{
+public:
+	const char *Name() { return "vec_i32_shr_b2"; }
+	double Bytes(size_t n) { return 8.0*n; }
+	bool Check()
+	{
+		for (size_t i=0; i < N; i++) In[i] = Rand() & 0x7FFFFFFF;
+		std::vector<int32_t> a(In.get(), In.get() + N);
+		vec_i32_shr_b2(In.get(), N);
+		for (size_t i=0; i < N; i++)
+			if (In[i] != (a[i] >> 2)) return false;
+		return true;
+	}
+	void Run() { vec_i32_shr_b2(In.get(), N); }
+};
+
+class CKernel_char_find_CRLF: public CKernel
+{
+protected:
+	CBuffer<char> In;
+	size_t N;
+public:
+	const char *Name() { return "vec_char_find_CRLF"; }
+	bool Dispatch() { return false; }
+	double Bytes(size_t n) { return n; }
+	// a long line with '\r' or '\n' at the end
+	void Init(size_t n, size_t offset)
+	{
+		In.Reset(n, offset); N = n;
+		for (size_t i=0; i < n; i++) In[i] = 'A' + Rand() % 26;
+		if (n > 0) In[n - 1] = (Rand() & 1) ? '\r' : '\n';
+	}
+	bool Check()
+	{
+		size_t i = 0;
+		for (; (i < N) && (In[i] != '\r') && (In[i] != '\n'); i++);
+		return vec_char_find_CRLF(In.get(), N) == &In[i];
+	}
+	void Run() { vec_char_find_CRLF(In.get(), N); }
+};
+
+
+
+// =====================================================================
+// Checking and timing
+
+static const char *LEVEL_NAME[] = { "default", "AVX2", "AVX512BW" };
+
+/// compare with the naive implementation over all alignments, and the lengths
+/// around the widths of SIMD headers, bodies and tails
+static bool CheckKernel(CKernel &k, const char *level)
+{
+	static const size_t LEN[] = { 127, 128, 129, 255, 256, 257, 1000, 4099,
+		70001 };
+	bool ok = true;
+	for (size_t off=0; ok && (off < 64); off += k.ElmSize())
+	{
+		for (size_t n=0; ok && (n < 80); n++)
+		{
+			k.Init(n, off);
+			if (!k.Check())
+			{
+				printf("FAILED: %s [%s], n = %d, offset = %d\n", k.Name(), level,
+					(int)n, (int)off);
+				ok = false;
+			}
+		}
+		for (size_t i=0; ok && (i < sizeof(LEN)/sizeof(size_t)); i++)
+		{
+			k.Init(LEN[i], off);
+			if (!k.Check())
+			{
+				printf("FAILED: %s [%s], n = %d, offset = %d\n", k.Name(), level,
+					(int)LEN[i], (int)off);
+				ok = false;
+			}
+		}
+	}
+	return ok;
+}
+
+/// return the best time of a call in seconds over 5 batches of at least 10ms
+static double TimeKernel(CKernel &k)
+{
+	typedef std::chrono::steady_clock clock;
+	size_t rep = 1;
+	double best = 1e30;
+	for (int b=0; b < 5; )
+	{
+		clock::time_point t0 = clock::now();
+		for (size_t i=0; i < rep; i++) k.Run();
+		double dt = std::chrono::duration<double>(clock::now() - t0).count();
+		if (dt < 0.01)
+		{
+			rep *= 2;  // calibrate the batch size
+		} else {
+			if (dt / rep < best) best = dt / rep;
+			b ++;
+		}
+	}
+	return best;
+}
+
+
+int main(int argc, char *argv[])
+{
+	bool check_only = false, quick = false;
+	for (int i=1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--check") == 0)
+			check_only = true;
+		else if (strcmp(argv[i], "--quick") == 0)
+			quick = true;
+		else {
+			printf("Usage: %s [--check] [--quick]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	// input sizes from L1 up to DRAM
+	static const size_t SIZE[] = { 16 << 10, 256 << 10, 4 << 20, 64 << 20 };
+	static const char *SIZE_NAME[] = { "16K", "256K", "4M", "64M" };
+	const size_t n_size = quick ? 2 : 4;
+
+	CKernel *kernels[] = {
+		new CKernel_i8_cnt_nonzero, new CKernel_i8_cnt_nonzero_ptr,
+		new CKernel_i8_ptr_nonzero, new CKernel_i8_count,
+		new CKernel_i8_count2, new CKernel_i8_count3, new CKernel_i8_replace,
+		new CKernel_i8_cnt_dosage2, new CKernel_i8_cnt_dosage2_i32,
+		new CKernel_u8_shr_b2, new CKernel_u8_pack_b2,
+		new CKernel_u8_pack_bool, new CKernel_u8_unpack_bool,
+		new CKernel_u8_nonzero_index, new CKernel_u8_gather,
+		new CKernel_i16_shr_b2, new CKernel_i32_count,
+		new CKernel_i32_count2, new CKernel_i32_count3,
+		new CKernel_int32_set, new CKernel_i32_replace,
+		new CKernel_i32_cnt_dosage2, new CKernel_i32_shr_b2,
+		new CKernel_char_find_CRLF
+	};
+	const size_t n_kernel = sizeof(kernels) / sizeof(CKernel*);
+
+	int n_fail = 0;
+	if (!check_only)
+		printf("%-24s %-9s %6s %-9s %10s\n", "kernel", "level", "size",
+			"align", "GB/s");
+
+	for (int level=VEC_SIMD_DEFAULT; level <= VEC_SIMD_AVX512BW; level++)
+	{
+		if (vec_simd_select(level) != level) continue;
+		const char *lv = (level == VEC_SIMD_DEFAULT) ? vec_simd_name() :
+			LEVEL_NAME[level];
+		for (size_t i=0; i < n_kernel; i++)
+		{
+			CKernel &k = *kernels[i];
+			// the kernels without dispatch are the same at all levels
+			if ((level > VEC_SIMD_DEFAULT) && !k.Dispatch()) continue;
+			if (!CheckKernel(k, lv))
+			{
+				n_fail ++;
+				continue;
+			}
+			if (check_only) continue;
+
+			for (size_t j=0; j < n_size; j++)
+			{
+				// aligned, and misaligned with an odd tail
+				for (int mis=0; mis < 2; mis++)
+				{
+					size_t n = SIZE[j] / k.ElmSize();
+					size_t off = mis ? k.ElmSize() : 0;
+					if (mis) n -= 3;
+					k.Init(n, off);
+					k.Check();
+					double t = TimeKernel(k);
+					printf("%-24s %-9s %6s %-9s %10.2f\n", k.Name(), lv,
+						SIZE_NAME[j], mis ? "unaligned" : "aligned",
+						k.Bytes(n) / t * 1e-9);
+					fflush(stdout);
+				}
+			}
+		}
+	}
+	vec_simd_select(-1);
+
+	for (size_t i=0; i < n_kernel; i++) delete kernels[i];
+	if (check_only || n_fail)
+		printf("%d kernel(s) failed\n", n_fail);
+	return n_fail ? 1 : 0;
+}
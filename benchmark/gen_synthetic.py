@@ -0,0 +1,125 @@
+# ===========================================================================
+#
+# gen_synthetic.py: scale up a SeqArray file for benchmarking
+#
+# Copyright (C) 2017    Xiuwen Zheng
+#
+# This file is part of PySeqArray.
+#
+# PySeqArray is free software: you can redistribute it and/or modify it
+# under the terms of the GNU General Public License Version 3 as
+# published by the Free Software Foundation.
+#
+# PySeqArray is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with PySeqArray.
+# If not, see <http://www.gnu.org/licenses/>.
+
+"""Create a larger SeqArray file by replicating samples and variants
+
+Usage: python gen_synthetic.py [-s sample_rep] [-v variant_rep]
+	[-c compress] [-i src.gds] out.gds
+
+The samples are replicated 'sample_rep' times with the suffix '.k' added to
+the sample IDs, and the variants 'variant_rep' times with the positions
+shifted past the previous copy, so the positions stay sorted. Only the
+variables used by the benchmarks are written: sample.id, variant.id,
+position, chromosome, allele, genotype and annotation/id, annotation/qual.
+The genotypes of a variant copy are appended one by one, so the memory
+usage is that of the source genotypes times 'sample_rep'.
+"""
+
+import argparse
+import numpy as np
+import pygds
+import PySeqArray as ps
+
+
+def _tile_id(v, rep):
+	return np.array([ s if k == 0 else '%s.%d' % (s, k)
+		for k in range(rep) for s in v ])
+
+
+def generate(src_fn, out_fn, sample_rep=2, variant_rep=2, compress='LZMA_RA',
+		verbose=True):
+	src = pygds.gdsfile()
+	src.open(src_fn, allow_dup=True)
+	dst = pygds.gdsfile()
+	dst.create(out_fn)
+	try:
+		root = dst.root()
+		root.put_attr('FileFormat', 'SEQ_ARRAY')
+		root.put_attr('FileVersion', 'v1.0')
+
+		# samples
+		sid = src.index('sample.id').read()
+		root.add_gdsn('sample.id', _tile_id(sid, sample_rep), storage='string',
+			compress=compress)
+
+		# variants
+		nvar = len(src.index('variant.id').read())
+		root.add_gdsn('variant.id', np.arange(1, nvar*variant_rep + 1,
+			dtype=np.int32), storage='int32', compress=compress)
+		pos = src.index('position').read().astype(np.int64)
+		shift = int(pos.max()) if len(pos) > 0 else 0
+		pos = np.hstack([ pos + k*shift for k in range(variant_rep) ])
+		if pos.max() > np.iinfo(np.int32).max:
+			raise ValueError('Too many variant copies for 32-bit positions.')
+		root.add_gdsn('position', pos.astype(np.int32), storage='int32',
+			compress=compress)
+		for nm in ('chromosome', 'allele'):
+			v = src.index(nm).read()
+			root.add_gdsn(nm, np.tile(v, variant_rep), storage='string',
+				compress=compress)
+
+		# genotypes, [# of bit layers, # of samples, ploidy] with 2 bits per entry
+		g = src.index('genotype/data').read()
+		if sample_rep > 1:
+			g = np.concatenate([ g ] * sample_rep, axis=1)
+		fd = root.addfolder('genotype')
+		fd.put_attr('VariableName', 'GT')
+		fd.put_attr('Description', 'Genotype')
+		# keep the compressed stream open for appending
+		nd = fd.add_gdsn('data', g, storage='bit2', compress=compress,
+			closezip=False)
+		for k in range(1, variant_rep):
+			if verbose:
+				print('genotype copy %d/%d' % (k + 1, variant_rep))
+			nd.append(g)
+		idx = src.index('genotype/@data').read()
+		fd.add_gdsn('@data', np.tile(idx, variant_rep), storage='uint8',
+			compress=compress, visible=False)
+		del g
+
+		# annotation
+		fd = root.addfolder('annotation')
+		fd.add_gdsn('id', np.tile(src.index('annotation/id').read(), variant_rep),
+			storage='string', compress=compress)
+		fd.add_gdsn('qual', np.tile(src.index('annotation/qual').read(),
+			variant_rep), storage='float32', compress=compress)
+		fd.addfolder('info')
+		fd.addfolder('format')
+
+		if verbose:
+			print('%s: %d samples, %d variants' % (out_fn,
+				len(sid)*sample_rep, nvar*variant_rep))
+	finally:
+		dst.close()
+		src.close()
+
+
+if __name__ == '__main__':
+	ap = argparse.ArgumentParser(description='Scale up a SeqArray file.')
+	ap.add_argument('out', help='the output GDS file')
+	ap.add_argument('-i', '--input', default=None,
+		help='the source GDS file (the bundled 1KG chr22 file by default)')
+	ap.add_argument('-s', '--sample_rep', type=int, default=2)
+	ap.add_argument('-v', '--variant_rep', type=int, default=2)
+	ap.add_argument('-c', '--compress', default='LZMA_RA')
+	a = ap.parse_args()
+	fn = a.input if a.input else ps.seqExample('1KG_phase1_release_v3_chr22.gds')
+	generate(fn, a.out, a.sample_rep, a.variant_rep, a.compress)
@@ -5,8 +5,17 @@ import pygds
 
 
 src_fnlst = [ os.path.join('src', fn) for fn in [
-	'GetData.cpp', 'Index.cpp', 'Methods.cpp', 'ReadByVariant.cpp',
-	'PySeqArray.cpp', 'LinkGDS.c', 'vectorization.c' ] ]
+	'GetData.cpp', 'Index.cpp', 'Methods.cpp', 'Parallel.cpp',
+	'ReadByVariant.cpp', 'PySeqArray.cpp', 'LinkGDS.c', 'vectorization.c',
+	'vectorization_avx2.c', 'vectorization_avx512bw.c' ] ]
+
+# multithreading
+thread_flags = [ ] if os.name == 'nt' else [ '-pthread' ]
+
+# performance counters in ccall.stats(), e.g., PYSEQARRAY_STATS=1 pip install .
+macro_list = [ ('USING_PYTHON', None) ]
+if os.environ.get('PYSEQARRAY_STATS', '') not in ('', '0'):
+	macro_list.append(('PYSEQARRAY_STATS', None))
 
 
 setup(name='PySeqArray',
@@ -21,7 +30,9 @@ setup(name='PySeqArray',
 	ext_modules = [ Extension('PySeqArray.ccall',
 		src_fnlst,
 		include_dirs = [ pygds.get_include(), numpy.get_include() ],
-		define_macros = [ ('USING_PYTHON', None) ],
+		define_macros = macro_list,
+		extra_compile_args = thread_flags,
+		extra_link_args = thread_flags,
 	) ],
 	package_data = {
 		'PySeqArray': [ 'data/*.gds' ]
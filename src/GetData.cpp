@@ -22,10 +22,313 @@
 #include "Index.h"
 #include "ReadByVariant.h"
 // #include "ReadBySample.h"
+#include "Parallel.h"
+#include <thread>
+#include <condition_variable>
+#include <memory>
 
 
 using namespace PySeqArray;
 
+
+// ===========================================================
+// Read blocks of genotypes with persistent readers
+// ===========================================================
+
+/// Reading genotypic variables block by block in SEQ_BApply_Variant
+/** Each variable has its own reader over all selected variants, which is
+ *  created once and advanced incrementally, so the readers do not depend on
+ *  the local block selection.
+**/
+class COREARRAY_DLL_LOCAL CApplyGenoBlock
+{
+public:
+	/// whether a variable can be read by block
+	static bool IsSupported(const string &name)
+	{
+		return (name=="genotype") || (name=="$dosage") || (name=="#dosage") ||
+			(name=="$genotype_packed") || (name=="#genotype_packed");
+	}
+
+	/// constructor, with the variable names all supported
+	CApplyGenoBlock(CFileInfo &File, const vector<string> &names,
+		bool gds_lock): Names(names)
+	{
+		for (size_t i=0; i < Names.size(); i++)
+		{
+			const string &s = Names[i];
+			CApply_Variant_Geno *p;
+			if (s=="genotype")
+			{
+				p = new CApply_Variant_Geno(File);
+				RowSize.push_back(p->SampNum * p->Ploidy);
+			} else if (s=="$dosage" || s=="#dosage")
+			{
+				p = new CApply_Variant_Dosage(File);
+				RowSize.push_back(p->SampNum);
+			} else {
+				CApply_Variant_GenoPacked *pk = new CApply_Variant_GenoPacked(File);
+				RowSize.push_back(pk->PackedSize);
+				p = pk;
+			}
+			p->GDSLock = gds_lock;
+			Reader.push_back(p);
+		}
+	}
+
+	/// the number of variables
+	inline size_t Count() const { return Names.size(); }
+
+	/// a new numpy array of the i-th variable for 'cnt' variants (GIL held)
+	PyObject *NewArray(size_t i, int cnt)
+	{
+		if (Names[i] == "genotype")
+		{
+			CApply_Variant_Geno *p = static_cast<CApply_Variant_Geno*>(Reader[i]);
+			return numpy_new_uint8_dim3(cnt, p->SampNum, p->Ploidy);
+		} else
+			return numpy_new_uint8_mat(cnt, RowSize[i]);
+	}
+
+	/// whether 'obj' is an array of the i-th variable for 'cnt' variants
+	bool Reusable(size_t i, PyObject *obj, int cnt)
+	{
+		return obj && numpy_is_uint8(obj) &&
+			(numpy_size(obj) == RowSize[i]*cnt);
+	}
+
+	/// read the next 'cnt' variants of the i-th variable, no Python API calls
+	void Read(size_t i, C_UInt8 *buf, int cnt)
+	{
+		const string &s = Names[i];
+		for (; cnt > 0; cnt--)
+		{
+			if (s=="genotype")
+				static_cast<CApply_Variant_Geno*>(Reader[i])->ReadGenoData(buf);
+			else if (s=="$dosage" || s=="#dosage")
+				static_cast<CApply_Variant_Dosage*>(Reader[i])->ReadDosage(buf);
+			else
+				static_cast<CApply_Variant_GenoPacked*>(Reader[i])->ReadGenoPacked(buf);
+			buf += RowSize[i];
+			Reader[i]->Next();
+		}
+	}
+
+private:
+	vector<string> Names;   ///< variable names
+	CVarApplyList Reader;   ///< readers of variables
+	vector<size_t> RowSize; ///< the number of bytes per variant
+};
+
+
+// ===========================================================
+// Decode blocks of genotypes ahead in a background thread
+// ===========================================================
+
+/// Decoding the next blocks of genotypes while the user function runs
+/** The numpy arrays are allocated by the calling thread with the GIL held,
+ *  and filled by a native thread without the GIL. Block idx uses the slot
+ *  idx % Depth.
+**/
+class COREARRAY_DLL_LOCAL CApplyPrefetch
+{
+public:
+	/// constructor, with the variable names all supported and 'depth' > 0
+	CApplyPrefetch(CFileInfo &File, const vector<string> &names, int bsize,
+		int nvariant, int depth): File(File), Block(File, names, true)
+	{
+		BlockSize = bsize; NumVariant = nvariant;
+		Depth = depth; ProdIdx = 0;
+		Stop = Failed = false;
+		Slot.resize(Depth);
+		for (int i=0; i < Depth; i++)
+		{
+			Slot[i].State = 0;
+			Slot[i].Data.resize(Block.Count(), NULL);
+		}
+		// the other accesses to the file lock GDS_Mutex until finished
+		File.BackgroundBegin();
+		try {
+			Thread = thread(&CApplyPrefetch::Run, this);
+		} catch (...) {
+			File.BackgroundEnd();
+			throw;
+		}
+	}
+
+	/// destructor, waiting for the background thread
+	~CApplyPrefetch()
+	{
+		{
+			lock_guard<mutex> lk(Mutex);
+			Stop = true;
+		}
+		CV.notify_all();
+		if (Thread.joinable())
+		{
+			PyThreadState *st = PyEval_SaveThread();
+			Thread.join();
+			PyEval_RestoreThread(st);
+			File.BackgroundEnd();
+		}
+		for (size_t i=0; i < Slot.size(); i++)
+		{
+			for (size_t j=0; j < Slot[i].Data.size(); j++)
+				Py_XDECREF(Slot[i].Data[j]);
+		}
+	}
+
+	/// allocate the arrays of block idx and queue it for decoding (GIL held)
+	void Post(int idx)
+	{
+		int st = idx * BlockSize;
+		if (st >= NumVariant) return;
+		int cnt = NumVariant - st;
+		if (cnt > BlockSize) cnt = BlockSize;
+		TSlot &S = Slot[idx % Depth];
+		for (size_t i=0; i < Block.Count(); i++)
+			S.Data[i] = Block.NewArray(i, cnt);
+		{
+			lock_guard<mutex> lk(Mutex);
+			S.Index = idx; S.Count = cnt;
+			S.State = 1;
+			for (size_t i=0; i < Block.Count(); i++)
+				S.Ptr.push_back((C_UInt8*)numpy_getptr(S.Data[i]));
+		}
+		CV.notify_all();
+	}
+
+	/// wait for block idx with the GIL released, and pass the arrays of the
+	/// i-th variable to the tuple 'args' at the position pos[i]
+	void Take(int idx, PyObject *args, const vector<int> &pos)
+	{
+		TSlot &S = Slot[idx % Depth];
+		PyThreadState *ts = PyEval_SaveThread();
+		{
+			unique_lock<mutex> lk(Mutex);
+			CV.wait(lk, [&]{ return Failed || (S.State==2 && S.Index==idx); });
+		}
+		PyEval_RestoreThread(ts);
+		if (Failed) throw ErrSeqArray(ErrMsg);
+		for (size_t i=0; i < S.Data.size(); i++)
+		{
+			PyTuple_SetItem(args, pos[i], S.Data[i]);
+			S.Data[i] = NULL;
+		}
+		lock_guard<mutex> lk(Mutex);
+		S.Ptr.clear();
+		S.State = 0;
+	}
+
+private:
+	struct TSlot
+	{
+		int State;  ///< 0: empty, 1: queued, 2: decoded
+		int Index;  ///< the block index
+		int Count;  ///< the number of variants in the block
+		vector<PyObject*> Data;  ///< numpy arrays
+		vector<C_UInt8*> Ptr;    ///< pointers to the numpy data
+	};
+
+	CFileInfo &File;        ///< the file
+	CApplyGenoBlock Block;  ///< readers of variables
+	int BlockSize;   ///< the number of variants per block
+	int NumVariant;  ///< the total number of selected variants
+	int Depth;       ///< the number of blocks decoded ahead
+	int ProdIdx;     ///< the next block index to be decoded
+	vector<TSlot> Slot;
+	bool Stop, Failed;
+	string ErrMsg;
+	mutex Mutex;
+	condition_variable CV;
+	thread Thread;
+
+	/// the background thread
+	void Run()
+	{
+		try {
+			while (true)
+			{
+				TSlot &S = Slot[ProdIdx % Depth];
+				{
+					unique_lock<mutex> lk(Mutex);
+					CV.wait(lk, [&]{ return Stop || (S.State==1 && S.Index==ProdIdx); });
+					if (Stop) return;
+				}
+				for (size_t i=0; i < Block.Count(); i++)
+					Block.Read(i, S.Ptr[i], S.Count);
+				{
+					lock_guard<mutex> lk(Mutex);
+					S.State = 2;
+				}
+				CV.notify_all();
+				ProdIdx ++;
+			}
+		} catch (exception &E) {
+			lock_guard<mutex> lk(Mutex);
+			Failed = true; ErrMsg = E.what();
+		} catch (...) {
+			lock_guard<mutex> lk(Mutex);
+			Failed = true; ErrMsg = "Unknown error in decoding blocks.";
+		}
+		CV.notify_all();
+	}
+};
+
+/// a list of Python objects, released when destroyed
+class COREARRAY_DLL_LOCAL CPyObjList: public vector<PyObject*>
+{
+public:
+	~CPyObjList() { Clear(); }
+	/// release all objects and clear the list
+	void Clear()
+	{
+		for (iterator p = begin(); p != end(); p++) Py_XDECREF(*p);
+		clear();
+	}
+};
+
+/// The local selection and Python objects of an apply function
+/** The local selection is popped up and the references are released when
+ *  leaving the scope, including on a C++ exception.
+**/
+class COREARRAY_DLL_LOCAL CApplyScope
+{
+public:
+	PyObject *Args;  ///< the arguments of the user function
+	PyObject *Ans;   ///< the list of returned values, or NULL
+
+	CApplyScope(): Args(NULL), Ans(NULL), _SelStack(NULL) { }
+	~CApplyScope()
+	{
+		if (_SelStack) _SelStack->pop_back();
+		Py_XDECREF(Args);
+		Py_XDECREF(Ans);
+	}
+
+	/// push a local selection which is pinned
+	TSelection &PushSel(CFileInfo &File)
+	{
+		_SelStack = &File.SelStack();
+		_SelStack->push_back(TSelection());
+		TSelection &Sel = _SelStack->back();
+		Sel.Pinned = true;
+		return Sel;
+	}
+
+	/// return Ans and give up its reference
+	PyObject *ReleaseAns()
+	{
+		PyObject *rv = Ans;
+		Ans = NULL;
+		return rv;
+	}
+
+private:
+	list<TSelection> *_SelStack;
+};
+
+
 extern "C"
 {
 
@@ -44,10 +347,23 @@ static bool is_logical(PdGDSObj Node)
 */
 
 
-// get data
-static PyObject* VarGetData(CFileInfo &File, const char *name)
+/// a list of chromosome levels
+static PyObject* chrom_levels(const CChromIndex &Chrom)
+{
+	PyObject *rv = PyList_New(Chrom.Levels.size());
+	for (size_t i=0; i < Chrom.Levels.size(); i++)
+	{
+		const string &s = Chrom.Levels[i];
+		PyList_SET_ITEM(rv, i, PYSTR_SET2(&s[0], s.size()));
+	}
+	return rv;
+}
+
+// get data, using the process default number of threads if nthread <= 0
+static PyObject* VarGetData(CFileInfo &File, const char *name, int nthread=0)
 {
 	static const char *ERR_DIM = "Invalid dimension of '%s'.";
+	STAT_TIMER(tm, STAT_GETDATA);
 
 	PyObject *rv_ans = NULL;
 	TSelection &Sel = File.Selection();
@@ -111,6 +427,18 @@ static PyObject* VarGetData(CFileInfo &File, const char *name)
 			}
 		}
 	
+	} else if (strcmp(name, "$chrom_code")==0 || strcmp(name, "#chrom_code")==0)
+	{
+		// ===========================================================
+		// chromosome codes and levels
+
+		int n = File.VariantSelNum();
+		CChromIndex &Chrom = File.Chromosome();
+		PyObject *code = numpy_new_int32(n);
+		if (n > 0)
+			Chrom.GetCode(Sel.pVariant(), (C_Int32*)numpy_getptr(code));
+		rv_ans = Py_BuildValue("(NN)", code, chrom_levels(Chrom));
+
 	} else if ( (strcmp(name, "variant.id")==0) ||
 		(strcmp(name, "allele")==0) ||
 		(strcmp(name, "annotation/id")==0) ||
@@ -139,16 +467,49 @@ static PyObject* VarGetData(CFileInfo &File, const char *name)
 
 		if ((nSample > 0) && (nVariant > 0))
 		{
-			// initialize GDS genotype Node
-			CApply_Variant_Geno NodeVar(File);
-			// set
 			rv_ans = numpy_new_uint8_dim3(nVariant, nSample, File.Ploidy());
 			C_UInt8 *base = (C_UInt8*)numpy_getptr(rv_ans);
 			ssize_t SIZE = (ssize_t)nSample * File.Ploidy();
-			do {
-				NodeVar.ReadGenoData(base);
-				base += SIZE;
-			} while (NodeVar.Next());
+			int nThread = GetNumThread(nthread);
+			if (nThread > nVariant) nThread = nVariant;
+
+			if (nThread <= 1)
+			{
+				// initialize GDS genotype Node
+				CApply_Variant_Geno NodeVar(File);
+				// set
+				do {
+					NodeVar.ReadGenoData(base);
+					base += SIZE;
+				} while (NodeVar.Next());
+			} else {
+				// one reader per thread, starting from its range of variants
+				vector<size_t> st;
+				ParallelSplit(nThread, nVariant, st);
+				vector<int> pos;
+				ParallelSelPos(Sel.VariantRank(), st, pos);
+				CVarApplyList NodeList;
+				for (int i=0; i < nThread; i++)
+				{
+					CApply_Variant_Geno *p = new CApply_Variant_Geno(File);
+					NodeList.push_back(p);
+					p->GDSLock = true;
+					p->Position = pos[i];
+				}
+				// decode in parallel without the GIL
+				ParallelFor(nThread, nVariant,
+					[&](int i, size_t start, size_t count) {
+						CApply_Variant_Geno *p =
+							static_cast<CApply_Variant_Geno*>(NodeList[i]);
+						C_UInt8 *b = base + start*SIZE;
+						for (; count > 0; count--)
+						{
+							p->ReadGenoData(b);
+							b += SIZE;
+							p->Next();
+						}
+					});
+			}
 		} else
 			rv_ans = numpy_new_uint8(0);
 
@@ -186,6 +547,29 @@ static PyObject* VarGetData(CFileInfo &File, const char *name)
 		} else
 			rv_ans = numpy_new_uint8(0);
 
+	} else if (strcmp(name, "$genotype_packed")==0 ||
+		strcmp(name, "#genotype_packed")==0)
+	{
+		// ===========================================================
+		// bit-packed genotypic data, 2 bits per allele
+
+		ssize_t nSample  = File.SampleSelNum();
+		ssize_t nVariant = File.VariantSelNum();
+
+		if ((nSample > 0) && (nVariant > 0))
+		{
+			// initialize GDS genotype Node
+			CApply_Variant_GenoPacked NodeVar(File);
+			// set
+			rv_ans = numpy_new_uint8_mat(nVariant, NodeVar.PackedSize);
+			C_UInt8 *base = (C_UInt8*)numpy_getptr(rv_ans);
+			do {
+				NodeVar.ReadGenoPacked(base);
+				base += NodeVar.PackedSize;
+			} while (NodeVar.Next());
+		} else
+			rv_ans = numpy_new_uint8(0);
+
 	} else if (strcmp(name, "phase") == 0)
 	{
 		// ===========================================================
@@ -359,6 +743,34 @@ static PyObject* VarGetData(CFileInfo &File, const char *name)
 			}
 		}
 
+	} else if (strcmp(name, "$chrom_pos_key")==0 || strcmp(name, "#chrom_pos_key")==0)
+	{
+		// ===========================================================
+		// chromosome code, position and duplicate counter
+
+		size_t n = File.VariantSelNum();
+		CChromIndex &Chrom = File.Chromosome();
+		const vector<C_Int32> &Pos = File.Position();
+		PyObject *key = numpy_new_chrom_pos(n);
+		if (n > 0)
+		{
+			TChromPos *p = (TChromPos*)numpy_getptr(key);
+			vector<C_Int32> code(n);
+			Chrom.GetCode(Sel.pVariant(), &code[0]);
+			const C_BOOL *s = Sel.pVariant();
+			const C_Int32 *pos = &Pos[0];
+			for (size_t i=0; i < n; s++, pos++)
+			{
+				if (!*s) continue;
+				p->Chrom = code[i];
+				p->Pos = *pos;
+				p->Dup = ((i > 0) && (p[-1].Chrom == p->Chrom) &&
+					(p[-1].Pos == p->Pos)) ? p[-1].Dup + 1 : 0;
+				p++; i++;
+			}
+		}
+		rv_ans = Py_BuildValue("(NN)", key, chrom_levels(Chrom));
+
 	} else if (strcmp(name, "$num_allele")==0 || strcmp(name, "#num_allele")==0)
 	{
 		// ===========================================================
@@ -442,19 +854,54 @@ static PyObject* VarGetData(CFileInfo &File, const char *name)
 }
 
 
+/// get data if other threads share the file, e.g., in a worker thread of
+/// RunParallel(backend='threads') or in the function of a prefetched Apply,
+/// where genotypes are decoded without the GIL, and GDS calls are serialized
+static PyObject* ThreadGetData(CFileInfo &File, const char *name)
+{
+	if (CApplyGenoBlock::IsSupported(name) && (File.SampleSelNum() > 0) &&
+		(File.VariantSelNum() > 0))
+	{
+		int nVariant = File.VariantSelNum();
+		vector<string> nm(1, name);
+		unique_ptr<CApplyGenoBlock> Block;
+		{
+			CGDSLock lock(true);
+			Block.reset(new CApplyGenoBlock(File, nm, true));
+		}
+		PyObject *rv_ans = Block->NewArray(0, nVariant);
+		C_UInt8 *base = (C_UInt8*)numpy_getptr(rv_ans);
+		try {
+			CPyUnlockGIL unlock;
+			Block->Read(0, base, nVariant);
+		} catch (...) {
+			Py_DECREF(rv_ans);
+			throw;
+		}
+		return rv_ans;
+	} else {
+		CGDSLock lock(true);
+		return VarGetData(File, name, 1);
+	}
+}
+
 /// Get data from a working space
 COREARRAY_DLL_EXPORT PyObject* SEQ_GetData(PyObject *self, PyObject *args)
 {
 	int file_id;
 	const char *name;
-	if (!PyArg_ParseTuple(args, "is", &file_id, &name))
+	int nthread = 0;
+	if (!PyArg_ParseTuple(args, "is|i", &file_id, &name, &nthread))
 		return NULL;
 
 	COREARRAY_TRY
 		// File information
 		CFileInfo &File = GetFileInfo(file_id);
 		// Get data
-		return VarGetData(File, name);
+		if (File.GDSShared())
+			return ThreadGetData(File, name);
+		else
+			return VarGetData(File, name, nthread);
 	COREARRAY_CATCH_NONE
 }
 
@@ -469,8 +916,10 @@ COREARRAY_DLL_EXPORT PyObject* SEQ_BApply_Variant(PyObject *self, PyObject *args
 	const char *as_is;
 	int bsize;
 	int verbose;
-	if (!PyArg_ParseTuple(args, "iOOOsi" BSTR, &file_id, &name, &func,
-			&obj, &as_is, &bsize, &verbose))
+	int prefetch = 0;
+	int reuse = 0;
+	if (!PyArg_ParseTuple(args, "iOOOsi" BSTR "|i" BSTR, &file_id, &name,
+			&func, &obj, &as_is, &bsize, &verbose, &prefetch, &reuse))
 		return NULL;
 
 	if (!PyCallable_Check(func))
@@ -491,7 +940,7 @@ COREARRAY_DLL_EXPORT PyObject* SEQ_BApply_Variant(PyObject *self, PyObject *args
 		if (name_list.empty())
 			throw ErrSeqArray("'name' should be specified.");
 
-		PyObject *rv_ans = NULL;
+		CApplyScope Scope;
 
 		// File information
 		CFileInfo &File = GetFileInfo(file_id);
@@ -510,7 +959,7 @@ COREARRAY_DLL_EXPORT PyObject* SEQ_BApply_Variant(PyObject *self, PyObject *args
 		// as_is
 		if (strcmp(as_is, "list")==0 || strcmp(as_is, "unlist")==0)
 		{
-			rv_ans = PyList_New(NumBlock);
+			Scope.Ans = PyList_New(NumBlock);
 		} else if (strcmp(as_is, "none") != 0)
 		{
 			throw ErrSeqArray("'asis' should be 'none', 'list' or 'unlist'.");
@@ -520,22 +969,56 @@ COREARRAY_DLL_EXPORT PyObject* SEQ_BApply_Variant(PyObject *self, PyObject *args
 		int num_var = name_list.size();
 		int st_var = 0;
 		if (obj != Py_None) { num_var++; st_var = 1; }
-		PyObject *args = PyTuple_New(num_var);
+		PyObject *args = Scope.Args = PyTuple_New(num_var);
 		if (obj != Py_None)
 		{
 			Py_INCREF(obj);
 			PyTuple_SetItem(args, 0, obj);
 		}
 
+		// genotypic variables are read by persistent readers over the current
+		// selection, and decoded ahead if prefetch > 0; the multithreaded
+		// decoding in VarGetData() is used instead if no prefetching, unless
+		// other threads share the file (e.g., RunParallel(backend='threads'))
+		const bool threaded = File.GDSShared();
+		vector<int> blk_pos;
+		unique_ptr<CApplyPrefetch> Prefetch;
+		unique_ptr<CApplyGenoBlock> Block;
+		if ((File.SampleSelNum() > 0) &&
+			((prefetch > 0) || threaded || (GetNumThread() <= 1)))
+		{
+			CGDSLock lock(threaded);
+			vector<string> blk_name;
+			for (int i=st_var; i < num_var; i++)
+			{
+				if (CApplyGenoBlock::IsSupported(name_list[i-st_var]))
+				{
+					blk_name.push_back(name_list[i-st_var]);
+					blk_pos.push_back(i);
+				}
+			}
+			if (!blk_name.empty())
+			{
+				if (prefetch > 0)
+				{
+					Prefetch.reset(new CApplyPrefetch(File, blk_name, bsize,
+						nVariant, prefetch));
+					for (int i=0; i < prefetch; i++) Prefetch->Post(i);
+				} else
+					Block.reset(new CApplyGenoBlock(File, blk_name, threaded));
+			}
+		}
+		const bool use_blk = Prefetch.get() || Block.get();
+
 		// local selection
-		File.SelList.push_back(TSelection());
-		TSelection &Sel = File.SelList.back();
+		TSelection &Sel = Scope.PushSel(File);
 		Sel.Sample = Selection.Sample;
 		Sel.Variant.resize(File.VariantNum());
 
-		C_BOOL *pBase, *pSel, *pEnd;
-		pBase = pSel = Selection.pVariant();
-		pEnd = pBase + Selection.Variant.size();
+		// the blocks are located by the rank/select index of the selection
+		const C_BOOL *pBase = Selection.pVariant();
+		const CSelRank &Rank = Selection.VariantRank();
+		size_t i_st=0, i_end=0;
 
 		// progress object
 		CProgressStdOut progress(NumBlock, verbose!=0);
@@ -543,52 +1026,305 @@ COREARRAY_DLL_EXPORT PyObject* SEQ_BApply_Variant(PyObject *self, PyObject *args
 		// for-loop
 		for (int idx=0; idx < NumBlock; idx++)
 		{
-			// assign sub-selection
+			// assign sub-selection, clearing the previous block
 			{
-				C_BOOL *pNewSel = Sel.pVariant();
-				memset(pNewSel, 0, Sel.Variant.size());
-				// for-loop
-				for (int bs=bsize; bs > 0; bs--)
-				{
-					while ((pSel < pEnd) && (*pSel == FALSE))
-						pSel ++;
-					if (pSel < pEnd)
-					{
-						pNewSel[pSel - pBase] = TRUE;
-						pSel ++;
-					} else
-						break;
-				}
+				C_BOOL *pNewSel = Sel.wVariant();
+				memset(pNewSel + i_st, 0, i_end - i_st);
+				int k = idx * bsize;
+				int cnt = (idx < NumBlock-1) ? bsize : (nVariant - k);
+				i_st = Rank.Select(k);
+				i_end = Rank.Select(k + cnt - 1) + 1;
+				memcpy(pNewSel + i_st, pBase + i_st, i_end - i_st);
 			}
 
 			// load data
-			for (int i=st_var; i < num_var; i++)
 			{
-				PyObject *v = VarGetData(File, name_list[i-st_var].c_str());
-				PyTuple_SetItem(args, i, v);
+				STAT_TIMER(tm_read, STAT_APPLY_READ);
+				if (Prefetch.get())
+				{
+					Prefetch->Take(idx, args, blk_pos);
+					Prefetch->Post(idx + prefetch);
+				} else if (Block.get())
+				{
+					int cnt = (idx < NumBlock-1) ? bsize : (nVariant - idx*bsize);
+					for (size_t k=0; k < Block->Count(); k++)
+					{
+						// reuse the array of the previous block if no one else holds it
+						PyObject *v = PyTuple_GET_ITEM(args, blk_pos[k]);
+						if (!Block->Reusable(k, v, cnt) || (!reuse && Py_REFCNT(v)>1))
+						{
+							v = Block->NewArray(k, cnt);
+							PyTuple_SetItem(args, blk_pos[k], v);
+						}
+						C_UInt8 *base = (C_UInt8*)numpy_getptr(v);
+						if (threaded)
+						{
+							CPyUnlockGIL unlock;
+							Block->Read(k, base, cnt);
+						} else
+							Block->Read(k, base, cnt);
+					}
+				}
+				for (int i=st_var; i < num_var; i++)
+				{
+					if (use_blk && CApplyGenoBlock::IsSupported(name_list[i-st_var]))
+						continue;
+					// the background or other threads may be reading GDS nodes
+					CGDSLock lock(Prefetch.get() || threaded);
+					PyObject *v = VarGetData(File, name_list[i-st_var].c_str(),
+						threaded ? 1 : 0);
+					PyTuple_SetItem(args, i, v);
+				}
 			}
 
 			// call Python function
-			PyObject *val = PyObject_CallObject(func, args);
-			if (val == NULL)
+			PyObject *val;
 			{
-				Py_DECREF(args);
-				if (rv_ans) Py_DECREF(rv_ans);
-				return NULL;
+				STAT_TIMER(tm_call, STAT_APPLY_CALL);
+				val = PyObject_CallObject(func, args);
 			}
+			if (val == NULL) return NULL;
 
 			// store data
-			if (rv_ans && val!=Py_None)
-				PyList_SetItem(rv_ans, idx, val);
+			if (Scope.Ans)
+				PyList_SetItem(Scope.Ans, idx, val);
+			else
+				Py_DECREF(val);
 
 			progress.Forward();
 		}
 
-		File.SelList.pop_back();
-		Py_DECREF(args);
+		// finally
+		if (Scope.Ans) return Scope.ReleaseAns();
+
+	COREARRAY_CATCH_NONE
+}
+
+
+/// the maximum number of bytes of the variant-by-sample arrays of a group of
+/// sample blocks in SEQ_BApply_Sample, with one pass over variants per group
+static const double APPLY_SAMPLE_MAXMEM = 1024.0 * 1024 * 1024;
+/// the number of bytes of genotypes read per variant block in the pass
+static const size_t APPLY_SAMPLE_VARBUF = 16 * 1024 * 1024;
+
+/// whether the first two dimensions of a variable are variant and sample
+static bool is_variant_sample_var(const string &name)
+{
+	return (name=="genotype") || (name=="$dosage") || (name=="#dosage") ||
+		(name=="phase");
+}
+
+/// Apply functions over samples in block
+COREARRAY_DLL_EXPORT PyObject* SEQ_BApply_Sample(PyObject *self, PyObject *args)
+{
+	int file_id;
+	PyObject *name;
+	PyObject *func;
+	PyObject *obj;
+	const char *as_is;
+	int bsize;
+	int verbose;
+	if (!PyArg_ParseTuple(args, "iOOOsi" BSTR, &file_id, &name, &func,
+			&obj, &as_is, &bsize, &verbose))
+		return NULL;
+
+	if (!PyCallable_Check(func))
+	{
+		PyErr_SetString(PyExc_TypeError, "'fun' must be callable.");
+		return NULL;
+	}
+	if (bsize < 1)
+	{
+		PyErr_SetString(PyExc_ValueError, "'bsize' must be >= 1.");
+		return NULL;
+	}
+
+	COREARRAY_TRY
+
+		vector<string> name_list;
+		numpy_to_string(name, name_list);
+		if (name_list.empty())
+			throw ErrSeqArray("'name' should be specified.");
+		for (size_t i=0; i < name_list.size(); i++)
+		{
+			const string &s = name_list[i];
+			if (s=="$genotype_packed" || s=="#genotype_packed")
+				throw ErrSeqArray("'%s' is not supported by sample.", s.c_str());
+		}
+
+		CApplyScope Scope;
+
+		// File information
+		CFileInfo &File = GetFileInfo(file_id);
+		// Selection
+		TSelection &Selection = File.Selection();
+
+		// the number of selected samples and variants
+		int nSample = File.SampleSelNum();
+		if (nSample <= 0)
+			throw ErrSeqArray("There is no selected sample.");
+		int nVariant = File.VariantSelNum();
+		if (nVariant <= 0)
+			throw ErrSeqArray("There is no selected variant.");
+
+		// the number of data blocks
+		int NumBlock = nSample / bsize;
+		if (nSample % bsize) NumBlock ++;
+
+		// as_is
+		if (strcmp(as_is, "list")==0 || strcmp(as_is, "unlist")==0)
+		{
+			Scope.Ans = PyList_New(NumBlock);
+		} else if (strcmp(as_is, "none") != 0)
+		{
+			throw ErrSeqArray("'asis' should be 'none', 'list' or 'unlist'.");
+		}
+
+		// function arguments
+		int num_var = name_list.size();
+		int st_var = 0;
+		if (obj != Py_None) { num_var++; st_var = 1; }
+		PyObject *args = Scope.Args = PyTuple_New(num_var);
+		if (obj != Py_None)
+		{
+			Py_INCREF(obj);
+			PyTuple_SetItem(args, 0, obj);
+		}
+
+		// local selection
+		const bool threaded = File.GDSShared();
+		TSelection &Sel = Scope.PushSel(File);
+		Sel.Sample.resize(File.SampleNum());
+		Sel.Variant = Selection.Variant;
+
+		// the blocks are located by the rank/select index of the selection
+		const C_BOOL *pSampBase = Selection.pSample();
+		const CSelRank &SampRank = Selection.SampleRank();
+		const C_BOOL *pVarBase = Selection.pVariant();
+		const CSelRank &VarRank = Selection.VariantRank();
+		size_t s_st=0, s_end=0, v_st=0, v_end=File.VariantNum();
+
+		// select the k-th to (k+cnt-1)-th elements of 'base' in 'sel',
+		// clearing the previous range [st, end)
+		auto sel_range = [](C_BOOL *sel, const C_BOOL *base,
+			const CSelRank &rank, size_t &st, size_t &end, int k, int cnt)
+		{
+			memset(sel + st, 0, end - st);
+			st = rank.Select(k);
+			end = rank.Select(k + cnt - 1) + 1;
+			memcpy(sel + st, base + st, end - st);
+		};
+
+		// variant-by-sample variables, passed with samples in the first dimension
+		vector<int> vs_pos;
+		for (int i=st_var; i < num_var; i++)
+			if (is_variant_sample_var(name_list[i-st_var])) vs_pos.push_back(i);
+		const size_t nVS = vs_pos.size();
+
+		// the number of sample blocks per group, whose variant-by-sample arrays
+		// take at most APPLY_SAMPLE_MAXMEM bytes (at least one block)
+		int GrpBlock = NumBlock;
+		if (nVS > 0)
+		{
+			double sz = (double)bsize * nVariant * File.Ploidy() * nVS;
+			if (sz * GrpBlock > APPLY_SAMPLE_MAXMEM)
+				GrpBlock = (int)(APPLY_SAMPLE_MAXMEM / sz);
+			if (GrpBlock < 1) GrpBlock = 1;
+		}
+
+		// progress object
+		CProgressStdOut progress(NumBlock, verbose!=0);
+		// the arrays of sample blocks, block by variable in a group
+		CPyObjList Out, Tmp;
+
+		// for each group of sample blocks
+		for (int b0=0; b0 < NumBlock; b0 += GrpBlock)
+		{
+			const int b1 = (b0 + GrpBlock < NumBlock) ? b0 + GrpBlock : NumBlock;
+			const int s0 = b0 * bsize;
+			const int ns = ((b1*bsize < nSample) ? b1*bsize : nSample) - s0;
+
+			// one pass over the selected variants for the samples of the group,
+			// each variant block is swapped into the arrays of sample blocks
+			Out.Clear();
+			Out.resize((b1 - b0) * nVS, NULL);
+			if (nVS > 0)
+			{
+				sel_range(Sel.wSample(), pSampBase, SampRank, s_st, s_end, s0, ns);
+				size_t sz = APPLY_SAMPLE_VARBUF / ((size_t)ns * File.Ploidy());
+				const int vb = (sz < 1) ? 1 : ((sz < (size_t)nVariant) ? sz : nVariant);
+				for (int v0=0; v0 < nVariant; v0 += vb)
+				{
+					const int nv = (v0 + vb < nVariant) ? vb : nVariant - v0;
+					sel_range(Sel.wVariant(), pVarBase, VarRank, v_st, v_end, v0, nv);
+					for (size_t j=0; j < nVS; j++)
+					{
+						const string &nm = name_list[vs_pos[j]-st_var];
+						Tmp.Clear();
+						{
+							CGDSLock lock(threaded);
+							Tmp.push_back(VarGetData(File, nm.c_str(),
+								threaded ? 1 : 0));
+						}
+						PyObject *v = Tmp[0];
+						if (!numpy_is_array(v))
+							throw ErrSeqArray("Invalid '%s'.", nm.c_str());
+						for (int b=b0; b < b1; b++)
+						{
+							const int k = b * bsize;
+							const int cnt = (k + bsize < nSample) ? bsize : nSample - k;
+							PyObject *&o = Out[(b - b0)*nVS + j];
+							if (!o) o = numpy_new_dim12(v, cnt, nVariant);
+							numpy_swap_dim12_to(v, k - s0, cnt, o, v0);
+						}
+					}
+				}
+				Tmp.Clear();
+				// all selected variants for the other variables
+				memcpy(Sel.wVariant(), pVarBase, File.VariantNum());
+				v_st = 0; v_end = File.VariantNum();
+			}
+
+			// call the function for each sample block of the group
+			for (int idx=b0; idx < b1; idx++)
+			{
+				const int k = idx * bsize;
+				const int cnt = (idx < NumBlock-1) ? bsize : (nSample - k);
+				sel_range(Sel.wSample(), pSampBase, SampRank, s_st, s_end, k, cnt);
+
+				// load data
+				for (int i=st_var, j=0; i < num_var; i++)
+				{
+					PyObject *v;
+					if ((j < (int)nVS) && (vs_pos[j] == i))
+					{
+						PyObject *&o = Out[(idx - b0)*nVS + j];
+						v = o; o = NULL;
+						j ++;
+					} else {
+						CGDSLock lock(threaded);
+						v = VarGetData(File, name_list[i-st_var].c_str(),
+							threaded ? 1 : 0);
+					}
+					PyTuple_SetItem(args, i, v);
+				}
+
+				// call Python function
+				PyObject *val = PyObject_CallObject(func, args);
+				if (val == NULL) return NULL;
+
+				// store data
+				if (Scope.Ans)
+					PyList_SetItem(Scope.Ans, idx, val);
+				else
+					Py_DECREF(val);
+
+				progress.Forward();
+			}
+		}
 
 		// finally
-		if (rv_ans) return rv_ans;
+		if (Scope.Ans) return Scope.ReleaseAns();
 
 	COREARRAY_CATCH_NONE
 }
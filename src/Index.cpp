@@ -20,6 +20,15 @@
 // If not, see <http://www.gnu.org/licenses/>.
 
 #include "Index.h"
+#include <algorithm>
+#include <cstdio>
+#include <sys/stat.h>
+#ifdef _WIN32
+#   include <process.h>
+#   define getpid    _getpid
+#else
+#   include <unistd.h>
+#endif
 #include <numpy/arrayobject.h>
 
 using namespace std;
@@ -30,6 +39,51 @@ namespace PySeqArray
 
 static double NaN = 0.0/0.0;
 
+// ===========================================================
+// Skip table of run-length encoding
+// ===========================================================
+
+size_t TRLESkipTable::Find(size_t pos) const
+{
+	// the last entry with Pos[i] <= pos
+	vector<C_Int64>::const_iterator it =
+		upper_bound(Pos.begin(), Pos.end(), (C_Int64)pos);
+	return (it - Pos.begin()) - 1;
+}
+
+/// build the sampled prefix sums from the RLE values and lengths
+template<typename TYPE>
+	static void RLE_InitSkip(TRLESkipTable &Skip, const vector<TYPE> &Values,
+	const vector<C_UInt32> &Lengths)
+{
+	Skip.Clear();
+	const size_t n = Lengths.size();
+	Skip.Pos.reserve(n/RLE_SKIP_STEP + 1);
+	Skip.Sum.reserve(n/RLE_SKIP_STEP + 1);
+	C_Int64 pos = 0, sum = 0;
+	for (size_t i=0; i < n; i++)
+	{
+		if (i % RLE_SKIP_STEP == 0)
+		{
+			Skip.Pos.push_back(pos);
+			Skip.Sum.push_back(sum);
+		}
+		pos += Lengths[i];
+		sum += (C_Int64)Values[i] * Lengths[i];
+	}
+}
+
+/// whether to jump via the skip table instead of walking from the current run
+inline static bool RLE_NeedSkip(const TRLESkipTable &Skip, size_t pos,
+	size_t cur_pos, size_t cur_idx)
+{
+	if (pos < cur_pos) return true;
+	size_t k = cur_idx / RLE_SKIP_STEP + 1;
+	return (k < Skip.Pos.size()) && ((C_Int64)pos >= Skip.Pos[k]);
+}
+
+
+
 // ===========================================================
 // Indexing object
 // ===========================================================
@@ -86,9 +140,7 @@ void CIndex::Init(PdContainer Obj)
 		Lengths.push_back(repeat);					
 	}
 
-	Position = 0;
-	AccSum = 0;
-	AccIndex = AccOffset = 0;
+	InitRLE();
 }
 
 void CIndex::InitOne(int num)
@@ -97,7 +149,16 @@ void CIndex::InitOne(int num)
 	Values.push_back(1);
 	Lengths.clear();
 	Lengths.push_back(num);
-	TotalLength = num;
+	InitRLE();
+}
+
+void CIndex::InitRLE()
+{
+	TotalLength = 0;
+	vector<C_UInt32>::iterator p;
+	for (p=Lengths.begin(); p != Lengths.end(); p++)
+		TotalLength += *p;
+	RLE_InitSkip(Skip, Values, Lengths);
 	Position = 0;
 	AccSum = 0;
 	AccIndex = AccOffset = 0;
@@ -107,11 +168,14 @@ void CIndex::GetInfo(size_t pos, C_Int64 &Sum, int &Value)
 {
 	if (pos >= TotalLength)
 		throw ErrSeqArray("Invalid position in CIndex.");
-	if (pos < Position)
+	if (RLE_NeedSkip(Skip, pos, Position, AccIndex))
 	{
-		Position = 0;
-		AccSum = 0;
-		AccIndex = AccOffset = 0;
+		STAT_INDEX_RESET();
+		size_t k = Skip.Find(pos);
+		Position = Skip.Pos[k];
+		AccSum = Skip.Sum[k];
+		AccIndex = k * RLE_SKIP_STEP;
+		AccOffset = 0;
 	}
 	for (; Position < pos; )
 	{
@@ -315,6 +379,16 @@ void CGenoIndex::Init(PdContainer Obj)
 		Lengths.push_back(repeat);					
 	}
 
+	InitRLE();
+}
+
+void CGenoIndex::InitRLE()
+{
+	TotalLength = 0;
+	vector<C_UInt32>::iterator p;
+	for (p=Lengths.begin(); p != Lengths.end(); p++)
+		TotalLength += *p;
+	RLE_InitSkip(Skip, Values, Lengths);
 	Position = 0;
 	AccSum = 0;
 	AccIndex = AccOffset = 0;
@@ -324,11 +398,14 @@ void CGenoIndex::GetInfo(size_t pos, C_Int64 &Sum, C_UInt8 &Value)
 {
 	if (pos >= TotalLength)
 		throw ErrSeqArray("Invalid position in CIndex.");
-	if (pos < Position)
+	if (RLE_NeedSkip(Skip, pos, Position, AccIndex))
 	{
-		Position = 0;
-		AccSum = 0;
-		AccIndex = AccOffset = 0;
+		STAT_INDEX_RESET();
+		size_t k = Skip.Find(pos);
+		Position = Skip.Pos[k];
+		AccSum = Skip.Sum[k];
+		AccIndex = k * RLE_SKIP_STEP;
+		AccOffset = 0;
 	}
 	for (; Position < pos; )
 	{
@@ -351,6 +428,259 @@ void CGenoIndex::GetInfo(size_t pos, C_Int64 &Sum, C_UInt8 &Value)
 
 
 
+// ===========================================================
+// Persistent index cache
+// ===========================================================
+
+// the sidecar file:
+//   magic (8 bytes), size and mtime of GDS file (2 x int64),
+//   entries: name length (uint32), name, # of runs (uint64),
+//            values (int32 x # of runs), lengths (uint32 x # of runs)
+static const char CACHE_MAGIC[8] = { 'S', 'E', 'Q', 'I', 'D', 'X', '0', '1' };
+
+/// seek to an absolute 64-bit offset
+static bool cache_seek(FILE *f, C_Int64 offset)
+{
+#ifdef _WIN32
+	return _fseeki64(f, offset, SEEK_SET) == 0;
+#else
+	return fseeko(f, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+/// read the header of sidecar file, return false if invalid or out of date
+static bool cache_read_header(FILE *f, C_Int64 size, C_Int64 mtime)
+{
+	char magic[8];
+	C_Int64 st[2];
+	if (fread(magic, 1, sizeof(magic), f) != sizeof(magic)) return false;
+	if (memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0) return false;
+	if (fread(st, sizeof(C_Int64), 2, f) != 2) return false;
+	return (st[0] == size) && (st[1] == mtime);
+}
+
+/// read the name and the number of runs of an entry
+static bool cache_read_entry(FILE *f, string &name, C_UInt64 &nrun)
+{
+	C_UInt32 len;
+	if (fread(&len, sizeof(len), 1, f) != 1) return false;
+	if (len > 65536) return false;  // not a variable name
+	name.resize(len);
+	if ((len > 0) && (fread(&name[0], 1, len, f) != len)) return false;
+	return fread(&nrun, sizeof(nrun), 1, f) == 1;
+}
+
+/// write an entry
+static void cache_write_entry(FILE *f, const string &name, C_UInt64 nrun,
+	const void *values, const void *lengths)
+{
+	C_UInt32 len = name.size();
+	fwrite(&len, sizeof(len), 1, f);
+	fwrite(name.c_str(), 1, len, f);
+	fwrite(&nrun, sizeof(nrun), 1, f);
+	fwrite(values, sizeof(C_Int32), nrun, f);
+	fwrite(lengths, sizeof(C_UInt32), nrun, f);
+}
+
+/// the bytes of values and lengths in an entry
+static const C_UInt64 CACHE_RUN_SIZE = sizeof(C_Int32) + sizeof(C_UInt32);
+
+
+CIndexCache::CIndexCache()
+{
+	_DirLoaded = false;
+	_Stamp[0] = _Stamp[1] = 0;
+}
+
+CIndexCache::~CIndexCache()
+{
+	Flush();
+}
+
+void CIndexCache::Reset(const string &gds_fn, const string &cache_fn)
+{
+	Flush();
+	_GDSFn = gds_fn;
+	_CacheFn = cache_fn;
+	_DirLoaded = false;
+	_Dir.clear();
+	_NewEntry.clear();
+}
+
+bool CIndexCache::Load(const string &name, C_Int64 total,
+	vector<int> &Values, vector<C_UInt32> &Lengths)
+{
+	return LoadEntry(name, total, Values, Lengths);
+}
+
+bool CIndexCache::Load(const string &name, C_Int64 total,
+	vector<C_UInt16> &Values, vector<C_UInt32> &Lengths)
+{
+	vector<C_Int32> buf;
+	if (!LoadEntry(name, total, buf, Lengths)) return false;
+	Values.assign(buf.begin(), buf.end());
+	return true;
+}
+
+void CIndexCache::Save(const string &name, const vector<int> &Values,
+	const vector<C_UInt32> &Lengths)
+{
+	if (!LoadDir()) return;
+	TNewEntry &e = _NewEntry[name];
+	e.Values = Values;
+	e.Lengths = Lengths;
+}
+
+void CIndexCache::Save(const string &name, const vector<C_UInt16> &Values,
+	const vector<C_UInt32> &Lengths)
+{
+	if (!LoadDir()) return;
+	TNewEntry &e = _NewEntry[name];
+	e.Values.assign(Values.begin(), Values.end());
+	e.Lengths = Lengths;
+}
+
+bool CIndexCache::FileStamp(C_Int64 &size, C_Int64 &mtime)
+{
+	struct stat st;
+	if (stat(_GDSFn.c_str(), &st) != 0) return false;
+	size = st.st_size;
+	mtime = st.st_mtime;
+	return true;
+}
+
+bool CIndexCache::LoadDir()
+{
+	if (_DirLoaded) return true;
+	if (!Enabled() || !FileStamp(_Stamp[0], _Stamp[1])) return false;
+	_DirLoaded = true;
+	FILE *f = fopen(_CacheFn.c_str(), "rb");
+	if (!f) return true;
+
+	// the file size, to validate the numbers of runs
+	C_Int64 fsize = -1;
+	struct stat st;
+	if (stat(_CacheFn.c_str(), &st) == 0) fsize = st.st_size;
+
+	if ((fsize > 0) && cache_read_header(f, _Stamp[0], _Stamp[1]))
+	{
+		C_Int64 offset = sizeof(CACHE_MAGIC) + 2*sizeof(C_Int64);
+		string nm;
+		TEntry e;
+		while (cache_read_entry(f, nm, e.NRun))
+		{
+			offset += sizeof(C_UInt32) + nm.size() + sizeof(C_UInt64);
+			if ((offset > fsize) ||
+				(e.NRun > (C_UInt64)(fsize - offset) / CACHE_RUN_SIZE))
+				break;  // truncated or corrupted
+			e.Offset = offset;
+			_Dir[nm] = e;
+			offset += e.NRun * CACHE_RUN_SIZE;
+			if (!cache_seek(f, offset)) break;
+		}
+	}
+
+	fclose(f);
+	return true;
+}
+
+bool CIndexCache::LoadEntry(const string &name, C_Int64 total,
+	vector<C_Int32> &Values, vector<C_UInt32> &Lengths)
+{
+	if (!LoadDir()) return false;
+	map<string, TEntry>::const_iterator p = _Dir.find(name);
+	if (p == _Dir.end()) return false;
+	// each run has a positive length
+	const C_UInt64 nrun = p->second.NRun;
+	if ((total < 0) || (nrun > (C_UInt64)total)) return false;
+	FILE *f = fopen(_CacheFn.c_str(), "rb");
+	if (!f) return false;
+
+	Values.resize(nrun);
+	Lengths.resize(nrun);
+	bool ok = cache_seek(f, p->second.Offset) && ((nrun <= 0) ||
+		((fread(&Values[0], sizeof(C_Int32), nrun, f) == nrun) &&
+		(fread(&Lengths[0], sizeof(C_UInt32), nrun, f) == nrun)));
+	fclose(f);
+
+	if (ok)
+	{
+		C_Int64 sum = 0;
+		for (size_t i=0; i < nrun; i++)
+		{
+			if (Lengths[i] <= 0) { ok = false; break; }
+			sum += Lengths[i];
+		}
+		ok = ok && (sum == total);
+	}
+	if (!ok) { Values.clear(); Lengths.clear(); }
+	return ok;
+}
+
+void CIndexCache::Flush()
+{
+	if (_NewEntry.empty()) return;
+	map<string, TNewEntry> new_entry;
+	new_entry.swap(_NewEntry);
+
+	// the GDS file has been modified since the indices were built
+	C_Int64 st[2];
+	if (!FileStamp(st[0], st[1]) || (st[0] != _Stamp[0]) ||
+		(st[1] != _Stamp[1]))
+		return;
+
+	// write to a temporary file, copying the other valid entries
+	char pid[32];
+	sprintf(pid, ".%d", (int)getpid());
+	string tmp_fn = _CacheFn + pid;
+	FILE *out = fopen(tmp_fn.c_str(), "wb");
+	if (!out) return;  // the cache is optional
+	fwrite(CACHE_MAGIC, 1, sizeof(CACHE_MAGIC), out);
+	fwrite(st, sizeof(C_Int64), 2, out);
+
+	bool failed = false;
+	if (!_Dir.empty())
+	{
+		FILE *f = fopen(_CacheFn.c_str(), "rb");
+		vector<C_Int32> v;
+		vector<C_UInt32> l;
+		map<string, TEntry>::const_iterator p;
+		for (p=_Dir.begin(); f && p != _Dir.end(); p++)
+		{
+			if (new_entry.count(p->first)) continue;
+			const C_UInt64 nrun = p->second.NRun;
+			v.resize(nrun); l.resize(nrun);
+			if (!cache_seek(f, p->second.Offset) || ((nrun > 0) &&
+				((fread(&v[0], sizeof(C_Int32), nrun, f) != nrun) ||
+				(fread(&l[0], sizeof(C_UInt32), nrun, f) != nrun))))
+				{ failed = true; break; }
+			cache_write_entry(out, p->first, nrun, v.data(), l.data());
+		}
+		if (f) fclose(f); else failed = true;
+	}
+
+	map<string, TNewEntry>::const_iterator p;
+	for (p=new_entry.begin(); p != new_entry.end(); p++)
+	{
+		cache_write_entry(out, p->first, p->second.Values.size(),
+			p->second.Values.data(), p->second.Lengths.data());
+	}
+	if (ferror(out) != 0) failed = true;
+	if (fclose(out) != 0) failed = true;
+
+	// replace the sidecar file
+	if (!failed)
+	{
+		remove(_CacheFn.c_str());
+		failed = (rename(tmp_fn.c_str(), _CacheFn.c_str()) != 0);
+	}
+	if (failed) remove(tmp_fn.c_str());
+	_DirLoaded = false;
+	_Dir.clear();
+}
+
+
+
 // ===========================================================
 // Chromosome Indexing
 // ===========================================================
@@ -377,9 +707,13 @@ void CChromIndex::AddChrom(PdGDSFolder Root)
 	TRange rng;
 	rng.Start = 0;
 	rng.Length = 1;
+	rng.Sorted = -1;
 
 	Map.clear();
 	PosToChr.Clear();
+	Levels.clear();
+	RunCode.clear(); RunLength.clear();
+	map<string, C_Int32> code;
 
 	const C_Int32 NMAX = 4096;
 	string txt[NMAX];
@@ -395,8 +729,7 @@ void CChromIndex::AddChrom(PdGDSFolder Root)
 			{
 				rng.Length ++;
 			} else {
-				Map[last].push_back(rng);
-				PosToChr.Add(last, rng.Length);
+				AddRun(last, rng, code);
 				last = string(txt[i].begin(), txt[i].end());
 				rng.Start = idx + i;
 				rng.Length = 1;
@@ -405,14 +738,47 @@ void CChromIndex::AddChrom(PdGDSFolder Root)
 		idx += len;
 	}
 
-	Map[last].push_back(rng);
-	PosToChr.Add(last, rng.Length);
+	AddRun(last, rng, code);
 	PosToChr.Init();
 }
 
+void CChromIndex::AddRun(const string &chr, const TRange &rng,
+	map<string, C_Int32> &code)
+{
+	Map[chr].push_back(rng);
+	PosToChr.Add(chr, rng.Length);
+	map<string, C_Int32>::iterator it = code.find(chr);
+	if (it == code.end())
+	{
+		it = code.insert(make_pair(chr, (C_Int32)Levels.size())).first;
+		Levels.push_back(chr);
+	}
+	RunCode.push_back(it->second);
+	RunLength.push_back(rng.Length);
+}
+
 void CChromIndex::Clear()
 {
 	Map.clear();
+	Levels.clear();
+	RunCode.clear(); RunLength.clear();
+}
+
+size_t CChromIndex::GetCode(const C_BOOL *sel, C_Int32 *out)
+{
+	C_Int32 *p = out;
+	for (size_t i=0; i < RunCode.size(); i++)
+	{
+		size_t n = RunLength[i];
+		if (sel)
+		{
+			size_t m = GetNumOfTRUE(sel, n);
+			sel += n;
+			n = m;
+		}
+		p = fill_n(p, n, RunCode[i]);
+	}
+	return p - out;
 }
 
 size_t CChromIndex::RangeTotalLength(const TRangeList &RngList)
@@ -475,6 +841,200 @@ bool CRangeSet::IsIncluded(int point)
 
 
 
+// ===========================================================
+// Hash indexing of sample and variant IDs
+// ===========================================================
+
+COREARRAY_DLL_LOCAL C_UInt64 IdHash(int id)
+{
+	return (C_UInt64)(C_UInt32)id * 0x9E3779B97F4A7C15ULL;
+}
+
+COREARRAY_DLL_LOCAL C_UInt64 IdHash(const string &id)
+{
+	// 64-bit FNV-1a
+	C_UInt64 h = 0xCBF29CE484222325ULL;
+	for (size_t i=0; i < id.size(); i++)
+	{
+		h ^= (C_UInt8)id[i];
+		h *= 0x100000001B3ULL;
+	}
+	return h * 0x9E3779B97F4A7C15ULL;
+}
+
+
+// ===========================================================
+// Performance counters
+// ===========================================================
+
+const char *StatStageName[STAT_NUM_STAGE] =
+{
+	"geno_read", "geno_decode", "getdata", "numpy_alloc",
+	"apply_read", "apply_call"
+};
+
+#ifdef PYSEQARRAY_STATS
+TStatCounter StatStage[STAT_NUM_STAGE];
+atomic<C_Int64> StatGDSIter(0);
+atomic<C_Int64> StatIndexReset(0);
+#endif
+
+COREARRAY_DLL_LOCAL void StatReset()
+{
+#ifdef PYSEQARRAY_STATS
+	for (int i=0; i < STAT_NUM_STAGE; i++)
+	{
+		StatStage[i].NanoSec = 0;
+		StatStage[i].Bytes = 0;
+		StatStage[i].Count = 0;
+	}
+	StatGDSIter = 0;
+	StatIndexReset = 0;
+#endif
+}
+
+
+// ===========================================================
+// Selection object
+// ===========================================================
+
+void CSelRank::Init(const C_BOOL *sel, size_t n)
+{
+	const size_t nw = (n + 63) >> 6;
+	_Bits.resize(nw + 1);
+	_Bits[nw] = 0;
+	if (n > 0) vec_u8_pack_bool((const C_UInt8*)sel, n, &_Bits[0]);
+	_Rank.resize(nw + 2);
+	_Samp.clear();
+	size_t cnt = 0;
+	for (size_t w=0; w <= nw; w++)
+	{
+		_Rank[w] = cnt;
+		size_t m = POPCNT_U64(_Bits[w]);
+		// the words of the selected elements 64*j in [cnt, cnt+m)
+		for (size_t j=(cnt + 63) >> 6; (j << 6) < cnt + m; j++)
+			_Samp.push_back(w);
+		cnt += m;
+	}
+	_Rank[nw + 1] = cnt;
+	// a sentinel bounding the search after the last sample
+	size_t last = nw;
+	while (last > 0 && _Rank[last] == cnt) last --;
+	_Samp.push_back(last);
+	_Total = cnt;
+	_Valid = true;
+}
+
+void CSelRank::Clear()
+{
+	_Valid = false;
+	_Total = 0;
+	vector<C_UInt64>().swap(_Bits);
+	vector<size_t>().swap(_Rank);
+	vector<size_t>().swap(_Samp);
+}
+
+
+TSelection::TSelection()
+{
+	Pinned = _Packed = false;
+	_SampSelNum = _VarSelNum = -1;
+	_PkSampNum = _PkVarNum = 0;
+}
+
+int TSelection::SampleSelNum()
+{
+	if ((_SampSelNum < 0) && _SampRank.Valid())
+		_SampSelNum = _SampRank.Count();
+	if (_SampSelNum < 0)
+		_SampSelNum = vec_i8_cnt_nonzero((C_Int8*)pSample(), Sample.size());
+	return _SampSelNum;
+}
+
+int TSelection::VariantSelNum()
+{
+	if ((_VarSelNum < 0) && _VarRank.Valid())
+		_VarSelNum = _VarRank.Count();
+	if (_VarSelNum < 0)
+		_VarSelNum = vec_i8_cnt_nonzero((C_Int8*)pVariant(), Variant.size());
+	return _VarSelNum;
+}
+
+CSelRank &TSelection::SampleRank()
+{
+	if (!_SampRank.Valid())
+		_SampRank.Init(pSample(), Sample.size());
+	return _SampRank;
+}
+
+CSelRank &TSelection::VariantRank()
+{
+	if (!_VarRank.Valid())
+		_VarRank.Init(pVariant(), Variant.size());
+	return _VarRank;
+}
+
+/// sel[i] &= flag[i] on the words packed from the bytes, returning the
+/// number of selected elements
+static int sel_intersect(vector<C_BOOL> &sel, const C_BOOL *flag)
+{
+	const size_t n = sel.size();
+	if (n <= 0) return 0;
+	const size_t nw = (n + 63) >> 6;
+	vector<C_UInt64> a(nw), b(nw);
+	vec_u8_pack_bool((const C_UInt8*)&sel[0], n, &a[0]);
+	vec_u8_pack_bool((const C_UInt8*)flag, n, &b[0]);
+	size_t cnt = 0;
+	for (size_t i=0; i < nw; i++)
+		cnt += POPCNT_U64(a[i] &= b[i]);
+	vec_u8_unpack_bool(&a[0], n, (C_UInt8*)&sel[0]);
+	return cnt;
+}
+
+void TSelection::IntersectVariant(const C_BOOL *flag)
+{
+	wVariant();
+	_VarSelNum = sel_intersect(Variant, flag);
+}
+
+void TSelection::Pack()
+{
+	if (_Packed || Pinned) return;
+	_SampRank.Clear();
+	_VarRank.Clear();
+	// samples
+	_PkSampNum = Sample.size();
+	_PkSample.resize((_PkSampNum + 63) / 64);
+	if (_PkSampNum > 0)
+		_SampSelNum = vec_u8_pack_bool((C_UInt8*)&Sample[0],
+			_PkSampNum, &_PkSample[0]);
+	vector<C_BOOL>().swap(Sample);
+	// variants
+	_PkVarNum = Variant.size();
+	_PkVariant.resize((_PkVarNum + 63) / 64);
+	if (_PkVarNum > 0)
+		_VarSelNum = vec_u8_pack_bool((C_UInt8*)&Variant[0],
+			_PkVarNum, &_PkVariant[0]);
+	vector<C_BOOL>().swap(Variant);
+	_Packed = true;
+}
+
+void TSelection::Unpack()
+{
+	if (!_Packed) return;
+	Sample.resize(_PkSampNum);
+	if (_PkSampNum > 0)
+		vec_u8_unpack_bool(&_PkSample[0], _PkSampNum, (C_UInt8*)&Sample[0]);
+	vector<C_UInt64>().swap(_PkSample);
+	Variant.resize(_PkVarNum);
+	if (_PkVarNum > 0)
+		vec_u8_unpack_bool(&_PkVariant[0], _PkVarNum, (C_UInt8*)&Variant[0]);
+	vector<C_UInt64>().swap(_PkVariant);
+	_Packed = false;
+}
+
+
+
 // ===========================================================
 // SeqArray GDS file information
 // ===========================================================
@@ -486,6 +1046,7 @@ CFileInfo::CFileInfo(PdGDSFolder root)
 {
 	_Root = NULL;
 	_SampleNum = _VariantNum = 0;
+	_NumBackground = 0;
 	ResetRoot(root);
 }
 
@@ -502,8 +1063,11 @@ void CFileInfo::ResetRoot(PdGDSFolder root)
 		// initialize
 		_Root = root;
 		SelList.clear();
+		_ThreadSel.clear();
 		_Chrom.Clear();
 		_Position.clear();
+		_SampIdInt.Clear(); _SampIdStr.Clear();
+		_VarIdInt.Clear(); _VarIdStr.Clear();
 
 		// sample.id
 		PdAbstractArray Node = GDS_Node_Path(root, "sample.id", TRUE);
@@ -534,14 +1098,22 @@ void CFileInfo::ResetRoot(PdGDSFolder root)
 	}
 }
 
+void CFileInfo::SetIndexCache(const string &gds_fn, const string &cache_fn)
+{
+	_IndexCache.Reset(gds_fn, cache_fn);
+}
+
 TSelection &CFileInfo::Selection()
 {
 	if (!_Root)
 		throw ErrSeqArray(ERR_FILE_ROOT);
-	if (SelList.empty())
-		SelList.push_back(TSelection());
+	list<TSelection> &sel_list = SelStack();
+	if (sel_list.empty())
+		sel_list.push_back(TSelection());
 
-	TSelection &s = SelList.back();
+	TSelection &s = sel_list.back();
+	if (s.Packed())
+		s.Unpack();
 	if (s.Sample.empty())
 		s.Sample.resize(_SampleNum, TRUE);
 	if (s.Variant.empty())
@@ -550,6 +1122,54 @@ TSelection &CFileInfo::Selection()
 	return s;
 }
 
+void CFileInfo::SelPush(bool reset)
+{
+	list<TSelection> &sel_list = SelStack();
+	if (reset || sel_list.empty())
+	{
+		sel_list.push_back(TSelection());
+	} else {
+		sel_list.push_back(Selection());
+		sel_list.back().Pinned = false;
+	}
+	// the previous selection is not in use until popped up
+	if (sel_list.size() > 1)
+		(++sel_list.rbegin())->Pack();
+}
+
+void CFileInfo::SelPop()
+{
+	list<TSelection> &sel_list = SelStack();
+	if (sel_list.size() <= 1)
+		throw ErrSeqArray("No filter can be pop up.");
+	sel_list.pop_back();
+}
+
+list<TSelection> &CFileInfo::SelStack()
+{
+	if (!_ThreadSel.empty())
+	{
+		map<thread::id, list<TSelection> >::iterator it =
+			_ThreadSel.find(this_thread::get_id());
+		if (it != _ThreadSel.end()) return it->second;
+	}
+	return SelList;
+}
+
+void CFileInfo::ThreadSelBegin()
+{
+	TSelection s = Selection();
+	s.Pinned = false;
+	list<TSelection> &sel_list = _ThreadSel[this_thread::get_id()];
+	sel_list.clear();
+	sel_list.push_back(s);
+}
+
+void CFileInfo::ThreadSelEnd()
+{
+	_ThreadSel.erase(this_thread::get_id());
+}
+
 CChromIndex &CFileInfo::Chromosome()
 {
 	if (!_Root)
@@ -577,12 +1197,32 @@ vector<C_Int32> &CFileInfo::Position()
 	return _Position;
 }
 
+bool CFileInfo::PositionSorted(CChromIndex::TRange &rng)
+{
+	if (rng.Sorted < 0)
+	{
+		const C_Int32 *p = &Position()[rng.Start];
+		rng.Sorted = 1;
+		for (int i=1; i < rng.Length; i++)
+			if (p[i] < p[i-1]) { rng.Sorted = 0; break; }
+	}
+	return rng.Sorted != 0;
+}
+
 CGenoIndex &CFileInfo::GenoIndex()
 {
 	if (_GenoIndex.Empty())
 	{
-		PdAbstractArray I = GetObj("genotype/@data", TRUE);
-		_GenoIndex.Init(I);
+		static const char *VarName = "genotype/@data";
+		PdAbstractArray I = GetObj(VarName, TRUE);
+		if (_IndexCache.Load(VarName, GDS_Array_GetTotalCount(I),
+			_GenoIndex.Values, _GenoIndex.Lengths))
+		{
+			_GenoIndex.InitRLE();
+		} else {
+			_GenoIndex.Init(I);
+			_IndexCache.Save(VarName, _GenoIndex.Values, _GenoIndex.Lengths);
+		}
 	}
 	return _GenoIndex;
 }
@@ -594,13 +1234,48 @@ CIndex &CFileInfo::VarIndex(const string &varname)
 	{
 		PdAbstractArray N = GDS_Node_Path(_Root, varname.c_str(), FALSE);
 		if (N == NULL)
+		{
 			I.InitOne(_VariantNum);
-		else
+		} else if (_IndexCache.Load(varname, GDS_Array_GetTotalCount(N),
+			I.Values, I.Lengths))
+		{
+			I.InitRLE();
+		} else {
 			I.Init(N);
+			_IndexCache.Save(varname, I.Values, I.Lengths);
+		}
 	}
 	return I;
 }
 
+CIdIndex<int> &CFileInfo::SampleIdInt()
+{
+	if (_SampIdInt.Empty())
+		_SampIdInt.Init(GetObj("sample.id", TRUE), svInt32);
+	return _SampIdInt;
+}
+
+CIdIndex<string> &CFileInfo::SampleIdStr()
+{
+	if (_SampIdStr.Empty())
+		_SampIdStr.Init(GetObj("sample.id", TRUE), svStrUTF8);
+	return _SampIdStr;
+}
+
+CIdIndex<int> &CFileInfo::VariantIdInt()
+{
+	if (_VarIdInt.Empty())
+		_VarIdInt.Init(GetObj("variant.id", TRUE), svInt32);
+	return _VarIdInt;
+}
+
+CIdIndex<string> &CFileInfo::VariantIdStr()
+{
+	if (_VarIdStr.Empty())
+		_VarIdStr.Init(GetObj("variant.id", TRUE), svStrUTF8);
+	return _VarIdStr;
+}
+
 PdAbstractArray CFileInfo::GetObj(const char *name, C_BOOL MustExist)
 {
 	if (!_Root)
@@ -610,14 +1285,12 @@ PdAbstractArray CFileInfo::GetObj(const char *name, C_BOOL MustExist)
 
 int CFileInfo::SampleSelNum()
 {
-	TSelection &sel = Selection();
-	return vec_i8_cnt_nonzero((C_Int8*)&sel.Sample[0], _SampleNum);
+	return Selection().SampleSelNum();
 }
 
 int CFileInfo::VariantSelNum()
 {
-	TSelection &sel = Selection();
-	return vec_i8_cnt_nonzero((C_Int8*)&sel.Variant[0], _VariantNum);
+	return Selection().VariantSelNum();
 }
 
 
@@ -1143,14 +1816,21 @@ COREARRAY_DLL_LOCAL bool numpy_init()
 
 static const char *err_new_array = "Fails to allocate a new numpy array object.";
 
-static PyObject* new_array(size_t n, NPY_TYPES type)
+static PyObject* new_array(int ndim, npy_intp *dims, NPY_TYPES type)
 {
-	npy_intp dims[1] = { (npy_intp)n };
-	PyObject *rv = PyArray_SimpleNew(1, dims, type);
+	STAT_TIMER(tm, STAT_NUMPY_ALLOC);
+	PyObject *rv = PyArray_SimpleNew(ndim, dims, type);
 	if (rv == NULL) throw ErrSeqArray(err_new_array);
+	STAT_BYTES(STAT_NUMPY_ALLOC, PyArray_NBYTES((PyArrayObject*)rv));
 	return rv;
 }
 
+static PyObject* new_array(size_t n, NPY_TYPES type)
+{
+	npy_intp dims[1] = { (npy_intp)n };
+	return new_array(1, dims, type);
+}
+
 
 COREARRAY_DLL_LOCAL PyObject* numpy_new_bool(size_t n)
 {
@@ -1165,17 +1845,13 @@ COREARRAY_DLL_LOCAL PyObject* numpy_new_uint8(size_t n)
 COREARRAY_DLL_LOCAL PyObject* numpy_new_uint8_mat(size_t n1, size_t n2)
 {
 	npy_intp dims[2] = { (npy_intp)n1, (npy_intp)n2 };
-	PyObject *rv = PyArray_SimpleNew(2, dims, NPY_UINT8);
-	if (rv == NULL) throw ErrSeqArray(err_new_array);
-	return rv;
+	return new_array(2, dims, NPY_UINT8);
 }
 
 COREARRAY_DLL_LOCAL PyObject* numpy_new_uint8_dim3(size_t n1, size_t n2, size_t n3)
 {
 	npy_intp dims[3] = { (npy_intp)n1, (npy_intp)n2, (npy_intp)n3 };
-	PyObject *rv = PyArray_SimpleNew(3, dims, NPY_UINT8);
-	if (rv == NULL) throw ErrSeqArray(err_new_array);
-	return rv;
+	return new_array(3, dims, NPY_UINT8);
 }
 
 
@@ -1187,17 +1863,24 @@ COREARRAY_DLL_LOCAL PyObject* numpy_new_int32(size_t n)
 COREARRAY_DLL_LOCAL PyObject* numpy_new_int32_mat(size_t n1, size_t n2)
 {
 	npy_intp dims[2] = { (npy_intp)n1, (npy_intp)n2 };
-	PyObject *rv = PyArray_SimpleNew(2, dims, NPY_INT32);
-	if (rv == NULL) throw ErrSeqArray(err_new_array);
-	return rv;
+	return new_array(2, dims, NPY_INT32);
 }
 
 COREARRAY_DLL_LOCAL PyObject* numpy_new_int32_dim3(size_t n1, size_t n2, size_t n3)
 {
 	npy_intp dims[3] = { (npy_intp)n1, (npy_intp)n2, (npy_intp)n3 };
-	PyObject *rv = PyArray_SimpleNew(3, dims, NPY_INT32);
-	if (rv == NULL) throw ErrSeqArray(err_new_array);
-	return rv;
+	return new_array(3, dims, NPY_INT32);
+}
+
+COREARRAY_DLL_LOCAL PyObject* numpy_new_int64(size_t n)
+{
+	return new_array(n, NPY_INT64);
+}
+
+
+COREARRAY_DLL_LOCAL PyObject* numpy_new_float64(size_t n)
+{
+	return new_array(n, NPY_FLOAT64);
 }
 
 
@@ -1213,6 +1896,26 @@ COREARRAY_DLL_LOCAL PyObject* numpy_new_list(size_t n)
 }
 
 
+COREARRAY_DLL_LOCAL PyObject* numpy_new_chrom_pos(size_t n)
+{
+	STAT_TIMER(tm, STAT_NUMPY_ALLOC);
+	// packed records of TChromPos
+	PyObject *spec = Py_BuildValue("[(ss)(ss)(ss)]", "chrom", "i4",
+		"pos", "i4", "dup", "i4");
+	if (spec == NULL) throw ErrSeqArray(err_new_array);
+	PyArray_Descr *descr = NULL;
+	int ok = PyArray_DescrConverter(spec, &descr);
+	Py_DECREF(spec);
+	if (!ok) throw ErrSeqArray(err_new_array);
+	npy_intp dims[1] = { (npy_intp)n };
+	PyObject *rv = PyArray_NewFromDescr(&PyArray_Type, descr, 1, dims,
+		NULL, NULL, 0, NULL);  // steal the reference of descr
+	if (rv == NULL) throw ErrSeqArray(err_new_array);
+	STAT_BYTES(STAT_NUMPY_ALLOC, n * sizeof(TChromPos));
+	return rv;
+}
+
+
 COREARRAY_DLL_LOCAL bool numpy_is_array(PyObject *obj)
 {
 	return PyArray_Check(obj) != 0;
@@ -1281,6 +1984,111 @@ COREARRAY_DLL_LOCAL void numpy_setval(PyObject *obj, void *ptr, PyObject *val)
 }
 
 
+/// transpose a (n1, n2) matrix of elements to (n2, n1) in cache-sized tiles,
+/// with the row lengths src_ld of 'src' and dst_ld of 'dst'
+template<typename TYPE>
+	static void transpose_tile(const TYPE *src, TYPE *dst, size_t n1, size_t n2,
+		size_t src_ld, size_t dst_ld)
+{
+	static const size_t TILE = 64;
+	for (size_t i0=0; i0 < n1; i0+=TILE)
+	{
+		const size_t i1 = (i0+TILE < n1) ? i0+TILE : n1;
+		for (size_t j0=0; j0 < n2; j0+=TILE)
+		{
+			const size_t j1 = (j0+TILE < n2) ? j0+TILE : n2;
+			for (size_t i=i0; i < i1; i++)
+			{
+				const TYPE *s = src + i*src_ld;
+				for (size_t j=j0; j < j1; j++)
+					dst[j*dst_ld + i] = s[j];
+			}
+		}
+	}
+}
+
+/// transpose with elements of 'es' bytes
+static void transpose_bytes(const void *src, void *dst, size_t n1, size_t n2,
+	size_t src_ld, size_t dst_ld, size_t es)
+{
+	switch (es)
+	{
+	case 1:
+		transpose_tile((const C_UInt8*)src, (C_UInt8*)dst, n1, n2,
+			src_ld, dst_ld);
+		break;
+	case 2:
+		transpose_tile((const C_UInt16*)src, (C_UInt16*)dst, n1, n2,
+			src_ld, dst_ld);
+		break;
+	case 4:
+		transpose_tile((const C_UInt32*)src, (C_UInt32*)dst, n1, n2,
+			src_ld, dst_ld);
+		break;
+	case 8:
+		transpose_tile((const C_UInt64*)src, (C_UInt64*)dst, n1, n2,
+			src_ld, dst_ld);
+		break;
+	default:
+		for (size_t i=0; i < n1; i++)
+		{
+			const C_UInt8 *s = (const C_UInt8*)src + i*src_ld*es;
+			for (size_t j=0; j < n2; j++, s+=es)
+				memcpy((C_UInt8*)dst + (j*dst_ld + i)*es, s, es);
+		}
+	}
+}
+
+/// check a C-contiguous numeric array with at least two dimensions, and
+/// return the number of bytes of an element in the first two dimensions
+static size_t dim12_elem_size(PyArrayObject *arr)
+{
+	const int ndim = PyArray_NDIM(arr);
+	if (ndim < 2)
+		throw ErrSeqArray("Need at least two dimensions to swap.");
+	if (PyArray_TYPE(arr)==NPY_OBJECT || !PyArray_IS_C_CONTIGUOUS(arr))
+		throw ErrSeqArray("Need a C-contiguous numeric array to swap dimensions.");
+	size_t es = PyArray_ITEMSIZE(arr);
+	for (int i=2; i < ndim; i++) es *= PyArray_DIMS(arr)[i];
+	return es;
+}
+
+COREARRAY_DLL_LOCAL PyObject* numpy_swap_dim12(PyObject *obj)
+{
+	PyArrayObject *arr = (PyArrayObject*)obj;
+	const size_t es = dim12_elem_size(arr);
+	const size_t n1 = PyArray_DIMS(arr)[0], n2 = PyArray_DIMS(arr)[1];
+	PyObject *rv = numpy_new_dim12(obj, n2, n1);
+	transpose_bytes(PyArray_DATA(arr), PyArray_DATA((PyArrayObject*)rv),
+		n1, n2, n2, n1, es);
+	return rv;
+}
+
+COREARRAY_DLL_LOCAL PyObject* numpy_new_dim12(PyObject *obj, size_t n1,
+	size_t n2)
+{
+	PyArrayObject *arr = (PyArrayObject*)obj;
+	const int ndim = PyArray_NDIM(arr);
+	vector<npy_intp> dims(PyArray_DIMS(arr), PyArray_DIMS(arr) + ndim);
+	dims[0] = n1; dims[1] = n2;
+	return new_array(ndim, &dims[0], (NPY_TYPES)PyArray_TYPE(arr));
+}
+
+COREARRAY_DLL_LOCAL void numpy_swap_dim12_to(PyObject *src, size_t col,
+	size_t ncol, PyObject *dst, size_t row)
+{
+	PyArrayObject *s = (PyArrayObject*)src, *d = (PyArrayObject*)dst;
+	const size_t es = dim12_elem_size(s);
+	const size_t n1 = PyArray_DIMS(s)[0], n2 = PyArray_DIMS(s)[1];
+	const size_t m2 = PyArray_DIMS(d)[1];
+	if ((dim12_elem_size(d) != es) || (col + ncol > n2) ||
+			((size_t)PyArray_DIMS(d)[0] != ncol) || (row + n1 > m2))
+		throw ErrSeqArray("Invalid dimensions to swap.");
+	transpose_bytes((const C_UInt8*)PyArray_DATA(s) + col*es,
+		(C_UInt8*)PyArray_DATA(d) + row*es, n1, ncol, n2, m2, es);
+}
+
+
 COREARRAY_DLL_LOCAL void numpy_to_int32(PyObject *obj, vector<int> &out)
 {
 	if (PyArray_Check(obj))
@@ -27,11 +27,17 @@
 #include <dTrait.h>
 
 #include <string>
+#include <algorithm>
 #include <vector>
 #include <list>
 #include <map>
 #include <set>
 #include <ctime>
+#include <thread>
+#ifdef PYSEQARRAY_STATS
+#   include <atomic>
+#   include <chrono>
+#endif
 
 #include <cctype>
 #include <cstring>
@@ -80,7 +86,7 @@ public:
 		Position = AccIndex = AccOffset = 0;
 	}
 
-	void Add(TYPE &val, C_UInt32 len)
+	void Add(const TYPE &val, C_UInt32 len)
 	{
 		Values.push_back(val);
 		Lengths.push_back(len);
@@ -136,6 +142,22 @@ protected:
 // Indexing object
 // ===========================================================
 
+/// the number of runs between two entries of a skip table
+const size_t RLE_SKIP_STEP = 64;
+
+/// Sampled prefix sums of a run-length encoding for random access
+struct COREARRAY_DLL_LOCAL TRLESkipTable
+{
+	vector<C_Int64> Pos;  ///< the position at the start of every RLE_SKIP_STEP runs
+	vector<C_Int64> Sum;  ///< the accumulated sum of values according to Pos
+
+	/// clear the table
+	void Clear() { Pos.clear(); Sum.clear(); }
+	/// return the entry index containing the position (Pos should not be empty)
+	size_t Find(size_t pos) const;
+};
+
+
 /// Indexing object with run-length encoding
 class COREARRAY_DLL_LOCAL CIndex
 {
@@ -152,6 +174,8 @@ public:
 	void Init(PdContainer Obj);
 	/// load data and represent as run-length encoding
 	void InitOne(int num);
+	/// initialize the cursor and skip table after setting Values and Lengths
+	void InitRLE();
 	/// return the accumulated sum of values and current value in Lengths and Values given by a position
 	void GetInfo(size_t pos, C_Int64 &Sum, int &Value);
 	/// get lengths with selection
@@ -173,6 +197,8 @@ protected:
 	size_t AccIndex;
 	/// the offset according the value of Lengths[AccIndex]
 	size_t AccOffset;
+	/// the skip table used when seeking backward or far forward
+	TRLESkipTable Skip;
 };
 
 
@@ -190,6 +216,8 @@ public:
 
 	/// load data and represent as run-length encoding
 	void Init(PdContainer Obj);
+	/// initialize the cursor and skip table after setting Values and Lengths
+	void InitRLE();
 	/// return the accumulated sum of values and current value in Lengths and Values given by a position
 	void GetInfo(size_t pos, C_Int64 &Sum, C_UInt8 &Value);
 	/// return true if empty
@@ -206,6 +234,75 @@ protected:
 	size_t AccIndex;
 	/// the offset according the value of Lengths[AccIndex]
 	size_t AccOffset;
+	/// the skip table used when seeking backward or far forward
+	TRLESkipTable Skip;
+};
+
+
+
+// ===========================================================
+// Persistent index cache
+// ===========================================================
+
+/// Sidecar file storing the run-length encodings of '@data' index variables
+/// to avoid scanning them when a file is opened; the cache is validated by
+/// the size and modification time of the GDS file
+/** The directory of entries is read once, and the new entries are kept in
+ *  memory and written together with the cached ones by Flush().
+**/
+class COREARRAY_DLL_LOCAL CIndexCache
+{
+public:
+	/// constructor
+	CIndexCache();
+	/// destructor, writing the new entries
+	~CIndexCache();
+
+	/// set the GDS file name and the sidecar file name (empty to disable)
+	void Reset(const string &gds_fn, const string &cache_fn);
+	/// whether the cache is enabled
+	inline bool Enabled() const { return !_CacheFn.empty(); }
+
+	/// load the runs of an index variable with the total length, return
+	/// false if not cached or invalid
+	bool Load(const string &name, C_Int64 total, vector<int> &Values,
+		vector<C_UInt32> &Lengths);
+	bool Load(const string &name, C_Int64 total, vector<C_UInt16> &Values,
+		vector<C_UInt32> &Lengths);
+	/// add the runs of an index variable, written by Flush()
+	void Save(const string &name, const vector<int> &Values, const vector<C_UInt32> &Lengths);
+	void Save(const string &name, const vector<C_UInt16> &Values, const vector<C_UInt32> &Lengths);
+	/// rewrite the sidecar file if there are new entries
+	void Flush();
+
+protected:
+	/// an entry in the sidecar file
+	struct TEntry
+	{
+		C_Int64 Offset;  ///< the file offset of values
+		C_UInt64 NRun;   ///< the number of runs
+	};
+	/// a new entry
+	struct TNewEntry
+	{
+		vector<C_Int32> Values;    ///< the values of runs
+		vector<C_UInt32> Lengths;  ///< the lengths of runs
+	};
+
+	string _GDSFn;    ///< the file name of GDS file
+	string _CacheFn;  ///< the file name of sidecar file
+	bool _DirLoaded;  ///< whether _Dir has been loaded
+	C_Int64 _Stamp[2];  ///< the file size and modification time of GDS file
+	map<string, TEntry> _Dir;  ///< the valid entries in the sidecar file
+	map<string, TNewEntry> _NewEntry;  ///< the entries not written yet
+
+	/// get the file size and modification time of GDS file
+	bool FileStamp(C_Int64 &size, C_Int64 &mtime);
+	/// read the directory of sidecar file once, return false if disabled
+	bool LoadDir();
+	/// load an entry with 32-bit values
+	bool LoadEntry(const string &name, C_Int64 total, vector<C_Int32> &Values,
+		vector<C_UInt32> &Lengths);
 };
 
 
@@ -223,6 +320,7 @@ public:
 	{
 		int Start;   ///< the starting position
 		int Length;  ///< the length
+		int Sorted;  ///< whether the positions are sorted, -1 for unknown
 	};
 
 	typedef vector<TRange> TRangeList;
@@ -244,12 +342,25 @@ public:
 
 	inline const string &operator [](size_t pos) { return PosToChr[pos]; }
 
+	/// fill the chromosome codes (indices in Levels) of the selected variants
+	/// run by run, and return the number of codes
+	size_t GetCode(const C_BOOL *sel, C_Int32 *out);
+
 	/// map to TRangeList from chromosome coding
 	map<string, TRangeList> Map;
+	/// chromosomes in the order of first appearance
+	vector<string> Levels;
 
 protected:
 	/// position to chromosome
 	C_RLE<string> PosToChr;
+	/// the codes and lengths of runs of chromosomes
+	vector<C_Int32> RunCode;
+	vector<C_UInt32> RunLength;
+
+	/// add a run of chromosome
+	void AddRun(const string &chr, const TRange &rng,
+		map<string, C_Int32> &code);
 };
 
 
@@ -288,20 +399,230 @@ protected:
 
 
 
+// ===========================================================
+// Hash indexing of sample and variant IDs
+// ===========================================================
+
+/// hash functions of IDs, multiplied by 2^64/phi (Fibonacci hashing), so
+/// that the slot is taken from the high bits
+COREARRAY_DLL_LOCAL C_UInt64 IdHash(int id);
+COREARRAY_DLL_LOCAL C_UInt64 IdHash(const string &id);
+
+/// Open-addressing hash index from IDs to positions
+/** The IDs are loaded from a GDS node, and the positions sharing the same ID
+ *  are linked in ascending order.
+**/
+template<typename TYPE> class COREARRAY_DLL_LOCAL CIdIndex
+{
+public:
+	/// constructor
+	CIdIndex() { _Built = false; _Mask = 0; _Shift = 63; }
+
+	/// clear
+	void Clear()
+	{
+		_Built = false; _Mask = 0; _Shift = 63;
+		Id.clear(); _Slot.clear(); _Next.clear();
+	}
+
+	/// whether it is not initialized
+	inline bool Empty() const { return !_Built; }
+
+	/// load the IDs from a GDS node in the SVType 'sv' and build the index
+	void Init(PdAbstractArray Node, C_SVType sv)
+	{
+		Clear();
+		const C_Int32 n = GDS_Array_GetTotalCount(Node);
+		Id.resize(n);
+		if (n > 0)
+		{
+			C_Int32 st=0, cnt=n;
+			GDS_Array_ReadData(Node, &st, &cnt, &Id[0], sv);
+		}
+		size_t m = 16;
+		_Shift = 60;
+		while (m < 2*(size_t)n) { m <<= 1; _Shift --; }
+		_Mask = m - 1;
+		_Slot.assign(m, -1);
+		_Next.assign(n, -1);
+		for (C_Int32 i=n-1; i >= 0; i--)
+		{
+			C_Int32 &s = _Slot[_Find(Id[i])];
+			_Next[i] = s;
+			s = i;
+		}
+		_Built = true;
+	}
+
+	/// append the positions of 'id' to 'out'
+	inline void Find(const TYPE &id, vector<C_Int32> &out) const
+	{
+		for (C_Int32 i = _Slot[_Find(id)]; i >= 0; i = _Next[i])
+			out.push_back(i);
+	}
+
+	/// select the elements whose IDs are in 'ids', or unselect the others in
+	/// the current selection 'sel' if 'intersect'
+	void Select(const vector<TYPE> &ids, C_BOOL *sel, bool intersect) const
+	{
+		vector<C_Int32> hit;
+		hit.reserve(ids.size());
+		for (size_t i=0; i < ids.size(); i++)
+			Find(ids[i], hit);
+		vector<C_BOOL> keep(hit.size(), TRUE);
+		if (intersect)
+		{
+			for (size_t i=0; i < hit.size(); i++)
+				keep[i] = sel[hit[i]];
+		}
+		memset(sel, 0, Id.size());
+		for (size_t i=0; i < hit.size(); i++)
+			sel[hit[i]] = keep[i];
+	}
+
+	vector<TYPE> Id;  ///< the IDs
+
+protected:
+	bool _Built;     ///< whether the index is built
+	size_t _Mask;    ///< the number of slots - 1
+	int _Shift;      ///< 64 - log2(the number of slots)
+	vector<C_Int32> _Slot;  ///< the first position of each slot, -1 for empty
+	vector<C_Int32> _Next;  ///< the next position with the same ID, or -1
+
+	/// return the slot of 'id', or the empty slot if not found
+	inline size_t _Find(const TYPE &id) const
+	{
+		size_t s = (size_t)(IdHash(id) >> _Shift);
+		while ((_Slot[s] >= 0) && !(Id[_Slot[s]] == id))
+			s = (s + 1) & _Mask;
+		return s;
+	}
+};
+
+
+
+
 // ===========================================================
 // SeqArray GDS file information
 // ===========================================================
 
+/// Rank/select index over a selection
+/** The selection is packed in bits with the cumulative counts per 64-bit word
+ *  (rank), and the word of every 64-th selected element is sampled (select).
+**/
+class COREARRAY_DLL_LOCAL CSelRank
+{
+public:
+	/// constructor
+	CSelRank() { _Valid = false; _Total = 0; }
+
+	/// build the index from a selection of n elements
+	void Init(const C_BOOL *sel, size_t n);
+	/// release the memory
+	void Clear();
+
+	/// whether the index is built for the current selection
+	inline bool Valid() const { return _Valid; }
+	/// mark the index out of date, but keep the data until rebuilt
+	inline void Invalidate() { _Valid = false; }
+
+	/// the total number of selected elements
+	inline size_t Count() const { return _Total; }
+	/// the number of selected elements before the index i (i <= n)
+	inline size_t Rank(size_t i) const
+	{
+		size_t w = i >> 6, b = i & 0x3F;
+		return (b == 0) ? _Rank[w] :
+			_Rank[w] + POPCNT_U64(_Bits[w] & ((~(C_UInt64)0) >> (64 - b)));
+	}
+	/// the index of the k-th selected element (k < Count())
+	/** The word is searched between two samples, which are at most 64
+	 *  selected elements apart, so it takes O(log(n/64)) in the worst case
+	 *  and O(1) when the selection is dense.
+	**/
+	inline size_t Select(size_t k) const
+	{
+		const size_t j = k >> 6;
+		size_t w = _Samp[j];
+		if (_Rank[w+1] <= k)
+		{
+			// the last word w in (_Samp[j], _Samp[j+1]] with _Rank[w] <= k
+			w = std::upper_bound(_Rank.begin() + w + 1,
+				_Rank.begin() + _Samp[j+1] + 1, k) - _Rank.begin() - 1;
+		}
+		C_UInt64 v = _Bits[w];
+		for (size_t r = k - _Rank[w]; r > 0; r--) v &= v - 1;
+		return (w << 6) + CTZ_U64(v);
+	}
+
+protected:
+	bool _Valid;     ///< whether it is built for the current selection
+	size_t _Total;   ///< the total number of selected elements
+	vector<C_UInt64> _Bits;  ///< the packed selection
+	vector<size_t> _Rank;    ///< the number of selected elements before each word
+	vector<size_t> _Samp;    ///< the word of the (64*j)-th selected element,
+	                         ///< ended with the last word having a selection
+};
+
+
 /// selection object used in GDS file
+/** The selection in use is stored in bytes which are passed to the GDS
+ *  reading functions. A selection beneath the top of a filter stack is packed
+ *  in bits, and the numbers of selected elements are cached.
+**/
 struct COREARRAY_DLL_LOCAL TSelection
 {
 	vector<C_BOOL> Sample;   ///< sample selection
 	vector<C_BOOL> Variant;  ///< variant selection
+	bool Pinned;  ///< true if referred by Apply, not to be packed
+
+	/// constructor
+	TSelection();
 
 	inline C_BOOL *pSample()
 		{ return Sample.empty() ? NULL : &Sample[0]; }
 	inline C_BOOL *pVariant()
 		{ return Variant.empty() ? NULL : &Variant[0]; }
+
+	/// return the sample selection for modification, resetting the cached
+	/// count and rank/select index
+	inline C_BOOL *wSample()
+		{ _SampSelNum = -1; _SampRank.Invalidate(); return pSample(); }
+	/// return the variant selection for modification, resetting the cached
+	/// count and rank/select index
+	inline C_BOOL *wVariant()
+		{ _VarSelNum = -1; _VarRank.Invalidate(); return pVariant(); }
+
+	/// the number of selected samples
+	int SampleSelNum();
+	/// the number of selected variants
+	int VariantSelNum();
+
+	/// the rank/select index of the sample selection, built on first use
+	CSelRank &SampleRank();
+	/// the rank/select index of the variant selection, built on first use
+	CSelRank &VariantRank();
+
+	/// intersect the variant selection with 'flag' on the packed words
+	void IntersectVariant(const C_BOOL *flag);
+
+	/// whether the selection is packed in bits
+	inline bool Packed() const { return _Packed; }
+	/// pack the selection in bits, unless pinned
+	void Pack();
+	/// unpack the selection from bits
+	void Unpack();
+
+protected:
+	int _SampSelNum;  ///< the number of selected samples, -1 for unknown
+	int _VarSelNum;   ///< the number of selected variants, -1 for unknown
+	bool _Packed;     ///< whether packed in bits
+	size_t _PkSampNum;   ///< the number of samples when packed
+	size_t _PkVarNum;    ///< the number of variants when packed
+	vector<C_UInt64> _PkSample;   ///< packed sample selection
+	vector<C_UInt64> _PkVariant;  ///< packed variant selection
+	CSelRank _SampRank;  ///< rank/select index of samples
+	CSelRank _VarRank;   ///< rank/select index of variants
 };
 
 
@@ -318,13 +639,41 @@ public:
 
 	/// reset the root of GDS file
 	void ResetRoot(PdGDSFolder root);
+	/// use a sidecar file to cache the indexing objects (empty to disable)
+	void SetIndexCache(const string &gds_fn, const string &cache_fn);
 	/// get selection
 	TSelection &Selection();
+	/// push a new selection to the stack (all selected if 'reset', or a copy
+	/// of the current selection), and pack the previous one in bits
+	void SelPush(bool reset);
+	/// pop up the current selection from the stack
+	void SelPop();
+	/// the selection stack of the calling thread, SelList if not a worker
+	list<TSelection> &SelStack();
+
+	/// register the calling thread as a worker of RunParallel(backend='threads'),
+	/// with its own selection stack copied from the current selection
+	void ThreadSelBegin();
+	/// unregister the calling thread
+	void ThreadSelEnd();
+	/// whether there are worker threads sharing the file
+	inline bool InThreads() const { return !_ThreadSel.empty(); }
+	/// register or unregister a native thread reading GDS nodes in background,
+	/// e.g., the prefetching in Apply (with the GIL held)
+	inline void BackgroundBegin() { _NumBackground ++; }
+	inline void BackgroundEnd() { _NumBackground --; }
+	/// whether other threads may access the GDS nodes and indexing objects,
+	/// if so, GDS_Mutex should be locked
+	inline bool GDSShared() const
+		{ return !_ThreadSel.empty() || (_NumBackground > 0); }
 
 	/// return _Chrom which has been initialized
 	CChromIndex &Chromosome();
 	/// return _Position which has been initialized
 	vector<C_Int32> &Position();
+	/// whether the positions are sorted within a run of a chromosome in
+	/// Chromosome().Map, checked once per run
+	bool PositionSorted(CChromIndex::TRange &rng);
 
 	/// return _GenoIndex which has been initialized
 	CGenoIndex &GenoIndex();
@@ -332,6 +681,15 @@ public:
 	/// return the indexing object according to variable name
 	CIndex &VarIndex(const string &varname);
 
+	/// return the hash index of sample.id in integer
+	CIdIndex<int> &SampleIdInt();
+	/// return the hash index of sample.id in string
+	CIdIndex<string> &SampleIdStr();
+	/// return the hash index of variant.id in integer
+	CIdIndex<int> &VariantIdInt();
+	/// return the hash index of variant.id in string
+	CIdIndex<string> &VariantIdStr();
+
 	/// get gds object
 	PdAbstractArray GetObj(const char *name, C_BOOL MustExist);
 
@@ -357,6 +715,15 @@ protected:
 	vector<C_Int32> _Position;  ///< position
 	CGenoIndex _GenoIndex;  ///< the indexing object for genotypes
 	map<string, CIndex> _VarIndex;  ///< the indexing objects for INFO/FORMAT variables
+	CIndexCache _IndexCache;  ///< the sidecar file of indexing objects
+	CIdIndex<int> _SampIdInt;  ///< hash index of sample.id in integer
+	CIdIndex<string> _SampIdStr;  ///< hash index of sample.id in string
+	CIdIndex<int> _VarIdInt;  ///< hash index of variant.id in integer
+	CIdIndex<string> _VarIdStr;  ///< hash index of variant.id in string
+	/// the selection stacks of worker threads, accessed with the GIL held
+	map<thread::id, list<TSelection> > _ThreadSel;
+	/// the number of background threads reading GDS nodes
+	int _NumBackground;
 };
 
 
@@ -490,6 +857,82 @@ protected:
 
 
 
+// ===========================================================
+// Performance counters
+// ===========================================================
+
+/// the stages timed by the performance counters, see cc.stats()
+enum TStatStage
+{
+	STAT_GENO_READ = 0,  ///< reading 2-bit genotype layers from GDS
+	STAT_GENO_DECODE,    ///< decoding genotypes from the buffer of a run
+	STAT_GETDATA,        ///< VarGetData() in total
+	STAT_NUMPY_ALLOC,    ///< allocating numpy arrays
+	STAT_APPLY_READ,     ///< loading the variables of a block in Apply
+	STAT_APPLY_CALL,     ///< calling the user function in Apply
+	STAT_NUM_STAGE       ///< the number of stages
+};
+
+/// the names of stages, used in cc.stats()
+COREARRAY_DLL_LOCAL extern const char *StatStageName[STAT_NUM_STAGE];
+
+#ifdef PYSEQARRAY_STATS
+
+/// nanoseconds, bytes and the number of calls of a stage
+struct COREARRAY_DLL_LOCAL TStatCounter
+{
+	atomic<C_Int64> NanoSec;
+	atomic<C_Int64> Bytes;
+	atomic<C_Int64> Count;
+};
+
+/// the counters of stages
+COREARRAY_DLL_LOCAL extern TStatCounter StatStage[STAT_NUM_STAGE];
+/// the number of GDS_Iter_* calls
+COREARRAY_DLL_LOCAL extern atomic<C_Int64> StatGDSIter;
+/// the number of CIndex or CGenoIndex repositioning by the skip table
+COREARRAY_DLL_LOCAL extern atomic<C_Int64> StatIndexReset;
+
+/// adding the elapsed time of a scope to a stage
+class COREARRAY_DLL_LOCAL CStatTimer
+{
+public:
+	CStatTimer(int stage): Stage(stage), Start(chrono::steady_clock::now())
+		{ }
+	~CStatTimer()
+	{
+		TStatCounter &c = StatStage[Stage];
+		c.NanoSec.fetch_add(chrono::duration_cast<chrono::nanoseconds>(
+			chrono::steady_clock::now() - Start).count(),
+			memory_order_relaxed);
+		c.Count.fetch_add(1, memory_order_relaxed);
+	}
+private:
+	int Stage;
+	chrono::steady_clock::time_point Start;
+};
+
+#   define STAT_TIMER(var, stage)    CStatTimer var(stage)
+#   define STAT_BYTES(stage, n)    \
+		StatStage[stage].Bytes.fetch_add(n, memory_order_relaxed)
+#   define STAT_GDS_ITER(n)    StatGDSIter.fetch_add(n, memory_order_relaxed)
+#   define STAT_INDEX_RESET()    StatIndexReset.fetch_add(1, memory_order_relaxed)
+
+#else
+
+// no cost if the counters are disabled
+#   define STAT_TIMER(var, stage)
+#   define STAT_BYTES(stage, n)
+#   define STAT_GDS_ITER(n)
+#   define STAT_INDEX_RESET()
+
+#endif
+
+/// clear all performance counters
+COREARRAY_DLL_LOCAL void StatReset();
+
+
+
 // ===========================================================
 // Define Functions
 // ===========================================================
@@ -564,11 +1007,25 @@ COREARRAY_DLL_LOCAL PyObject* numpy_new_uint8_dim3(size_t n1, size_t n2, size_t
 COREARRAY_DLL_LOCAL PyObject* numpy_new_int32(size_t n);
 COREARRAY_DLL_LOCAL PyObject* numpy_new_int32_mat(size_t n1, size_t n2);
 COREARRAY_DLL_LOCAL PyObject* numpy_new_int32_dim3(size_t n1, size_t n2, size_t n3);
+COREARRAY_DLL_LOCAL PyObject* numpy_new_int64(size_t n);
+
+COREARRAY_DLL_LOCAL PyObject* numpy_new_float64(size_t n);
 
 COREARRAY_DLL_LOCAL PyObject* numpy_new_string(size_t n);
 
 COREARRAY_DLL_LOCAL PyObject* numpy_new_list(size_t n);
 
+/// a record of chromosome code, position and duplicate counter
+struct TChromPos
+{
+	C_Int32 Chrom;  ///< the index in the chromosome levels
+	C_Int32 Pos;    ///< the position
+	C_Int32 Dup;    ///< 0 for the first occurrence, 1, 2, ... for duplicates
+};
+
+/// a new numpy structured array of TChromPos with fields 'chrom', 'pos', 'dup'
+COREARRAY_DLL_LOCAL PyObject* numpy_new_chrom_pos(size_t n);
+
 COREARRAY_DLL_LOCAL bool numpy_is_array(PyObject *obj);
 COREARRAY_DLL_LOCAL bool numpy_is_array_or_list(PyObject *obj);
 COREARRAY_DLL_LOCAL bool numpy_is_array_int(PyObject *obj);
@@ -583,6 +1040,9 @@ COREARRAY_DLL_LOCAL size_t numpy_size(PyObject *obj);  // assuming obj is PyArra
 
 COREARRAY_DLL_LOCAL void* numpy_getptr(PyObject *obj);  // assuming obj is PyArray
 COREARRAY_DLL_LOCAL void numpy_setval(PyObject *obj, void *ptr, PyObject *val);  // assuming obj is PyArray
+COREARRAY_DLL_LOCAL PyObject* numpy_swap_dim12(PyObject *obj);  // assuming obj is PyArray, returning a new array
+COREARRAY_DLL_LOCAL PyObject* numpy_new_dim12(PyObject *obj, size_t n1, size_t n2);  // assuming obj is PyArray, a new array of the same type with the first two dimensions (n1, n2)
+COREARRAY_DLL_LOCAL void numpy_swap_dim12_to(PyObject *src, size_t col, size_t ncol, PyObject *dst, size_t row);  // dst[j, row+i, ...] = src[i, col+j, ...] for all i and j < ncol
 
 COREARRAY_DLL_LOCAL void numpy_to_int32(PyObject *obj, vector<int> &out);
 COREARRAY_DLL_LOCAL void numpy_to_string(PyObject *obj, vector<string> &out);
@@ -23,16 +23,451 @@
 
 #include <set>
 #include <algorithm>
+#include <cmath>
 
-// #include "ReadByVariant.h"
+#include "ReadByVariant.h"
 // #include "ReadBySample.h"
+#include "Parallel.h"
 #include <ctype.h>
 
 using namespace PySeqArray;
 
 
+// ======================================================================
+// Allele counts and frequencies
+// ======================================================================
+
+/// get the allele index of each selected variant, from None (the reference
+/// allele), an integer, a vector of integers or a vector of allele strings
+static void GetAlleleIndex(CFileInfo &File, PyObject *ref, vector<int> &out)
+{
+	const size_t nVariant = File.VariantSelNum();
+	out.clear();
+	if (ref == Py_None)
+	{
+		out.resize(nVariant, 0);
+	} else if (numpy_is_array_or_list(ref))
+	{
+		if (numpy_is_array_int(ref))
+		{
+			numpy_to_int32(ref, out);
+		} else if (numpy_is_array(ref) && !numpy_is_string(ref))
+		{
+			throw ErrSeqArray("'ref' should be a vector of integers or strings.");
+		} else {
+			// allele strings
+			vector<string> ss;
+			numpy_to_string(ref, ss);
+			if (ss.size() != nVariant)
+				throw ErrSeqArray("'ref' should have the same length as the selected variants.");
+			vector<string> allele(nVariant);
+			{
+				// other threads may be reading GDS nodes
+				CGDSLock lock(File.GDSShared());
+				PdAbstractArray N = File.GetObj("allele", TRUE);
+				C_BOOL *sel = File.Selection().pVariant();
+				if (nVariant > 0)
+					GDS_Array_ReadDataEx(N, NULL, NULL, &sel, &allele[0], svStrUTF8);
+			}
+			out.resize(nVariant);
+			for (size_t i=0; i < nVariant; i++)
+				out[i] = GetIndexOfAllele(ss[i].c_str(), allele[i].c_str());
+		}
+		if (out.size() != nVariant)
+			throw ErrSeqArray("'ref' should have the same length as the selected variants.");
+	} else if (PyIndex_Check(ref))
+	{
+		Py_ssize_t v = PyNumber_AsSsize_t(ref, NULL);
+		if (PyErr_Occurred()) throw ErrSeqArray("Invalid 'ref'.");
+		out.resize(nVariant, (int)v);
+	} else
+		throw ErrSeqArray("'ref' should be None, an integer, or a vector of integers or strings.");
+}
+
+/// create one reader per thread, each starting from its range of the selected
+/// variants, and return the number of threads; the readers lock GDS_Mutex if
+/// multithreaded or other threads share the file
+template<typename TYPE>
+static int NewThreadReaders(CFileInfo &File, int nthread, CVarApplyList &List)
+{
+	const int nVariant = File.VariantSelNum();
+	int nThread = GetNumThread(nthread);
+	if (nThread > nVariant) nThread = nVariant;
+	vector<size_t> st;
+	ParallelSplit(nThread, nVariant, st);
+	vector<int> pos;
+	ParallelSelPos(File.Selection().VariantRank(), st, pos);
+	const bool gds_lock = (nThread > 1) || File.GDSShared();
+	CGDSLock lock(File.GDSShared());
+	for (int i=0; i < nThread; i++)
+	{
+		TYPE *p = new TYPE(File);
+		List.push_back(p);
+		p->GDSLock = gds_lock;
+		p->Position = pos[i];
+	}
+	return nThread;
+}
+
+/// count the allele 'allele[i]' and the non-missing alleles of each selected
+/// variant, using multiple threads over variant ranges
+static void CountAllele(CFileInfo &File, const vector<int> &allele, int nthread,
+	C_Int32 *out_cnt, C_Int32 *out_nonmiss)
+{
+	const int nVariant = File.VariantSelNum();
+	if ((nVariant <= 0) || (File.SampleSelNum() <= 0))
+	{
+		for (int i=0; i < nVariant; i++) out_cnt[i] = out_nonmiss[i] = 0;
+		return;
+	}
+	CVarApplyList NodeList;
+	const int nThread =
+		NewThreadReaders<CApply_Variant_Geno>(File, nthread, NodeList);
+
+	ParallelFor(nThread, nVariant,
+		[&](int i, size_t start, size_t count) {
+			CApply_Variant_Geno *p = static_cast<CApply_Variant_Geno*>(NodeList[i]);
+			const size_t n = p->SampNum * p->Ploidy;
+			vector<C_UInt8> buf(n);
+			for (size_t k=start; k < start+count; k++)
+			{
+				p->ReadGenoData(&buf[0]);
+				p->Next();
+				// the allele index 255 is not distinguishable from missing
+				size_t m=0, nmiss=0;
+				int a = allele[k];
+				if ((0 <= a) && (a < NA_UINT8))
+				{
+					vec_i8_count2((const char*)&buf[0], n, a, (char)NA_UINT8,
+						&m, &nmiss);
+				} else
+					nmiss = vec_i8_count((const char*)&buf[0], n, (char)NA_UINT8);
+				out_cnt[k] = m;
+				out_nonmiss[k] = n - nmiss;
+			}
+		}, nThread > 1);
+}
+
+
+
+// ======================================================================
+// Native reductions over dosages
+// ======================================================================
+
+/// a streaming reduction over the dosages of the selected variants
+/** The dosage is the number of reference alleles per sample, NA_UINT8 for
+ *  missing. A dosage class is 0 .. Ploidy, and Ploidy+1 for missing.
+**/
+class COREARRAY_DLL_LOCAL CReduce
+{
+public:
+	virtual ~CReduce() {}
+	/// initialize accumulators with the numbers of threads, variants and samples
+	virtual void Init(int nThread, size_t nVar, size_t nSamp, int Ploidy) = 0;
+	/// accumulate the dosages 'd' of the k-th selected variant in the thread i
+	virtual void Add(int i, size_t k, const C_UInt8 *d) = 0;
+	/// merge the accumulators and return a numpy array
+	virtual PyObject *Result() = 0;
+};
+
+/// the names of reductions
+static const char *REDUCE_NAMES[] = {
+	"variant.dosage_count", "variant.dosage_sum", "variant.dosage_sqsum",
+	"variant.nonmiss",
+	"sample.dosage_count", "sample.dosage_sum", "sample.dosage_sqsum",
+	"sample.nonmiss",
+	NULL
+};
+
+/// per-variant reductions, each thread writes its own rows
+class COREARRAY_DLL_LOCAL CReduce_Variant: public CReduce
+{
+protected:
+	int Type, NumClass;
+	size_t NumSamp;
+	vector<C_Int32> Cnt;
+	vector<C_Int64> Sum;
+public:
+	CReduce_Variant(int type) { Type = type; }
+
+	virtual void Init(int, size_t nVar, size_t nSamp, int Ploidy)
+	{
+		NumSamp = nSamp;
+		NumClass = Ploidy + 2;
+		if (Type == 0)
+			Cnt.assign(nVar * NumClass, 0);
+		else
+			Sum.assign(nVar, 0);
+	}
+
+	virtual void Add(int, size_t k, const C_UInt8 *d)
+	{
+		switch (Type)
+		{
+		case 0:  // the counts of dosage classes
+			{
+				C_Int32 *p = &Cnt[k * NumClass];
+				if (NumClass == 4)
+				{
+					size_t n0, n1, n2;
+					vec_i8_count3((const char*)d, NumSamp, 0, 1, 2, &n0, &n1, &n2);
+					p[0] = n0; p[1] = n1; p[2] = n2;
+					p[3] = NumSamp - n0 - n1 - n2;
+				} else {
+					const int m = NumClass - 1;
+					for (size_t j=0; j < NumSamp; j++)
+						p[(d[j] < m) ? d[j] : m] ++;
+				}
+				break;
+			}
+		case 1: case 2:  // the sum of dosages or squared dosages
+			{
+				C_Int64 s = 0;
+				for (size_t j=0; j < NumSamp; j++)
+				{
+					C_Int64 v = d[j];
+					if (v != NA_UINT8) s += (Type == 1) ? v : v*v;
+				}
+				Sum[k] = s;
+				break;
+			}
+		case 3:  // the number of non-missing dosages
+			Sum[k] = NumSamp - vec_i8_count((const char*)d, NumSamp, (char)NA_UINT8);
+			break;
+		}
+	}
+
+	virtual PyObject *Result()
+	{
+		if (Type == 0)
+		{
+			PyObject *rv = numpy_new_int32_mat(Cnt.size() / NumClass, NumClass);
+			if (!Cnt.empty())
+				memcpy(numpy_getptr(rv), &Cnt[0], sizeof(C_Int32)*Cnt.size());
+			return rv;
+		} else if (Type == 3)
+		{
+			PyObject *rv = numpy_new_int32(Sum.size());
+			C_Int32 *p = (C_Int32*)numpy_getptr(rv);
+			for (size_t i=0; i < Sum.size(); i++) p[i] = Sum[i];
+			return rv;
+		} else {
+			PyObject *rv = numpy_new_int64(Sum.size());
+			if (!Sum.empty())
+				memcpy(numpy_getptr(rv), &Sum[0], sizeof(C_Int64)*Sum.size());
+			return rv;
+		}
+	}
+};
+
+/// per-sample reductions, each thread has its own accumulators
+class COREARRAY_DLL_LOCAL CReduce_Sample: public CReduce
+{
+protected:
+	int Type, NumClass;
+	size_t NumSamp;
+	vector< vector<C_Int64> > Acc;  ///< thread-private accumulators
+public:
+	CReduce_Sample(int type) { Type = type; }
+
+	virtual void Init(int nThread, size_t, size_t nSamp, int Ploidy)
+	{
+		NumSamp = nSamp;
+		NumClass = Ploidy + 2;
+		Acc.resize(nThread);
+		for (int i=0; i < nThread; i++)
+			Acc[i].assign((Type == 0) ? nSamp*NumClass : nSamp, 0);
+	}
+
+	virtual void Add(int i, size_t, const C_UInt8 *d)
+	{
+		C_Int64 *p = &Acc[i][0];
+		switch (Type)
+		{
+		case 0:  // the counts of dosage classes
+			{
+				const int m = NumClass - 1;
+				for (size_t j=0; j < NumSamp; j++, p+=NumClass)
+					p[(d[j] < m) ? d[j] : m] ++;
+				break;
+			}
+		case 1:  // the sum of dosages
+			for (size_t j=0; j < NumSamp; j++)
+				if (d[j] != NA_UINT8) p[j] += d[j];
+			break;
+		case 2:  // the sum of squared dosages
+			for (size_t j=0; j < NumSamp; j++)
+				if (d[j] != NA_UINT8) p[j] += d[j] * d[j];
+			break;
+		case 3:  // the number of non-missing dosages
+			for (size_t j=0; j < NumSamp; j++)
+				if (d[j] != NA_UINT8) p[j] ++;
+			break;
+		}
+	}
+
+	virtual PyObject *Result()
+	{
+		// merge in the order of threads, integer sums are exact
+		vector<C_Int64> &S = Acc[0];
+		for (size_t i=1; i < Acc.size(); i++)
+		{
+			vector<C_Int64> &T = Acc[i];
+			for (size_t j=0; j < S.size(); j++) S[j] += T[j];
+		}
+		if ((Type == 0) || (Type == 3))
+		{
+			PyObject *rv = (Type == 0) ?
+				numpy_new_int32_mat(NumSamp, NumClass) : numpy_new_int32(NumSamp);
+			C_Int32 *p = (C_Int32*)numpy_getptr(rv);
+			for (size_t j=0; j < S.size(); j++) p[j] = S[j];
+			return rv;
+		} else {
+			PyObject *rv = numpy_new_int64(NumSamp);
+			if (!S.empty())
+				memcpy(numpy_getptr(rv), &S[0], sizeof(C_Int64)*S.size());
+			return rv;
+		}
+	}
+};
+
+/// a list of reductions
+class COREARRAY_DLL_LOCAL CReduceList: public vector<CReduce*>
+{
+public:
+	~CReduceList()
+	{
+		for (iterator p = begin(); p != end(); p++) delete *p;
+	}
+};
+
+/// run the reductions 'List' in one pass over the selected variants
+static void RunReduce(CFileInfo &File, CReduceList &List, int nthread)
+{
+	const size_t nVariant = File.VariantSelNum();
+	const size_t nSample = File.SampleSelNum();
+	CVarApplyList NodeList;
+	int nThread = 1, Ploidy = File.Ploidy();
+	if ((nVariant > 0) && (nSample > 0))
+		nThread = NewThreadReaders<CApply_Variant_Dosage>(File, nthread, NodeList);
+	for (size_t j=0; j < List.size(); j++)
+		List[j]->Init(nThread, nVariant, nSample, Ploidy);
+	if (NodeList.empty()) return;
+
+	ParallelFor(nThread, nVariant,
+		[&](int i, size_t start, size_t count) {
+			CApply_Variant_Dosage *p =
+				static_cast<CApply_Variant_Dosage*>(NodeList[i]);
+			vector<C_UInt8> buf(nSample);
+			for (size_t k=start; k < start+count; k++)
+			{
+				// decode once, shared by all reductions
+				p->ReadDosage(&buf[0]);
+				p->Next();
+				for (size_t j=0; j < List.size(); j++)
+					List[j]->Add(i, k, &buf[0]);
+			}
+		}, nThread > 1);
+}
+
+
+
 extern "C"
 {
+
+// ======================================================================
+
+/// Calculate the frequencies of reference or specified alleles
+COREARRAY_DLL_EXPORT PyObject* FC_CalcAF(PyObject *self, PyObject *args)
+{
+	int file_id;
+	PyObject *ref;
+	int nthread = 0;
+	if (!PyArg_ParseTuple(args, "iO|i", &file_id, &ref, &nthread))
+		return NULL;
+
+	COREARRAY_TRY
+		CFileInfo &File = GetFileInfo(file_id);
+		vector<int> allele;
+		GetAlleleIndex(File, ref, allele);
+		const size_t n = allele.size();
+		vector<C_Int32> cnt(n), nonmiss(n);
+		if (n > 0) CountAllele(File, allele, nthread, &cnt[0], &nonmiss[0]);
+
+		PyObject *rv_ans = numpy_new_float64(n);
+		double *p = (double*)numpy_getptr(rv_ans);
+		for (size_t i=0; i < n; i++)
+		{
+			p[i] = ((allele[i] >= 0) && (nonmiss[i] > 0)) ?
+				(double)cnt[i] / nonmiss[i] : NAN;
+		}
+		return rv_ans;
+	COREARRAY_CATCH_NONE
+}
+
+/// Calculate the counts of reference or specified alleles
+COREARRAY_DLL_EXPORT PyObject* FC_CalcAC(PyObject *self, PyObject *args)
+{
+	int file_id;
+	PyObject *ref;
+	int nthread = 0;
+	if (!PyArg_ParseTuple(args, "iO|i", &file_id, &ref, &nthread))
+		return NULL;
+
+	COREARRAY_TRY
+		CFileInfo &File = GetFileInfo(file_id);
+		vector<int> allele;
+		GetAlleleIndex(File, ref, allele);
+		const size_t n = allele.size();
+		vector<C_Int32> nonmiss(n);
+		PyObject *rv_ans = numpy_new_int32(n);
+		if (n > 0)
+			CountAllele(File, allele, nthread, (C_Int32*)numpy_getptr(rv_ans),
+				&nonmiss[0]);
+		return rv_ans;
+	COREARRAY_CATCH_NONE
+}
+
+// ======================================================================
+
+/// Reduce the dosages of the selected variants with built-in reductions
+COREARRAY_DLL_EXPORT PyObject* FC_Reduce(PyObject *self, PyObject *args)
+{
+	int file_id;
+	PyObject *names;
+	int nthread = 0;
+	if (!PyArg_ParseTuple(args, "iO|i", &file_id, &names, &nthread))
+		return NULL;
+
+	COREARRAY_TRY
+		CFileInfo &File = GetFileInfo(file_id);
+		CReduceList List;
+		vector<string> nm;
+		numpy_to_string(names, nm);
+		for (size_t i=0; i < nm.size(); i++)
+		{
+			int k = 0;
+			while (REDUCE_NAMES[k] && (nm[i] != REDUCE_NAMES[k])) k++;
+			if (!REDUCE_NAMES[k])
+				throw ErrSeqArray("Invalid reduction '%s'.", nm[i].c_str());
+			if (k < 4)
+				List.push_back(new CReduce_Variant(k));
+			else
+				List.push_back(new CReduce_Sample(k - 4));
+		}
+		RunReduce(File, List, nthread);
+
+		PyObject *rv_ans = PyDict_New();
+		for (size_t i=0; i < List.size(); i++)
+		{
+			PyObject *v = List[i]->Result();
+			PyDict_SetItemString(rv_ans, nm[i].c_str(), v);
+			Py_DECREF(v);
+		}
+		return rv_ans;
+	COREARRAY_CATCH_NONE
+}
+
 /*
 // ======================================================================
 
@@ -69,90 +504,6 @@ COREARRAY_DLL_EXPORT PyObject* FC_Missing_PerSample(PyObject* Geno, PyObject* su
 }
 */
 
-// ======================================================================
-/*
-/// Get a list of allele frequencies
-COREARRAY_DLL_LOCAL PyObject* FC_CalcAF(PyObject *self, PyObject *args)
-{
-	PyObject *ref, *geno;
-	if (!PyArg_ParseTuple(args, "OO", &ref, &geno))
-		return NULL;
-
-
-	PyObject* Geno = VECTOR_ELT(List, 0);
-	const size_t N = XLENGTH(Geno);
-
-	int nAllele = Rf_asInteger(VECTOR_ELT(List, 1));
-	PyObject* rv = NEW_NUMERIC(nAllele);
-	double *pV = REAL(rv);
-
-	size_t n1, n2, n3;
-	switch (nAllele)
-	{
-	case 2:
-		if (TYPEOF(Geno) == RAWSXP)
-			vec_i8_count3((const char*)RAW(Geno), N, 0, 1, NA_RAW, &n1, &n2, &n3);
-		else
-			vec_i32_count3(INTEGER(Geno), N, 0, 1, NA_INTEGER, &n1, &n2, &n3);
-		n3 = N - n3;
-		if (n3 > 0)
-		{
-			pV[0] = (double)n1 / n3;
-			pV[1] = (double)n2 / n3;
-		} else
-			pV[0] = pV[1] = R_NaN;
-		break;
-
-	case 1:
-		if (TYPEOF(Geno) == RAWSXP)
-			vec_i8_count2((const char*)RAW(Geno), N, 0, NA_RAW, &n1, &n2);
-		else
-			vec_i32_count2(INTEGER(Geno), N, 0, NA_INTEGER, &n1, &n2);
-		n2 = N - n2;
-		pV[0] = (n2 > 0) ? (double)n1 / n2 : R_NaN;
-		break;
-
-	default:
-		int num = 0;
-		memset((void*)pV, 0, sizeof(double)*nAllele);
-		if (TYPEOF(Geno) == RAWSXP)
-		{
-			C_UInt8 *p = (C_UInt8*)RAW(Geno);
-			for (size_t n=N; n > 0; n--)
-			{
-				C_UInt8 g = *p++;
-				if (g != NA_RAW)
-				{
-					num ++;
-					if (g < nAllele) pV[g] ++;
-				}
-			}
-		} else {
-			int *p = INTEGER(Geno);
-			for (size_t n=N; n > 0; n--)
-			{
-				int g = *p++;
-				if (g != NA_INTEGER)
-				{
-					num ++;
-					if ((0 <= g) && (g < nAllele))
-						pV[g] ++;
-				}
-			}
-		}
-		if (num > 0)
-		{
-			const double scale = 1.0 / num;
-			for (; (nAllele--) > 0;) (*pV++) *= scale;
-		} else {
-			for (; (nAllele--) > 0;) (*pV++) = R_NaN;
-		}
-	}
-
-	return rv;
-}
-*/
-
 /*
 // ======================================================================
 
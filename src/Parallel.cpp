@@ -0,0 +1,131 @@
+// ===========================================================
+//
+// Parallel.cpp: Multithreading in native computation
+//
+// Copyright (C) 2017    Xiuwen Zheng
+//
+// This file is part of PySeqArray.
+//
+// PySeqArray is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License Version 3 as
+// published by the Free Software Foundation.
+//
+// PySeqArray is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with PySeqArray.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#include "Parallel.h"
+#include <thread>
+
+
+namespace PySeqArray
+{
+
+/// the default number of threads, 1 for no multithreading
+static int Default_NumThread = 1;
+
+/// the mutex for GDS objects
+COREARRAY_DLL_LOCAL mutex GDS_Mutex;
+
+
+COREARRAY_DLL_LOCAL void SetNumThread(int num)
+{
+	if (num <= 0)
+	{
+		num = GDS_Mach_GetNumOfCores();
+		if (num <= 0) num = 1;
+	}
+	Default_NumThread = num;
+}
+
+COREARRAY_DLL_LOCAL int GetNumThread(int num)
+{
+	return (num > 0) ? num : Default_NumThread;
+}
+
+
+COREARRAY_DLL_LOCAL void ParallelSplit(int nthread, size_t n,
+	vector<size_t> &start)
+{
+	if (nthread < 1) nthread = 1;
+	start.resize(nthread + 1);
+	double avg = (double)n / nthread, st = 0;
+	for (int i=0; i < nthread; i++)
+	{
+		start[i] = (size_t)(st + 0.5);
+		st += avg;
+	}
+	start[nthread] = n;
+}
+
+COREARRAY_DLL_LOCAL void ParallelSelPos(const CSelRank &sel,
+	const vector<size_t> &start, vector<int> &pos)
+{
+	const int nthread = (int)start.size() - 1;
+	pos.resize(nthread);
+	for (int k=0; k < nthread; k++)
+		pos[k] = (start[k] < sel.Count()) ? sel.Select(start[k]) : 0;
+}
+
+
+/// call func in a thread and keep the first error message
+static void thread_run(const TParallelFunc *func, int i, size_t st,
+	size_t cnt, string *err, mutex *err_mutex)
+{
+	try {
+		(*func)(i, st, cnt);
+	} catch (exception &E) {
+		lock_guard<mutex> lock(*err_mutex);
+		if (err->empty()) *err = E.what();
+	} catch (const char *E) {
+		lock_guard<mutex> lock(*err_mutex);
+		if (err->empty()) *err = E;
+	} catch (...) {
+		lock_guard<mutex> lock(*err_mutex);
+		if (err->empty()) *err = "Unknown error in a thread.";
+	}
+}
+
+COREARRAY_DLL_LOCAL void ParallelFor(int nthread, size_t n,
+	const TParallelFunc &func, bool release_gil)
+{
+	if ((size_t)nthread > n) nthread = n;
+	if (nthread <= 1)
+	{
+		if (n > 0) func(0, 0, n);
+		return;
+	}
+
+	vector<size_t> st;
+	ParallelSplit(nthread, n, st);
+	string err;
+	mutex err_mutex;
+
+	PyThreadState *save = release_gil ? PyEval_SaveThread() : NULL;
+	{
+		vector<thread> thds;
+		thds.reserve(nthread - 1);
+		try {
+			for (int i=1; i < nthread; i++)
+			{
+				thds.push_back(thread(thread_run, &func, i, st[i],
+					st[i+1]-st[i], &err, &err_mutex));
+			}
+		} catch (exception &E) {
+			err = E.what();  // fails to create a thread
+		}
+		if (err.empty())
+			thread_run(&func, 0, st[0], st[1]-st[0], &err, &err_mutex);
+		for (size_t i=0; i < thds.size(); i++) thds[i].join();
+	}
+	if (save) PyEval_RestoreThread(save);
+
+	if (!err.empty()) throw ErrSeqArray(err);
+}
+
+}
@@ -0,0 +1,100 @@
+// ===========================================================
+//
+// Parallel.h: Multithreading in native computation
+//
+// Copyright (C) 2017    Xiuwen Zheng
+//
+// This file is part of PySeqArray.
+//
+// PySeqArray is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License Version 3 as
+// published by the Free Software Foundation.
+//
+// PySeqArray is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with PySeqArray.
+// If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _HEADER_SEQ_PARALLEL_
+#define _HEADER_SEQ_PARALLEL_
+
+#include "Index.h"
+#include <mutex>
+#include <functional>
+
+
+namespace PySeqArray
+{
+
+using namespace std;
+
+
+// ===========================================================
+// Thread settings
+// ===========================================================
+
+/// set the default number of threads for the process (<= 0 for all cores)
+COREARRAY_DLL_LOCAL void SetNumThread(int num);
+
+/// get the number of threads, using the process default if num <= 0
+COREARRAY_DLL_LOCAL int GetNumThread(int num=0);
+
+
+/// the mutex serializing the access to GDS objects, since the GDS nodes
+/// and their decompressors are not thread-safe
+extern COREARRAY_DLL_LOCAL mutex GDS_Mutex;
+
+/// lock GDS_Mutex in a scope if enabled
+class COREARRAY_DLL_LOCAL CGDSLock
+{
+public:
+	CGDSLock(bool enable): Enabled(enable)
+		{ if (Enabled) GDS_Mutex.lock(); }
+	~CGDSLock()
+		{ if (Enabled) GDS_Mutex.unlock(); }
+private:
+	bool Enabled;
+};
+
+/// release the Python GIL in a scope, the GIL must be held when entering
+class COREARRAY_DLL_LOCAL CPyUnlockGIL
+{
+public:
+	CPyUnlockGIL(): State(PyEval_SaveThread()) { }
+	~CPyUnlockGIL() { PyEval_RestoreThread(State); }
+private:
+	PyThreadState *State;
+};
+
+
+
+// ===========================================================
+// Parallel loops
+// ===========================================================
+
+/// the function called by ParallelFor(), with the thread index,
+/// the starting index and the count of a contiguous range
+typedef function<void(int, size_t, size_t)> TParallelFunc;
+
+/// split [0, n) into contiguous ranges and call func in nthread threads;
+/// the Python GIL is released during the loop if release_gil, and the
+/// first error raised in any thread is rethrown in the calling thread
+COREARRAY_DLL_LOCAL void ParallelFor(int nthread, size_t n,
+	const TParallelFunc &func, bool release_gil=true);
+
+/// the starting indices of nthread contiguous ranges over [0, n)
+COREARRAY_DLL_LOCAL void ParallelSplit(int nthread, size_t n,
+	vector<size_t> &start);
+
+/// the positions of the start[i]-th selected elements for the ranges from
+/// ParallelSplit(), where pos has nthread = start.size()-1 entries
+COREARRAY_DLL_LOCAL void ParallelSelPos(const CSelRank &sel,
+	const vector<size_t> &start, vector<int> &pos);
+
+}
+
+#endif /* _HEADER_SEQ_PARALLEL_ */
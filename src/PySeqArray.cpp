@@ -26,6 +26,7 @@
 
 #include "ReadByVariant.h"
 // #include "ReadBySample.h"
+#include "Parallel.h"
 #include <ctype.h>
 
 
@@ -51,12 +52,16 @@ using namespace PySeqArray;
 PY_EXPORT PyObject* SEQ_File_Init(PyObject *self, PyObject *args)
 {
 	int file_id;
-	if (!PyArg_ParseTuple(args, "i", &file_id))
+	const char *fn = NULL;
+	const char *cache_fn = NULL;
+	if (!PyArg_ParseTuple(args, "i|zz", &file_id, &fn, &cache_fn))
 		return NULL;
 
 	COREARRAY_TRY
 		CFileInfo &file = GetFileInfo(file_id);
 		file.Selection();  // force to initialize selection
+		if (fn && cache_fn)
+			file.SetIndexCache(fn, cache_fn);
 	COREARRAY_CATCH_NONE
 }
 
@@ -70,7 +75,11 @@ PY_EXPORT PyObject* SEQ_File_Done(PyObject *self, PyObject *args)
 	COREARRAY_TRY
 		map<int, CFileInfo>::iterator p = GDSFile_ID_Info.find(file_id);
 		if (p != GDSFile_ID_Info.end())
+		{
+			if (p->second.GDSShared())
+				throw ErrSeqArray("The file is in use by other threads.");
 			GDSFile_ID_Info.erase(p);
+		}
 	COREARRAY_CATCH_NONE
 }
 
@@ -90,12 +99,8 @@ PY_EXPORT PyObject* SEQ_FilterPush(PyObject *self, PyObject *args)
 	COREARRAY_TRY
 		map<int, CFileInfo>::iterator it = GDSFile_ID_Info.find(file_id);
 		if (it != GDSFile_ID_Info.end())
-		{
-			if (new_flag || it->second.SelList.empty())
-				it->second.SelList.push_back(TSelection());
-			else
-				it->second.SelList.push_back(it->second.SelList.back());
-		} else
+			it->second.SelPush(new_flag != 0);
+		else
 			throw ErrSeqArray("The GDS file is closed or invalid.");
 	COREARRAY_CATCH_NONE
 }
@@ -110,16 +115,30 @@ PY_EXPORT PyObject* SEQ_FilterPop(PyObject *self, PyObject *args)
 	COREARRAY_TRY
 		map<int, CFileInfo>::iterator it = GDSFile_ID_Info.find(file_id);
 		if (it != GDSFile_ID_Info.end())
-		{
-			if (it->second.SelList.size() <= 1)
-				throw ErrSeqArray("No filter can be pop up.");
-			it->second.SelList.pop_back();
-		} else
+			it->second.SelPop();
+		else
 			throw ErrSeqArray("The GDS file is closed or invalid.");
 	COREARRAY_CATCH_NONE
 }
 
 
+/// register or unregister the calling thread as a worker with its own filter
+PY_EXPORT PyObject* SEQ_FilterThread(PyObject *self, PyObject *args)
+{
+	int file_id;
+	int begin_flag;
+	if (!PyArg_ParseTuple(args, "i" BSTR, &file_id, &begin_flag)) return NULL;
+
+	COREARRAY_TRY
+		CFileInfo &File = GetFileInfo(file_id);
+		if (begin_flag)
+			File.ThreadSelBegin();
+		else
+			File.ThreadSelEnd();
+	COREARRAY_CATCH_NONE
+}
+
+
 /// set a working space with selected sample id
 PY_EXPORT PyObject* SEQ_SetSpaceSample(PyObject *self, PyObject *args)
 {
@@ -133,68 +152,26 @@ PY_EXPORT PyObject* SEQ_SetSpaceSample(PyObject *self, PyObject *args)
 
 		CFileInfo &File = GetFileInfo(file_id);
 		TSelection &Sel = File.Selection();
-		C_BOOL *pArray = Sel.pSample();
+		C_BOOL *pArray = Sel.wSample();
 		int Count = File.SampleNum();
-		PdAbstractArray varSamp = File.GetObj("sample.id", TRUE);
+		// worker threads may be reading GDS nodes
+		CGDSLock lock(File.GDSShared());
 
 		if (samp_id == Py_None)
 		{
 			memset(pArray, TRUE, Count);
 		} else if (numpy_is_array_or_list(samp_id))
 		{
+			// the hash index of IDs is built on first use
 			if (numpy_is_array_int(samp_id))
 			{
-				// initialize
-				set<int> set_id;
-				{
-					vector<int> ary;
-					numpy_to_int32(samp_id, ary);
-					set_id.insert(ary.begin(), ary.end());
-				}
-
-				// sample id
-				vector<int> sample_id(Count);
-				C_Int32 _st=0, _cnt=Count;
-				GDS_Array_ReadData(varSamp, &_st, &_cnt, &sample_id[0], svInt32);
-
-				// set selection
-				if (!intersect)
-				{
-					for (int i=0; i < Count; i++)
-						*pArray++ = (set_id.find(sample_id[i]) != set_id.end());
-				} else {
-					for (int i=0; i < Count; i++, pArray++)
-					{
-						if (*pArray)
-							*pArray = (set_id.find(sample_id[i]) != set_id.end());
-					}
-				}
+				vector<int> ary;
+				numpy_to_int32(samp_id, ary);
+				File.SampleIdInt().Select(ary, pArray, intersect);
 			} else {
-				// initialize
-				set<string> set_id;
-				{
-					vector<string> ary;
-					numpy_to_string(samp_id, ary);
-					set_id.insert(ary.begin(), ary.end());
-				}
-
-				// sample id
-				vector<string> sample_id(Count);
-				C_Int32 _st=0, _cnt=Count;
-				GDS_Array_ReadData(varSamp, &_st, &_cnt, &sample_id[0], svStrUTF8);
-
-				// set selection
-				if (!intersect)
-				{
-					for (int i=0; i < Count; i++)
-						*pArray++ = (set_id.find(sample_id[i]) != set_id.end());
-				} else {
-					for (int i=0; i < Count; i++, pArray++)
-					{
-						if (*pArray)
-							*pArray = (set_id.find(sample_id[i]) != set_id.end());
-					}
-				}
+				vector<string> ary;
+				numpy_to_string(samp_id, ary);
+				File.SampleIdStr().Select(ary, pArray, intersect);
 			}
 		} else
 			throw ErrSeqArray("Invalid type of 'sample.id'.");
@@ -222,7 +199,11 @@ PY_EXPORT PyObject* SEQ_SetSpaceSample2(PyObject *self, PyObject *args)
 
 		CFileInfo &File = GetFileInfo(file_id);
 		TSelection &Sel = File.Selection();
-		C_BOOL *pArray = Sel.pSample();
+		const int SelCnt = Sel.SampleSelNum();
+		// the rank/select index of the current selection, kept after wSample()
+		const CSelRank *Rank = (intersect && numpy_is_int(samp_sel)) ?
+			&Sel.SampleRank() : NULL;
+		C_BOOL *pArray = Sel.wSample();
 		int Count = File.SampleNum();
 
 		if (numpy_is_bool(samp_sel))
@@ -234,17 +215,17 @@ PY_EXPORT PyObject* SEQ_SetSpaceSample2(PyObject *self, PyObject *args)
 					throw ErrSeqArray("Invalid length of 'sample'.");
 				memcpy(pArray, numpy_getptr(samp_sel), Count);
 			} else {
-				if (numpy_size(samp_sel) != (size_t)File.SampleSelNum())
+				if (numpy_size(samp_sel) != (size_t)SelCnt)
 				{
 					throw ErrSeqArray(
 						"Invalid length of 'sample' (should be equal to the number of selected samples).");
 				}
+				vector<C_Int32> Idx(SelCnt);
+				if (SelCnt > 0)
+					vec_u8_nonzero_index((C_UInt8*)pArray, Count, &Idx[0]);
 				C_BOOL *base = (C_BOOL*)numpy_getptr(samp_sel);
-				for (int i=0; i < Count; i++)
-				{
-					if (*pArray)
-						*pArray = ((*base++) != 0);
-				}
+				for (int i=0; i < SelCnt; i++)
+					pArray[Idx[i]] = (base[i] != 0);
 			}
 		} else if (numpy_is_int(samp_sel))
 		{
@@ -268,7 +249,7 @@ PY_EXPORT PyObject* SEQ_SetSpaceSample2(PyObject *self, PyObject *args)
 				for (size_t i=0; i < N; i++)
 					pArray[*pI++] = TRUE;
 			} else {
-				int Cnt = File.SampleSelNum();
+				int Cnt = SelCnt;
 				int *pI = &idx[0];
 				size_t N = idx.size();
 				// check
@@ -278,18 +259,14 @@ PY_EXPORT PyObject* SEQ_SetSpaceSample2(PyObject *self, PyObject *args)
 					if ((I < 0) || (I >= Cnt))
 						throw ErrSeqArray("Out of range 'sample'.");
 				}
-				// get the current index
-				vector<int> Idx;
-				Idx.reserve(Cnt);
-				for (int i=0; i < Count; i++)
-				{
-					if (pArray[i]) Idx.push_back(i);
-				}
+				// map to the indices by the current selection
+				vector<C_Int32> Idx(N);
+				for (size_t i=0; i < N; i++)
+					Idx[i] = Rank->Select(idx[i]);
 				// set values
 				memset((void*)pArray, 0, Count);
-				pI = &idx[0];
 				for (size_t i=0; i < N; i++)
-					pArray[Idx[*pI++]] = TRUE;
+					pArray[Idx[i]] = TRUE;
 			}
 		} else if (samp_sel == Py_None)
 		{
@@ -320,68 +297,26 @@ PY_EXPORT PyObject* SEQ_SetSpaceVariant(PyObject *self, PyObject *args)
 
 		CFileInfo &File = GetFileInfo(file_id);
 		TSelection &Sel = File.Selection();
-		C_BOOL *pArray = Sel.pVariant();
+		C_BOOL *pArray = Sel.wVariant();
 		int Count = File.VariantNum();
-		PdAbstractArray varVariant = File.GetObj("variant.id", TRUE);
+		// worker threads may be reading GDS nodes
+		CGDSLock lock(File.GDSShared());
 
 		if (variant_id == Py_None)
 		{
 			memset(pArray, TRUE, Count);
 		} else if (numpy_is_array_or_list(variant_id))
 		{
+			// the hash index of IDs is built on first use
 			if (numpy_is_array_int(variant_id))
 			{
-				// initialize
-				set<int> set_id;
-				{
-					vector<int> ary;
-					numpy_to_int32(variant_id, ary);
-					set_id.insert(ary.begin(), ary.end());
-				}
-
-				// variant id
-				vector<int> var_id(Count);
-				C_Int32 _st=0, _cnt=Count;
-				GDS_Array_ReadData(varVariant, &_st, &_cnt, &var_id[0], svInt32);
-
-				// set selection
-				if (!intersect)
-				{
-					for (int i=0; i < Count; i++)
-						*pArray++ = (set_id.find(var_id[i]) != set_id.end());
-				} else {
-					for (int i=0; i < Count; i++, pArray++)
-					{
-						if (*pArray)
-							*pArray = (set_id.find(var_id[i]) != set_id.end());
-					}
-				}
+				vector<int> ary;
+				numpy_to_int32(variant_id, ary);
+				File.VariantIdInt().Select(ary, pArray, intersect);
 			} else {
-				// initialize
-				set<string> set_id;
-				{
-					vector<string> ary;
-					numpy_to_string(variant_id, ary);
-					set_id.insert(ary.begin(), ary.end());
-				}
-
-				// variant id
-				vector<string> var_id(Count);
-				C_Int32 _st=0, _cnt=Count;
-				GDS_Array_ReadData(varVariant, &_st, &_cnt, &var_id[0], svStrUTF8);
-
-				// set selection
-				if (!intersect)
-				{
-					for (int i=0; i < Count; i++)
-						*pArray++ = (set_id.find(var_id[i]) != set_id.end());
-				} else {
-					for (int i=0; i < Count; i++, pArray++)
-					{
-						if (*pArray)
-							*pArray = (set_id.find(var_id[i]) != set_id.end());
-					}
-				}
+				vector<string> ary;
+				numpy_to_string(variant_id, ary);
+				File.VariantIdStr().Select(ary, pArray, intersect);
 			}
 		} else
 			throw ErrSeqArray("Invalid type of 'variant.id'.");
@@ -409,7 +344,11 @@ PY_EXPORT PyObject* SEQ_SetSpaceVariant2(PyObject *self, PyObject *args)
 
 		CFileInfo &File = GetFileInfo(file_id);
 		TSelection &Sel = File.Selection();
-		C_BOOL *pArray = Sel.pVariant();
+		const int SelCnt = Sel.VariantSelNum();
+		// the rank/select index of the current selection, kept after wVariant()
+		const CSelRank *Rank = (intersect && numpy_is_int(var_sel)) ?
+			&Sel.VariantRank() : NULL;
+		C_BOOL *pArray = Sel.wVariant();
 		int Count = File.VariantNum();
 
 		if (numpy_is_bool(var_sel))
@@ -421,18 +360,18 @@ PY_EXPORT PyObject* SEQ_SetSpaceVariant2(PyObject *self, PyObject *args)
 					throw ErrSeqArray("Invalid length of 'variant.sel'.");
 				memcpy(pArray, numpy_getptr(var_sel), Count);
 			} else {
-				if (numpy_size(var_sel) != (size_t)File.VariantSelNum())
+				if (numpy_size(var_sel) != (size_t)SelCnt)
 				{
 					throw ErrSeqArray(
 						"Invalid length of 'variant' (should be equal to the number of selected variants).");
 				}
 				// set selection
+				vector<C_Int32> Idx(SelCnt);
+				if (SelCnt > 0)
+					vec_u8_nonzero_index((C_UInt8*)pArray, Count, &Idx[0]);
 				C_BOOL *base = (C_BOOL*)numpy_getptr(var_sel);
-				for (int i=0; i < Count; i++)
-				{
-					if (*pArray)
-						*pArray = ((*base++) != 0);
-				}
+				for (int i=0; i < SelCnt; i++)
+					pArray[Idx[i]] = (base[i] != 0);
 			}
 		} else if (numpy_is_int(var_sel))
 		{
@@ -456,7 +395,7 @@ PY_EXPORT PyObject* SEQ_SetSpaceVariant2(PyObject *self, PyObject *args)
 				for (size_t i=0; i < N; i++)
 					pArray[*pI++] = TRUE;
 			} else {
-				int Cnt = File.VariantSelNum();
+				int Cnt = SelCnt;
 				int *pI = &idx[0];
 				size_t N = idx.size();
 				// check
@@ -466,18 +405,14 @@ PY_EXPORT PyObject* SEQ_SetSpaceVariant2(PyObject *self, PyObject *args)
 					if ((I < 0) || (I >= Cnt))
 						throw ErrSeqArray("Out of range 'variant'.");
 				}
-				// get the current index
-				vector<int> Idx;
-				Idx.reserve(Cnt);
-				for (int i=0; i < Count; i++)
-				{
-					if (pArray[i]) Idx.push_back(i);
-				}
+				// map to the indices by the current selection
+				vector<C_Int32> Idx(N);
+				for (size_t i=0; i < N; i++)
+					Idx[i] = Rank->Select(idx[i]);
 				// set values
 				memset((void*)pArray, 0, Count);
-				pI = &idx[0];
 				for (size_t i=0; i < N; i++)
-					pArray[Idx[*pI++]] = TRUE;
+					pArray[Idx[i]] = TRUE;
 			}
 		} else if (var_sel == Py_None)
 		{
@@ -494,181 +429,255 @@ PY_EXPORT PyObject* SEQ_SetSpaceVariant2(PyObject *self, PyObject *args)
 	COREARRAY_CATCH_NONE
 }
 
-/*
 // ================================================================
 
-static bool is_numeric(const string &txt)
-{
-	char *endptr = (char*)(txt.c_str());
-	strtol(txt.c_str(), &endptr, 10);
-	return (endptr != txt.c_str()) && (*endptr == 0);
-}
-
-/// set a working space flag with selected chromosome(s)
-PY_EXPORT PyObject* SEQ_SetChrom(PyObject* gdsfile, PyObject* include,
-	PyObject* is_num, PyObject* frombp, PyObject* tobp, PyObject* intersect, PyObject* verbose)
+/// set the variants in the run 'rng' with positions in [start, end] to TRUE,
+/// using binary search if the positions are sorted in the run
+static void SetRunPosRange(C_BOOL *out, const C_Int32 *pos,
+	const CChromIndex::TRange &rng, int start, int end, bool sorted)
 {
-	int nProtected = 0;
-	int *pFrom=NULL, *pTo=NULL;
-
-	int IsNum = Rf_asLogical(is_num);
-	int IsIntersect = Rf_asLogical(intersect);
-	if (IsIntersect == NA_INTEGER)
-		error("'intersect' should be either FALSE or TRUE.");
-
-	if (Rf_isNull(include))
+	const C_Int32 *b = pos + rng.Start, *e = b + rng.Length;
+	if (sorted)
 	{
-		if (!Rf_isNull(frombp))
-			error("'from.bp' should be NULL.");
-		if (!Rf_isNull(tobp))
-			error("'to.bp' should be NULL.");
+		const C_Int32 *lo = lower_bound(b, e, start);
+		const C_Int32 *hi = upper_bound(lo, e, end);
+		if (hi > lo) memset(out + (lo - pos), TRUE, hi - lo);
 	} else {
-		include = PROTECT(AS_CHARACTER(include));
-		nProtected ++;
-		if (!Rf_isNull(frombp) || !Rf_isNull(tobp))
-		{
-			if (RLength(include) != RLength(frombp))
-				error("'from.bp' should have the same length as 'include'.");
-			if (RLength(include) != RLength(tobp))
-				error("'to.bp' should have the same length as 'include'.");
-			frombp = PROTECT(AS_INTEGER(frombp));
-			tobp = PROTECT(AS_INTEGER(tobp));
-			pFrom = INTEGER(frombp); pTo = INTEGER(tobp);
-			nProtected += 2;
-		}
+		for (const C_Int32 *p=b; p < e; p++)
+			if ((start <= *p) && (*p <= end)) out[p - pos] = TRUE;
 	}
+}
+
+/// set a working space with selected chromosome(s) and position ranges
+PY_EXPORT PyObject* SEQ_SetChrom(PyObject *self, PyObject *args)
+{
+	int file_id;
+	PyObject *chrom, *start, *end;
+	int intersect, verbose;
+	if (!PyArg_ParseTuple(args, "iOOO" BSTR BSTR, &file_id, &chrom, &start,
+			&end, &intersect, &verbose))
+		return NULL;
 
 	COREARRAY_TRY
 
-		CFileInfo &File = GetFileInfo(gdsfile);
+		CFileInfo &File = GetFileInfo(file_id);
 		TSelection &Sel = File.Selection();
+		C_BOOL *pArray = Sel.wVariant();
+		int Count = File.VariantNum();
+		// worker threads may be reading GDS nodes
+		CGDSLock lock(File.GDSShared());
 
-		vector<C_BOOL> &sel_array = Sel.Variant;
-		vector<C_BOOL> tmp_array;
-		if (IsIntersect) tmp_array.resize(sel_array.size());
+		// chromosomes and ranges
+		vector<string> chr;
+		vector<int> st, ed;
+		if (chrom != Py_None)
+		{
+			numpy_to_string(chrom, chr);
+			if ((start == Py_None) != (end == Py_None))
+				throw ErrSeqArray("'start' and 'end' should be both specified or None.");
+			if (start != Py_None)
+			{
+				numpy_to_int32(start, st);
+				numpy_to_int32(end, ed);
+				if ((st.size() != chr.size()) || (ed.size() != chr.size()))
+					throw ErrSeqArray("'start' and 'end' should have the same length as 'chrom'.");
+			}
+		}
 
-		vector<C_BOOL> &array = IsIntersect ? tmp_array : sel_array;
-		memset(&array[0], FALSE, array.size());
+		// the variants in the ranges
+		vector<C_BOOL> tmp;
+		C_BOOL *out = pArray;
+		if (intersect)
+		{
+			tmp.resize(Count, FALSE);
+			out = &tmp[0];
+		} else
+			memset(pArray, FALSE, Count);
 
-		if (Rf_isNull(include))
+		if (chrom == Py_None)
 		{
-			// include = NULL
-			if (IsNum == NA_INTEGER)
+			memset(out, TRUE, Count);
+		} else {
+			CChromIndex &Chrom = File.Chromosome();
+			const C_Int32 *pos = st.empty() ? NULL : &File.Position()[0];
+			for (size_t i=0; i < chr.size(); i++)
 			{
-				memset(&array[0], TRUE, array.size());
-			} else {
-				CChromIndex &Chrom = File.Chromosome();
-				map<string, CChromIndex::TRangeList>::iterator it;
-				for (it=Chrom.Map.begin(); it != Chrom.Map.end(); it++)
+				map<string, CChromIndex::TRangeList>::iterator it =
+					Chrom.Map.find(chr[i]);
+				if (it == Chrom.Map.end()) continue;
+				CChromIndex::TRangeList::iterator p;
+				for (p=it->second.begin(); p != it->second.end(); p++)
 				{
-					bool flag = is_numeric(it->first);
-					if (((IsNum==TRUE) && flag) || ((IsNum==FALSE) && !flag))
+					if (pos)
 					{
-						CChromIndex::TRangeList &rng = it->second;
-						vector<CChromIndex::TRange>::iterator it;
-						for (it=rng.begin(); it != rng.end(); it++)
-						{
-							memset(&array[it->Start], TRUE, it->Length);
-						}
-					}
+						SetRunPosRange(out, pos, *p, st[i], ed[i],
+							File.PositionSorted(*p));
+					} else
+						memset(out + p->Start, TRUE, p->Length);
 				}
 			}
+		}
 
-		} else {
-			// include != NULL
-			vector<C_Int32> *varPos = NULL;
-			if (pFrom && pTo)
-				varPos = &File.Position();
+		if (intersect)
+			Sel.IntersectVariant(out);
 
-			CChromIndex &Chrom = File.Chromosome();
-			map<string, CRangeSet> RngSets;
+		if (verbose)
+		{
+			int n = File.VariantSelNum();
+			printf("# of selected variants: %s\n", PrettyInt(n));
+		}
 
-			size_t n = XLENGTH(include);
-			for (size_t idx=0; idx < n; idx++)
-			{
-				string s = CHAR(STRING_ELT(include, idx));
+	COREARRAY_CATCH_NONE
+}
 
-				if (IsNum == TRUE)
-				{
-					if (!is_numeric(s)) continue;
-				} else if (IsNum == FALSE)
-				{
-					if (is_numeric(s)) continue;
-				}
 
-				map<string, CChromIndex::TRangeList>::iterator it =
-					Chrom.Map.find(s);
-				if (it != Chrom.Map.end())
+
+/// set a working space with a large number of regions, and return the
+/// selected variants in each region if 'ret_index'
+PY_EXPORT PyObject* SEQ_SetRegions(PyObject *self, PyObject *args)
+{
+	int file_id;
+	PyObject *chrom, *start, *end;
+	int intersect, verbose, ret_index;
+	if (!PyArg_ParseTuple(args, "iOOO" BSTR BSTR BSTR, &file_id, &chrom, &start,
+			&end, &intersect, &verbose, &ret_index))
+		return NULL;
+
+	COREARRAY_TRY
+
+		CFileInfo &File = GetFileInfo(file_id);
+		TSelection &Sel = File.Selection();
+		C_BOOL *pArray = Sel.wVariant();
+		int Count = File.VariantNum();
+		// worker threads may be reading GDS nodes
+		CGDSLock lock(File.GDSShared());
+
+		// regions
+		vector<string> chr;
+		vector<int> st, ed;
+		numpy_to_string(chrom, chr);
+		numpy_to_int32(start, st);
+		numpy_to_int32(end, ed);
+		if ((st.size() != chr.size()) || (ed.size() != chr.size()))
+			throw ErrSeqArray("'start' and 'end' should have the same length as 'chrom'.");
+		const size_t nRegion = chr.size();
+
+		CChromIndex &Chrom = File.Chromosome();
+		const C_Int32 *pos = (Count > 0) ? &File.Position()[0] : NULL;
+
+		// the variants in the regions
+		vector<C_BOOL> tmp;
+		C_BOOL *out = pArray;
+		if (intersect)
+		{
+			tmp.resize(Count, FALSE);
+			out = &tmp[0];
+		} else
+			memset(pArray, FALSE, Count);
+
+		// group the regions by chromosome
+		map<string, vector<int> > Group;
+		for (size_t i=0; i < nRegion; i++)
+			if (st[i] <= ed[i]) Group[chr[i]].push_back(i);
+
+		map<string, vector<int> >::iterator it;
+		for (it=Group.begin(); it != Group.end(); it++)
+		{
+			map<string, CChromIndex::TRangeList>::iterator c =
+				Chrom.Map.find(it->first);
+			if (c == Chrom.Map.end()) continue;
+
+			// sort by the starting positions and merge overlapping regions
+			vector<int> &I = it->second;
+			sort(I.begin(), I.end(),
+				[&st](int a, int b) { return st[a] < st[b]; });
+			vector< pair<int,int> > M;
+			for (size_t k=0; k < I.size(); k++)
+			{
+				int s1 = st[I[k]], e1 = ed[I[k]];
+				if (!M.empty() && (s1 <= M.back().second))
 				{
-					if (varPos)
-					{
-						// if from.bp and to.bp
-						int from = pFrom[idx], to = pTo[idx];
-						if (from == NA_INTEGER) from = 0;
-						if (to == NA_INTEGER) to = 2147483647;
-						RngSets[s].AddRange(from, to);
-					} else {
-						// no from.bp and to.bp
-						CChromIndex::TRangeList &rng = it->second;
-						vector<CChromIndex::TRange>::iterator p;
-						for (p=rng.begin(); p != rng.end(); p++)
-						{
-							memset(&array[p->Start], TRUE, p->Length);
-						}
-					}
-				}
+					if (e1 > M.back().second) M.back().second = e1;
+				} else
+					M.push_back(pair<int,int>(s1, e1));
 			}
 
-			if (varPos)
+			// a forward sweep over each run of the chromosome, or a linear scan
+			// if the positions are not sorted in the run
+			CChromIndex::TRangeList::iterator r;
+			for (r=c->second.begin(); r != c->second.end(); r++)
 			{
-				map<string, CRangeSet>::iterator it;
-				for (it=RngSets.begin(); it != RngSets.end(); it++)
+				if (File.PositionSorted(*r))
 				{
-					CChromIndex::TRangeList &rng = Chrom.Map[it->first];
-					CRangeSet &RngSet = it->second;
-					vector<CChromIndex::TRange>::const_iterator p;
-					for (p=rng.begin(); p != rng.end(); p++)
+					const C_Int32 *p = pos + r->Start, *e = p + r->Length;
+					for (size_t k=0; (k < M.size()) && (p < e); k++)
 					{
-						size_t i = p->Start;
-						size_t n = p->Length;
-						C_Int32 *s = &((*varPos)[0]) + i;
-						if (!IsIntersect)
-						{
-							for (; n > 0; n--, i++)
-								if (RngSet.IsIncluded(*s++)) array[i] = TRUE;
-						} else {
-							C_BOOL *b = &sel_array[i];
-							for (; n > 0; n--, i++, s++)
-							{
-								if (*b++)
-									if (RngSet.IsIncluded(*s)) array[i] = TRUE;
-							}
-						}
+						p = lower_bound(p, e, M[k].first);
+						const C_Int32 *q = upper_bound(p, e, M[k].second);
+						if (q > p) memset(out + (p - pos), TRUE, q - p);
+						p = q;
 					}
+				} else {
+					for (size_t k=0; k < M.size(); k++)
+						SetRunPosRange(out, pos, *r, M[k].first, M[k].second, false);
 				}
 			}
 		}
 
-		if (IsIntersect)
+		if (intersect)
+			Sel.IntersectVariant(out);
+
+		if (verbose)
 		{
-			C_BOOL *p = &sel_array[0];
-			C_BOOL *s = &array[0];
-			for (size_t n=sel_array.size(); n > 0; n--)
-				(*p++) &= (*s++);
+			int n = File.VariantSelNum();
+			printf("# of selected variants: %s\n", PrettyInt(n));
 		}
 
-		if (Rf_asLogical(verbose) == TRUE)
+		if (!ret_index) Py_RETURN_NONE;
+
+		// the selected variants in each region, as the indices in the new
+		// selection, region i with index[offset[i]:offset[i+1]]
+		const CSelRank &Rank = Sel.VariantRank();
+		vector<C_Int32> offset(nRegion + 1), index;
+		for (size_t i=0; i < nRegion; i++)
 		{
-			int n = GetNumOfTRUE(&sel_array[0], sel_array.size());
-			Rprintf("# of selected variants: %s\n", PrettyInt(n));
+			offset[i] = index.size();
+			if (st[i] > ed[i]) continue;
+			map<string, CChromIndex::TRangeList>::iterator c =
+				Chrom.Map.find(chr[i]);
+			if (c == Chrom.Map.end()) continue;
+			CChromIndex::TRangeList::iterator r;
+			for (r=c->second.begin(); r != c->second.end(); r++)
+			{
+				const C_Int32 *b = pos + r->Start, *e = b + r->Length;
+				if (File.PositionSorted(*r))
+				{
+					// the selected variants in [lo, hi) are consecutive
+					const C_Int32 *lo = lower_bound(b, e, st[i]);
+					const C_Int32 *hi = upper_bound(lo, e, ed[i]);
+					size_t k1 = Rank.Rank(hi - pos);
+					for (size_t k = Rank.Rank(lo - pos); k < k1; k++)
+						index.push_back(k);
+				} else {
+					for (const C_Int32 *p=b; p < e; p++)
+					{
+						if ((st[i] <= *p) && (*p <= ed[i]) && pArray[p - pos])
+							index.push_back(Rank.Rank(p - pos));
+					}
+				}
+			}
 		}
+		offset[nRegion] = index.size();
 
-		UNPROTECT(nProtected);
+		PyObject *v1 = numpy_new_int32(offset.size());
+		memcpy(numpy_getptr(v1), &offset[0], sizeof(C_Int32)*offset.size());
+		PyObject *v2 = numpy_new_int32(index.size());
+		if (!index.empty())
+			memcpy(numpy_getptr(v2), &index[0], sizeof(C_Int32)*index.size());
+		return Py_BuildValue("(NN)", v1, v2);
 
-	COREARRAY_CATCH
+	COREARRAY_CATCH_NONE
 }
-*/
-
 
 // ================================================================
 
@@ -706,26 +715,8 @@ PY_EXPORT PyObject* SEQ_GetSpace(PyObject *self, PyObject *args)
 
 // ===========================================================
 
-inline static C_BOOL *CLEAR_SELECTION(size_t num, C_BOOL *p)
-{
-	while (num > 0)
-	{
-		if (*p != FALSE) { num--; *p = FALSE; }
-		p ++;
-	}
-	return p;
-}
-inline static C_BOOL *SKIP_SELECTION(size_t num, C_BOOL *p)
-{
-	while (num > 0)
-	{
-		if (*p != FALSE) num--;
-		p ++;
-	}
-	return p;
-}
-
-/// split the selected variants according to multiple processes
+/// split the selected variants according to multiple processes, and return
+/// (start, count, total) of the selected elements for the process
 PY_EXPORT PyObject* SEQ_SplitSelection(PyObject *self, PyObject *args)
 {
 	int file_id, proc_idx, proc_ncpu;
@@ -739,23 +730,28 @@ PY_EXPORT PyObject* SEQ_SplitSelection(PyObject *self, PyObject *args)
 		CFileInfo &File = GetFileInfo(file_id);
 		TSelection &s = File.Selection();
 
-		// the total number of selected elements
-		int SelectCount;
+		// the selection and its rank/select index
 		C_BOOL *sel;
+		size_t Count;
+		const CSelRank *Rank;
 		if (strcmp(split, "by.variant") == 0)
 		{
-			sel = &s.Variant[0];
-			SelectCount = GetNumOfTRUE(sel, s.Variant.size());
+			Rank = &s.VariantRank();
+			sel = s.wVariant();
+			Count = s.Variant.size();
 		} else if (strcmp(split, "by.sample") == 0)
 		{
-			sel = &s.Sample[0];
-			SelectCount = GetNumOfTRUE(sel, s.Sample.size());
+			Rank = &s.SampleRank();
+			sel = s.wSample();
+			Count = s.Sample.size();
 		} else if (strcmp(split, "none") == 0)
 		{
 			Py_RETURN_NONE;
 		} else {
 			throw ErrSeqArray("'split' should be 'by.variant', 'by.sample' or 'none'.");
 		}
+		// the total number of selected elements
+		const int SelectCount = Rank->Count();
 
 		// split a list
 		vector<int> split(proc_ncpu);
@@ -768,20 +764,20 @@ PY_EXPORT PyObject* SEQ_SplitSelection(PyObject *self, PyObject *args)
 		}
 
 		// ---------------------------------------------------
-		int st = 0;
-		for (int i=0; i < proc_idx; i++)
-		{
-			sel = CLEAR_SELECTION(split[i] - st, sel);
-			st = split[i];
-		}
+		// keep the selected elements in [st, st+ans_n)
+		int st = (proc_idx > 0) ? split[proc_idx-1] : 0;
 		int ans_n = split[proc_idx] - st;
-		sel = SKIP_SELECTION(ans_n, sel);
-		st = split[proc_idx];
-		for (int i=proc_idx+1; i < proc_ncpu; i++)
+		if (ans_n > 0)
 		{
-			sel = CLEAR_SELECTION(split[i] - st, sel);
-			st = split[i];
-		}
+			size_t i_st = Rank->Select(st);
+			size_t i_end = Rank->Select(st + ans_n - 1) + 1;
+			memset(sel, FALSE, i_st);
+			memset(sel + i_end, FALSE, Count - i_end);
+		} else
+			memset(sel, FALSE, Count);
+
+		// the starting index and count in the selected elements, and the total
+		return Py_BuildValue("(iii)", st, ans_n, SelectCount);
 
 		/*
 		// ---------------------------------------------------
@@ -1007,6 +1003,78 @@ PY_EXPORT PyObject* SEQ_System()
 */
 
 
+// ===========================================================
+// Multithreading
+// ===========================================================
+
+/// get or set the default number of threads
+PY_EXPORT PyObject* SEQ_NumThread(PyObject *self, PyObject *args)
+{
+	PyObject *num = Py_None;
+	if (!PyArg_ParseTuple(args, "|O", &num))
+		return NULL;
+
+	COREARRAY_TRY
+		if (num != Py_None)
+		{
+			long n = PyLong_AsLong(num);
+			if ((n == -1) && PyErr_Occurred()) return NULL;
+			SetNumThread(n);
+		}
+		return PyLong_FromLong(GetNumThread());
+	COREARRAY_CATCH_NONE
+}
+
+
+
+// ===========================================================
+// Performance counters
+// ===========================================================
+
+/// set an item of a dictionary, stealing the reference of 'val'
+static void dict_set(PyObject *dict, const char *key, PyObject *val)
+{
+	PyDict_SetItemString(dict, key, val);
+	Py_DECREF(val);
+}
+
+/// get the performance counters, enabled by building with PYSEQARRAY_STATS
+PY_EXPORT PyObject* SEQ_Stats(PyObject *self, PyObject *args)
+{
+	COREARRAY_TRY
+		PyObject *rv_ans = PyDict_New();
+	#ifdef PYSEQARRAY_STATS
+		dict_set(rv_ans, "enabled", PyBool_FromLong(1));
+		for (int i=0; i < STAT_NUM_STAGE; i++)
+		{
+			const TStatCounter &c = StatStage[i];
+			PyObject *v = PyDict_New();
+			dict_set(v, "ns", PyLong_FromLongLong(c.NanoSec.load()));
+			dict_set(v, "bytes", PyLong_FromLongLong(c.Bytes.load()));
+			dict_set(v, "calls", PyLong_FromLongLong(c.Count.load()));
+			dict_set(rv_ans, StatStageName[i], v);
+		}
+		dict_set(rv_ans, "gds_iter_calls",
+			PyLong_FromLongLong(StatGDSIter.load()));
+		dict_set(rv_ans, "index_reset",
+			PyLong_FromLongLong(StatIndexReset.load()));
+	#else
+		dict_set(rv_ans, "enabled", PyBool_FromLong(0));
+	#endif
+		return rv_ans;
+	COREARRAY_CATCH_NONE
+}
+
+/// clear the performance counters
+PY_EXPORT PyObject* SEQ_StatsReset(PyObject *self, PyObject *args)
+{
+	COREARRAY_TRY
+		StatReset();
+	COREARRAY_CATCH_NONE
+}
+
+
+
 // ===========================================================
 // the initial function when the package is loaded
 // ===========================================================
@@ -1015,8 +1083,11 @@ PY_EXPORT PyObject* SEQ_System()
 
 extern PyObject* SEQ_GetData(PyObject *self, PyObject *args);
 extern PyObject* SEQ_BApply_Variant(PyObject *self, PyObject *args);
+extern PyObject* SEQ_BApply_Sample(PyObject *self, PyObject *args);
 
 extern PyObject* FC_CalcAF(PyObject *self, PyObject *args);
+extern PyObject* FC_CalcAC(PyObject *self, PyObject *args);
+extern PyObject* FC_Reduce(PyObject *self, PyObject *args);
 
 
 static PyMethodDef module_methods[] = {
@@ -1027,20 +1098,31 @@ static PyMethodDef module_methods[] = {
 	{ "flt_push", (PyCFunction)SEQ_FilterPush, METH_VARARGS, NULL },
 	{ "flt_pop", (PyCFunction)SEQ_FilterPop, METH_VARARGS, NULL },
 	{ "flt_split", (PyCFunction)SEQ_SplitSelection, METH_VARARGS, NULL },
+	{ "flt_thread", (PyCFunction)SEQ_FilterThread, METH_VARARGS, NULL },
 
 	{ "set_sample", (PyCFunction)SEQ_SetSpaceSample, METH_VARARGS, NULL },
 	{ "set_sample2", (PyCFunction)SEQ_SetSpaceSample2, METH_VARARGS, NULL },
 	{ "set_variant", (PyCFunction)SEQ_SetSpaceVariant, METH_VARARGS, NULL },
 	{ "set_variant2", (PyCFunction)SEQ_SetSpaceVariant2, METH_VARARGS, NULL },
+	{ "set_chrom", (PyCFunction)SEQ_SetChrom, METH_VARARGS, NULL },
+	{ "set_regions", (PyCFunction)SEQ_SetRegions, METH_VARARGS, NULL },
 
 	{ "get_filter", (PyCFunction)SEQ_GetSpace, METH_VARARGS, NULL },
 
+	{ "num_thread", (PyCFunction)SEQ_NumThread, METH_VARARGS, NULL },
+
+	{ "stats", (PyCFunction)SEQ_Stats, METH_NOARGS, NULL },
+	{ "stats_reset", (PyCFunction)SEQ_StatsReset, METH_NOARGS, NULL },
+
 	// get data
     { "get_data", (PyCFunction)SEQ_GetData, METH_VARARGS, NULL },
     { "apply", (PyCFunction)SEQ_BApply_Variant, METH_VARARGS, NULL },
+    { "apply_sample", (PyCFunction)SEQ_BApply_Sample, METH_VARARGS, NULL },
 
-	// get data
-	// { "calc_af", (PyCFunction)FC_CalcAF, METH_VARARGS, NULL },
+	// methods
+	{ "calc_af", (PyCFunction)FC_CalcAF, METH_VARARGS, NULL },
+	{ "calc_ac", (PyCFunction)FC_CalcAC, METH_VARARGS, NULL },
+	{ "reduce", (PyCFunction)FC_Reduce, METH_VARARGS, NULL },
 
 	// end
 	{ NULL, NULL, 0, NULL }
@@ -20,6 +20,7 @@
 // If not, see <http://www.gnu.org/licenses/>.
 
 #include "ReadByVariant.h"
+#include "Parallel.h"
 
 
 namespace PySeqArray
@@ -136,6 +137,7 @@ CApply_Variant_Geno::CApply_Variant_Geno(): CApply_Variant()
 {
 	fVarType = ctGenotype;
 	SiteCount = CellCount = 0; SampNum = 0; Ploidy = 0;
+	GDSLock = false;
 	VarIntGeno = VarNode = NULL;
 }
 
@@ -144,6 +146,7 @@ CApply_Variant_Geno::CApply_Variant_Geno(CFileInfo &File):
 {
 	fVarType = ctGenotype;
 	SiteCount = CellCount = 0; SampNum = 0; Ploidy = 0;
+	GDSLock = false;
 	VarIntGeno = VarNode = NULL;
 	Init(File);
 }
@@ -153,6 +156,9 @@ CApply_Variant_Geno::~CApply_Variant_Geno()
 	if (VarIntGeno) Py_DECREF(VarIntGeno);
 }
 
+/// use the gather path if less than 1/GENO_SPARSE_RATIO of entries selected
+static const ssize_t GENO_SPARSE_RATIO = 4;
+
 void CApply_Variant_Geno::Init(CFileInfo &File)
 {
 	static const char *VAR_NAME = "genotype/data";
@@ -192,79 +198,179 @@ void CApply_Variant_Geno::Init(CFileInfo &File)
 		}
 	}
 
+	// a sparse subset of samples, gather the selected entries by offsets
+	if ((CellCount > 0) && (CellCount*GENO_SPARSE_RATIO < SiteCount))
+	{
+		SelIdx.resize(CellCount);
+		vec_u8_nonzero_index((const C_UInt8*)&Selection[0], SiteCount,
+			&SelIdx[0]);
+	} else
+		SelIdx.clear();
+
 	ExtPtr.reset(SiteCount);
 	VarIntGeno = VarNode = NULL;
+	RunStart = RunEnd = 0;
+	RunPos = 0;
+	RunIndex.clear(); RunNum.clear();
 	Reset();
 }
 
-int CApply_Variant_Geno::_ReadGenoData(int *Base)
-{
-	C_UInt8 NumIndexRaw;
-	C_Int64 Index;
-	GenoIndex->GetInfo(Position, Index, NumIndexRaw);
+/// the maximum size of the buffer for a run of contiguous selected variants
+static const C_Int64 GENO_RUN_BUFSIZE = 4*1024*1024;
+/// the maximum size if GDS_Mutex is shared with other threads, to bound the
+/// time of holding the lock in a read
+static const C_Int64 GENO_RUN_BUFSIZE_MT = 512*1024;
 
-	if (NumIndexRaw >= 1)
+/// get the index of bit layers of the current variant, from the variants
+/// scanned ahead if possible, not to move the cursor of GenoIndex backward
+void CApply_Variant_Geno::_GetInfo(C_Int64 &Index, C_UInt8 &NumIndexRaw)
+{
+	const ssize_t k = Position - RunPos;
+	if ((k >= 0) && (k < (ssize_t)RunIndex.size()))
 	{
-		CdIterator it;
-		GDS_Iter_Position(Node, &it, Index*SiteCount);
-		GDS_Iter_RDataEx(&it, Base, SiteCount, svInt32, &Selection[0]);
+		Index = RunIndex[k];
+		NumIndexRaw = RunNum[k];
+	} else
+		GenoIndex->GetInfo(Position, Index, NumIndexRaw);
+}
 
-		const int bit_mask = 0x03;
-		int missing = bit_mask;
-		for (C_UInt8 i=1; i < NumIndexRaw; i++)
+/// get the index of bit layers of the current variant, and return its raw
+/// layers in RunBuf, or NULL if no layer; the following contiguous selected
+/// variants are read in the same call, and their layer indices are kept so
+/// that GenoIndex is only moved forward; GDS_Mutex is held for the index
+/// lookups and the raw read, but not for the decoding
+const C_UInt8 *CApply_Variant_Geno::_RunData(C_Int64 &Index,
+	C_UInt8 &NumIndexRaw)
+{
+	C_Int64 End;
+	{
+		CGDSLock lock(GDSLock);
+		_GetInfo(Index, NumIndexRaw);
+		if (NumIndexRaw < 1) return NULL;
+		if ((RunStart <= Index) && (Index + NumIndexRaw <= RunEnd))
+			return &RunBuf[(Index - RunStart) * SiteCount];
+
+		// the following selected variants have contiguous bit layers
+		C_Int64 MaxLayer = (GDSLock ? GENO_RUN_BUFSIZE_MT : GENO_RUN_BUFSIZE) /
+			SiteCount;
+		End = Index + NumIndexRaw;
+		RunPos = Position;
+		RunIndex.assign(1, Index);
+		RunNum.assign(1, NumIndexRaw);
+		for (ssize_t p=Position+1; (p < MarginalSize) && MarginalSelect[p]; p++)
 		{
-			GDS_Iter_RDataEx(&it, ExtPtr.get(), SiteCount, svUInt8, &Selection[0]);
-
-			C_UInt8 shift = i * 2;
-			C_UInt8 *s = (C_UInt8*)ExtPtr.get();
-			int *p = Base;
-			for (ssize_t n=CellCount; n > 0; n--)
-				*p++ |= int(*s++) << shift;
-
-			missing = (missing << 2) | bit_mask;
+			C_Int64 I;
+			C_UInt8 N;
+			GenoIndex->GetInfo(p, I, N);
+			if (I + N - Index > MaxLayer) break;
+			End = I + N;
+			RunIndex.push_back(I);
+			RunNum.push_back(N);
 		}
+	}
 
-		return missing;
+	// read the raw bytes of the run, padded for the 4-byte gather
+	const ssize_t size = (End - Index) * SiteCount;
+	RunBuf.resize(size + 3);
+	{
+		CGDSLock lock(GDSLock);
+		STAT_TIMER(tm, STAT_GENO_READ);
+		CdIterator it;
+		GDS_Iter_Position(Node, &it, Index*SiteCount);
+		GDS_Iter_RData(&it, &RunBuf[0], size, svUInt8);
+		STAT_BYTES(STAT_GENO_READ, size);
+		STAT_GDS_ITER(2);
+	}
+	RunStart = Index;
+	RunEnd = End;
+	return &RunBuf[0];
+}
+
+/// select the entries of the selected samples from a raw bit layer
+void CApply_Variant_Geno::_SelLayer(const C_UInt8 *s, C_UInt8 *p)
+{
+	if (CellCount == SiteCount)
+	{
+		memcpy(p, s, CellCount);
+	} else if (!SelIdx.empty())
+	{
+		vec_u8_gather(s, &SelIdx[0], CellCount, p);
 	} else {
+		const C_BOOL *sel = &Selection[0];
+		for (ssize_t n=SiteCount; n > 0; n--, s++)
+			if (*sel++) *p++ = *s;
+	}
+}
+
+int CApply_Variant_Geno::_DecodeGeno(const C_UInt8 *run, C_UInt8 NumIndexRaw,
+	int *Base)
+{
+	if (!run)
+	{
 		memset(Base, 0, sizeof(int)*CellCount);
 		return 0;
 	}
+
+	STAT_TIMER(tm, STAT_GENO_DECODE);
+	C_UInt8 *s = (C_UInt8*)ExtPtr.get();
+	_SelLayer(run, s);
+	for (ssize_t n=0; n < CellCount; n++) Base[n] = s[n];
+
+	const int bit_mask = 0x03;
+	int missing = bit_mask;
+	for (C_UInt8 i=1; i < NumIndexRaw; i++)
+	{
+		_SelLayer(run + i*SiteCount, s);
+		C_UInt8 shift = i * 2;
+		for (ssize_t n=0; n < CellCount; n++)
+			Base[n] |= int(s[n]) << shift;
+		missing = (missing << 2) | bit_mask;
+	}
+	return missing;
 }
 
-C_UInt8 CApply_Variant_Geno::_ReadGenoData(C_UInt8 *Base)
+C_UInt8 CApply_Variant_Geno::_DecodeGeno(const C_UInt8 *run,
+	C_UInt8 NumIndexRaw, C_UInt8 *Base)
 {
-	C_UInt8 NumIndexRaw;
-	C_Int64 Index;
-	GenoIndex->GetInfo(Position, Index, NumIndexRaw);
-
-	if (NumIndexRaw >= 1)
+	if (!run)
 	{
-		CdIterator it;
-		GDS_Iter_Position(Node, &it, Index*SiteCount);
-		GDS_Iter_RDataEx(&it, Base, SiteCount, svUInt8, &Selection[0]);
+		memset(Base, 0, CellCount);
+		return 0;
+	}
 
-		const C_UInt8 bit_mask = 0x03;
-		C_UInt8 missing = bit_mask;
-		if (NumIndexRaw > 4) NumIndexRaw = 4;
+	STAT_TIMER(tm, STAT_GENO_DECODE);
+	_SelLayer(run, Base);
 
-		for (C_UInt8 i=1; i < NumIndexRaw; i++)
-		{
-			GDS_Iter_RDataEx(&it, ExtPtr.get(), SiteCount, svUInt8, &Selection[0]);
+	const C_UInt8 bit_mask = 0x03;
+	C_UInt8 missing = bit_mask;
+	if (NumIndexRaw > 4) NumIndexRaw = 4;
 
-			C_UInt8 shift = i * 2;
-			C_UInt8 *s = (C_UInt8*)ExtPtr.get();
-			C_UInt8 *p = Base;
-			for (ssize_t n=CellCount; n > 0; n--)
-				*p++ |= (*s++) << shift;
+	C_UInt8 *s = (C_UInt8*)ExtPtr.get();
+	for (C_UInt8 i=1; i < NumIndexRaw; i++)
+	{
+		_SelLayer(run + i*SiteCount, s);
+		C_UInt8 shift = i * 2;
+		for (ssize_t n=0; n < CellCount; n++)
+			Base[n] |= s[n] << shift;
+		missing = (missing << 2) | bit_mask;
+	}
+	return missing;
+}
 
-			missing = (missing << 2) | bit_mask;
-		}
+int CApply_Variant_Geno::_ReadGenoData(int *Base)
+{
+	C_UInt8 NumIndexRaw;
+	C_Int64 Index;
+	const C_UInt8 *run = _RunData(Index, NumIndexRaw);
+	return _DecodeGeno(run, NumIndexRaw, Base);
+}
 
-		return missing;
-	} else {
-		memset(Base, 0, CellCount);
-		return 0;
-	}
+C_UInt8 CApply_Variant_Geno::_ReadGenoData(C_UInt8 *Base)
+{
+	C_UInt8 NumIndexRaw;
+	C_Int64 Index;
+	const C_UInt8 *run = _RunData(Index, NumIndexRaw);
+	return _DecodeGeno(run, NumIndexRaw, Base);
 }
 
 void CApply_Variant_Geno::ReadGenoData(int *Base)
@@ -283,7 +389,10 @@ PyObject* CApply_Variant_Geno::NeedArray()
 {
 	C_UInt8 NumIndexRaw;
 	C_Int64 Index;
-	GenoIndex->GetInfo(Position, Index, NumIndexRaw);
+	{
+		CGDSLock lock(GDSLock);
+		_GetInfo(Index, NumIndexRaw);
+	}
 	if (NumIndexRaw > 4)
 	{
 		if (!VarIntGeno)
@@ -300,7 +409,7 @@ void CApply_Variant_Geno::ReadData(PyObject *val)
 {
 	void *ptr = numpy_getptr(val);
 	if (numpy_is_uint8(val))
-		ReadGenoData((C_UInt8*)val);
+		ReadGenoData((C_UInt8*)ptr);
 	else
 		ReadGenoData((int*)ptr);
 }
@@ -327,15 +436,48 @@ void CApply_Variant_Dosage::ReadData(PyObject *val)
 {
 	void *ptr = numpy_getptr(val);
 	if (numpy_is_uint8(val))
-		ReadDosage((C_UInt8*)val);
+		ReadDosage((C_UInt8*)ptr);
 	else
 		ReadDosage((int*)ptr);
 }
 
+const C_UInt8 *CApply_Variant_Dosage::_FoldLayer(const C_UInt8 *run,
+	C_UInt8 NumIndexRaw)
+{
+	// a single layer of all samples, counted in place
+	if ((NumIndexRaw == 1) && (CellCount == SiteCount))
+		return run;
+
+	STAT_TIMER(tm, STAT_GENO_DECODE);
+	C_UInt8 *s = (C_UInt8 *)ExtPtr2.get();
+	_SelLayer(run, s);
+	// a genotype is 0 if all layers are 0, or missing if all layers are 3
+	C_UInt8 *t = (C_UInt8 *)ExtPtr.get();
+	for (C_UInt8 i=1; i < NumIndexRaw; i++)
+	{
+		_SelLayer(run + i*SiteCount, t);
+		for (ssize_t n=0; n < CellCount; n++)
+			if (s[n] != t[n]) s[n] = 1;
+	}
+	return s;
+}
+
 void CApply_Variant_Dosage::ReadDosage(int *Base)
 {
+	C_UInt8 NumIndexRaw;
+	C_Int64 Index;
+	const C_UInt8 *run = _RunData(Index, NumIndexRaw);
+	if ((Ploidy == 2) && run) // diploid
+	{
+		// count from the raw bit layers
+		const C_UInt8 *s = _FoldLayer(run, NumIndexRaw);
+		vec_i8_cnt_dosage2_i32((const int8_t *)s, Base, SampNum, 0, 3,
+			NA_INTEGER);
+		return;
+	}
+
 	int *p = (int *)ExtPtr2.get();
-	int missing = _ReadGenoData(p);
+	int missing = _DecodeGeno(run, NumIndexRaw, p);
 
 	// count the number of reference allele
 	if (Ploidy == 2) // diploid
@@ -361,8 +503,21 @@ void CApply_Variant_Dosage::ReadDosage(int *Base)
 
 void CApply_Variant_Dosage::ReadDosage(C_UInt8 *Base)
 {
+	C_UInt8 NumIndexRaw;
+	C_Int64 Index;
+	const C_UInt8 *run = _RunData(Index, NumIndexRaw);
+	if ((Ploidy == 2) && run) // diploid
+	{
+		// count from the raw bit layers, up to 4 layers as _DecodeGeno()
+		if (NumIndexRaw > 4) NumIndexRaw = 4;
+		const C_UInt8 *s = _FoldLayer(run, NumIndexRaw);
+		vec_i8_cnt_dosage2((const int8_t *)s, (int8_t *)Base, SampNum, 0, 3,
+			NA_UINT8);
+		return;
+	}
+
 	C_UInt8 *p = (C_UInt8 *)ExtPtr2.get();
-	C_UInt8 missing = _ReadGenoData(p);
+	C_UInt8 missing = _DecodeGeno(run, NumIndexRaw, p);
 
 	// count the number of reference allele
 	if (Ploidy == 2) // diploid
@@ -370,7 +525,6 @@ void CApply_Variant_Dosage::ReadDosage(C_UInt8 *Base)
 		vec_i8_cnt_dosage2((int8_t *)p, (int8_t *)Base, SampNum, 0,
 			missing, NA_UINT8);
 	} else {
-		C_UInt8 *p = (C_UInt8 *)ExtPtr.get();
 		for (int n=SampNum; n > 0; n--)
 		{
 			C_UInt8 cnt = 0;
@@ -389,6 +543,37 @@ void CApply_Variant_Dosage::ReadDosage(C_UInt8 *Base)
 }
 
 
+
+// =====================================================================
+// Object for reading bit-packed genotypes variant by variant
+
+CApply_Variant_GenoPacked::CApply_Variant_GenoPacked(CFileInfo &File):
+	CApply_Variant_Geno(File)
+{
+	PackedSize = (CellCount + 3) / 4;
+	ExtPtr2.reset(CellCount);
+}
+
+PyObject* CApply_Variant_GenoPacked::NeedArray()
+{
+	if (!VarNode) VarNode = numpy_new_uint8(PackedSize);
+	return VarNode;
+}
+
+void CApply_Variant_GenoPacked::ReadData(PyObject *val)
+{
+	ReadGenoPacked((C_UInt8*)numpy_getptr(val));
+}
+
+void CApply_Variant_GenoPacked::ReadGenoPacked(C_UInt8 *Base)
+{
+	C_UInt8 *p = (C_UInt8 *)ExtPtr2.get();
+	// missing values are 0x03, 0x0F, ..., all of which are set to 3 in packing
+	_ReadGenoData(p);
+	vec_u8_pack_b2(p, CellCount, Base);
+}
+
+
 /*
 // =====================================================================
 // Object for reading phasing information variant by variant
@@ -81,15 +81,28 @@ protected:
 	ssize_t SiteCount;  ///< the total number of entries at a site
 	ssize_t CellCount;  ///< the selected number of entries at a site
 	vector<C_BOOL> Selection;  ///< the buffer of selection
+	vector<C_Int32> SelIdx;    ///< gather offsets of selected entries if sparse
 	VEC_AUTO_PTR ExtPtr;       ///< a pointer to the additional buffer
 	PyObject *VarIntGeno;      ///< genotype R integer object
-
+	vector<C_UInt8> RunBuf;    ///< raw bit layers of contiguous selected variants
+	C_Int64 RunStart;  ///< the first layer index in RunBuf
+	C_Int64 RunEnd;    ///< the end of layer indices in RunBuf
+	ssize_t RunPos;    ///< the position of the first variant scanned ahead
+	vector<C_Int64> RunIndex;  ///< the layer indices of the variants scanned ahead
+	vector<C_UInt8> RunNum;    ///< the numbers of layers of the variants scanned ahead
+
+	inline void _GetInfo(C_Int64 &Index, C_UInt8 &NumIndexRaw);
+	inline const C_UInt8 *_RunData(C_Int64 &Index, C_UInt8 &NumIndexRaw);
+	inline void _SelLayer(const C_UInt8 *s, C_UInt8 *p);
+	inline int _DecodeGeno(const C_UInt8 *run, C_UInt8 NumIndexRaw, int *Base);
+	inline C_UInt8 _DecodeGeno(const C_UInt8 *run, C_UInt8 NumIndexRaw, C_UInt8 *Base);
 	inline int _ReadGenoData(int *Base);
 	inline C_UInt8 _ReadGenoData(C_UInt8 *Base);
 
 public:
 	ssize_t SampNum;  ///< the number of selected samples
 	int Ploidy;       ///< ploidy
+	bool GDSLock;     ///< whether to lock GDS_Mutex when reading from the GDS file
 
 	/// constructor
 	CApply_Variant_Geno();
@@ -115,6 +128,10 @@ class COREARRAY_DLL_LOCAL CApply_Variant_Dosage: public CApply_Variant_Geno
 {
 protected:
 	VEC_AUTO_PTR ExtPtr2;  ///< a pointer to the additional buffer for dosages
+
+	/// fold the raw bit layers of the selected entries to 0 (reference
+	/// allele), 3 (missing) or others, without decoding the genotypes
+	inline const C_UInt8 *_FoldLayer(const C_UInt8 *run, C_UInt8 NumIndexRaw);
 public:
 	/// constructor
 	CApply_Variant_Dosage(CFileInfo &File);
@@ -129,6 +146,33 @@ public:
 };
 
 
+// =====================================================================
+
+/// Object for reading bit-packed genotypes variant by variant
+/** Each allele takes 2 bits, and four alleles are stored in one byte starting
+ *  from the lowest bits (like PLINK .bed). The allele j of the i-th selected
+ *  sample is the k-th value with k = i*Ploidy + j, stored in the byte k/4 at
+ *  the bits 2*(k%4). A 2-bit value is the allele index 0, 1 or 2, and 3 for
+ *  a missing allele or an allele index >= 3 which can not be fit in 2 bits.
+**/
+class COREARRAY_DLL_LOCAL CApply_Variant_GenoPacked: public CApply_Variant_Geno
+{
+protected:
+	VEC_AUTO_PTR ExtPtr2;  ///< a pointer to the additional buffer for genotypes
+public:
+	ssize_t PackedSize;  ///< the number of bytes per variant
+
+	/// constructor
+	CApply_Variant_GenoPacked(CFileInfo &File);
+
+	virtual PyObject *NeedArray();
+	virtual void ReadData(PyObject *val);
+
+	/// read packed genotypes, PackedSize bytes
+	void ReadGenoPacked(C_UInt8 *Base);
+};
+
+
 // =====================================================================
 
 /// Object for reading phasing information variant by variant
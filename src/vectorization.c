@@ -31,11 +31,68 @@
 #include "vectorization.h"
 
 
+// the kernels with runtime dispatch are compiled once more for each target
+// in vectorization_avx2.c and vectorization_avx512bw.c with the suffix
+// VEC_CPU_TARGET, and called via the table of 'TVecKernels'
+
+#define VEC_CAT2(a, b)    a ## b
+#define VEC_CAT(a, b)     VEC_CAT2(a, b)
+
+#if defined(VEC_CPU_TARGET)
+#   define VEC_KERNEL         static
+#   define VEC_NAME(name)     VEC_CAT(name, VEC_CPU_TARGET)
+#elif defined(COREARRAY_SIMD_DISPATCH)
+#   define VEC_KERNEL         static
+#   define VEC_NAME(name)     VEC_CAT(name, _def)
+#else
+#   define VEC_KERNEL
+#   define VEC_NAME(name)     name
+#endif
+
+#ifdef COREARRAY_SIMD_DISPATCH
+/// the table of kernels with runtime dispatch
+struct TVecKernels
+{
+	size_t (*i8_cnt_nonzero)(const int8_t*, size_t);
+	size_t (*i8_count)(const char*, size_t, char);
+	void (*i8_count2)(const char*, size_t, char, char, size_t*, size_t*);
+	void (*i8_count3)(const char*, size_t, char, char, char, size_t*, size_t*,
+		size_t*);
+	void (*i8_replace)(int8_t*, size_t, int8_t, int8_t);
+	void (*i8_cnt_dosage2)(const int8_t*, int8_t*, size_t, int8_t, int8_t,
+		int8_t);
+	void (*u8_shr_b2)(uint8_t*, size_t);
+	void (*u8_gather)(const uint8_t*, const int32_t*, size_t, uint8_t*);
+	void (*i16_shr_b2)(int16_t*, size_t);
+	size_t (*i32_count)(const int32_t*, size_t, int32_t);
+	void (*i32_count2)(const int32_t*, size_t, int32_t, int32_t, size_t*,
+		size_t*);
+	void (*i32_count3)(const int32_t*, size_t, int32_t, int32_t, int32_t,
+		size_t*, size_t*, size_t*);
+	void (*i32_replace)(int32_t*, size_t, int32_t, int32_t);
+	void (*i32_cnt_dosage2)(const int32_t*, int32_t*, size_t, int32_t, int32_t,
+		int32_t);
+	void (*i32_shr_b2)(int32_t*, size_t);
+};
+#endif
+
+
 /// get the number of non-zero
-size_t vec_i8_cnt_nonzero(const int8_t *p, size_t n)
+VEC_KERNEL size_t VEC_NAME(vec_i8_cnt_nonzero)(const int8_t *p, size_t n)
 {
 	size_t ans = 0;
 
+#ifdef COREARRAY_SIMD_AVX512BW
+
+	// body, AVX512BW
+	for (; n >= 64; n-=64, p+=64)
+	{
+		__m512i v = _mm512_loadu_si512((void const*)p);
+		ans += POPCNT_U64(_mm512_test_epi8_mask(v, v));
+	}
+
+#endif
+
 #ifdef COREARRAY_SIMD_SSE2
 
 	const __m128i ZERO = { 0LL, 0LL };
@@ -183,6 +240,8 @@ size_t vec_i8_cnt_nonzero(const int8_t *p, size_t n)
 }
 
 
+#ifndef VEC_CPU_TARGET
+
 /// get the number of non-zeros and the pointer to the first non-zero value
 const int8_t *vec_i8_cnt_nonzero_ptr(const int8_t *p, size_t n, size_t *out_n)
 {
@@ -235,11 +294,25 @@ const char *vec_i8_ptr_nonzero(const char *p, size_t n)
 	return p;
 }
 
+#endif  // VEC_CPU_TARGET
 
-size_t vec_i8_count(const char *p, size_t n, char val)
+
+VEC_KERNEL size_t VEC_NAME(vec_i8_count)(const char *p, size_t n, char val)
 {
 	size_t num = 0;
 
+#ifdef COREARRAY_SIMD_AVX512BW
+
+	// body, AVX512BW
+	const __m512i val64 = _mm512_set1_epi8(val);
+	for (; n >= 64; n-=64, p+=64)
+	{
+		__m512i v = _mm512_loadu_si512((void const*)p);
+		num += POPCNT_U64(_mm512_cmpeq_epi8_mask(v, val64));
+	}
+
+#endif
+
 #ifdef COREARRAY_SIMD_SSE2
 
 	// header 1, 16-byte aligned
@@ -300,8 +373,8 @@ size_t vec_i8_count(const char *p, size_t n, char val)
 		n -= 16; p += 16;
 	}
 
-	if (offset > 0)
-		num += vec_avx_sum_u8(sum);
+	// header 2 and the last 16 bytes are not counted in offset
+	num += vec_avx_sum_u8(sum);
 
 #   else
 	// body, SSE2
@@ -352,11 +425,25 @@ size_t vec_i8_count(const char *p, size_t n, char val)
 }
 
 
-void vec_i8_count2(const char *p, size_t n, char val1, char val2,
-	size_t *out_n1, size_t *out_n2)
+VEC_KERNEL void VEC_NAME(vec_i8_count2)(const char *p, size_t n,
+	char val1, char val2, size_t *out_n1, size_t *out_n2)
 {
 	size_t n1 = 0, n2 = 0;
 
+#ifdef COREARRAY_SIMD_AVX512BW
+
+	// body, AVX512BW
+	const __m512i val64_1 = _mm512_set1_epi8(val1);
+	const __m512i val64_2 = _mm512_set1_epi8(val2);
+	for (; n >= 64; n-=64, p+=64)
+	{
+		__m512i v = _mm512_loadu_si512((void const*)p);
+		n1 += POPCNT_U64(_mm512_cmpeq_epi8_mask(v, val64_1));
+		n2 += POPCNT_U64(_mm512_cmpeq_epi8_mask(v, val64_2));
+	}
+
+#endif
+
 #ifdef COREARRAY_SIMD_SSE2
 
 	// header 1, 16-byte aligned
@@ -412,11 +499,9 @@ void vec_i8_count2(const char *p, size_t n, char val1, char val2,
 		n -= 16; p += 16;
 	}
 
-	if (offset > 0)
-	{
-		n1 += vec_avx_sum_u8(sum1);
-		n2 += vec_avx_sum_u8(sum2);
-	}
+	// header 2 and the last 16 bytes are not counted in offset
+	n1 += vec_avx_sum_u8(sum1);
+	n2 += vec_avx_sum_u8(sum2);
 
 #   else
 	// body, SSE2
@@ -462,11 +547,28 @@ void vec_i8_count2(const char *p, size_t n, char val1, char val2,
 }
 
 
-void vec_i8_count3(const char *p, size_t n, char val1, char val2, char val3,
-	size_t *out_n1, size_t *out_n2, size_t *out_n3)
+VEC_KERNEL void VEC_NAME(vec_i8_count3)(const char *p, size_t n,
+	char val1, char val2, char val3, size_t *out_n1, size_t *out_n2,
+	size_t *out_n3)
 {
 	size_t n1 = 0, n2 = 0, n3 = 0;
 
+#ifdef COREARRAY_SIMD_AVX512BW
+
+	// body, AVX512BW
+	const __m512i val64_1 = _mm512_set1_epi8(val1);
+	const __m512i val64_2 = _mm512_set1_epi8(val2);
+	const __m512i val64_3 = _mm512_set1_epi8(val3);
+	for (; n >= 64; n-=64, p+=64)
+	{
+		__m512i v = _mm512_loadu_si512((void const*)p);
+		n1 += POPCNT_U64(_mm512_cmpeq_epi8_mask(v, val64_1));
+		n2 += POPCNT_U64(_mm512_cmpeq_epi8_mask(v, val64_2));
+		n3 += POPCNT_U64(_mm512_cmpeq_epi8_mask(v, val64_3));
+	}
+
+#endif
+
 #ifdef COREARRAY_SIMD_SSE2
 
 	// header 1, 16-byte aligned
@@ -530,12 +632,10 @@ void vec_i8_count3(const char *p, size_t n, char val1, char val2, char val3,
 		n -= 16; p += 16;
 	}
 
-	if (offset > 0)
-	{
-		n1 += vec_avx_sum_u8(sum1);
-		n2 += vec_avx_sum_u8(sum2);
-		n3 += vec_avx_sum_u8(sum3);
-	}
+	// header 2 and the last 16 bytes are not counted in offset
+	n1 += vec_avx_sum_u8(sum1);
+	n2 += vec_avx_sum_u8(sum2);
+	n3 += vec_avx_sum_u8(sum3);
 
 #   else
 	// body, SSE2
@@ -587,8 +687,23 @@ void vec_i8_count3(const char *p, size_t n, char val1, char val2, char val3,
 }
 
 
-void vec_i8_replace(int8_t *p, size_t n, int8_t val, int8_t substitute)
+VEC_KERNEL void VEC_NAME(vec_i8_replace)(int8_t *p, size_t n, int8_t val,
+	int8_t substitute)
 {
+#ifdef COREARRAY_SIMD_AVX512BW
+
+	// body, AVX512BW
+	const __m512i val64 = _mm512_set1_epi8(val);
+	const __m512i sub64 = _mm512_set1_epi8(substitute);
+	for (; n >= 64; n-=64, p+=64)
+	{
+		__m512i v = _mm512_loadu_si512((void const*)p);
+		__mmask64 c = _mm512_cmpeq_epi8_mask(v, val64);
+		if (c) _mm512_mask_storeu_epi8(p, c, sub64);
+	}
+
+#endif
+
 #ifdef COREARRAY_SIMD_SSE2
 
 	// header 1, 16-byte aligned
@@ -617,8 +732,6 @@ void vec_i8_replace(int8_t *p, size_t n, int8_t val, int8_t substitute)
 
 	const __m256i mask2 = _mm256_set1_epi8(val);
 	const __m256i sub32 = _mm256_set1_epi8(substitute);
-	const __m256i zero = _mm256_setzero_si256();
-	const __m256i ones = _mm256_cmpeq_epi64(zero, zero);
 
 	for (; n >= 32; n-=32, p+=32)
 	{
@@ -651,9 +764,36 @@ void vec_i8_replace(int8_t *p, size_t n, int8_t val, int8_t substitute)
 }
 
 
-void vec_i8_cnt_dosage2(const int8_t *p, int8_t *out, size_t n, int8_t val,
-	int8_t missing, int8_t missing_substitute)
+VEC_KERNEL void VEC_NAME(vec_i8_cnt_dosage2)(const int8_t *p, int8_t *out,
+	size_t n, int8_t val, int8_t missing, int8_t missing_substitute)
 {
+#ifdef COREARRAY_SIMD_AVX512BW
+
+	// body, AVX512BW
+	const __m512i val64  = _mm512_set1_epi8(val);
+	const __m512i miss64 = _mm512_set1_epi8(missing);
+	const __m512i sub64  = _mm512_set1_epi8(missing_substitute);
+	const __m512i one64  = _mm512_set1_epi8(1);
+	for (; n >= 64; n-=64, p+=128, out+=64)
+	{
+		__m512i w1 = _mm512_loadu_si512((void const*)p);
+		__m512i w2 = _mm512_loadu_si512((void const*)(p + 64));
+		// the first and second entries of each pair
+		__m512i v1 = _mm512_inserti64x4(_mm512_castsi256_si512(
+			_mm512_cvtepi16_epi8(w1)), _mm512_cvtepi16_epi8(w2), 1);
+		__m512i v2 = _mm512_inserti64x4(_mm512_castsi256_si512(
+			_mm512_cvtepi16_epi8(_mm512_srli_epi16(w1, 8))),
+			_mm512_cvtepi16_epi8(_mm512_srli_epi16(w2, 8)), 1);
+		__m512i c = _mm512_add_epi8(
+			_mm512_maskz_mov_epi8(_mm512_cmpeq_epi8_mask(v1, val64), one64),
+			_mm512_maskz_mov_epi8(_mm512_cmpeq_epi8_mask(v2, val64), one64));
+		__mmask64 m = _mm512_cmpeq_epi8_mask(v1, miss64) |
+			_mm512_cmpeq_epi8_mask(v2, miss64);
+		_mm512_storeu_si512((void*)out, _mm512_mask_mov_epi8(c, m, sub64));
+	}
+
+#endif
+
 #ifdef COREARRAY_SIMD_SSE2
 
 	// header 1, 16-byte aligned
@@ -759,13 +899,87 @@ void vec_i8_cnt_dosage2(const int8_t *p, int8_t *out, size_t n, int8_t val,
 
 
 
+#ifndef VEC_CPU_TARGET
+
+/// the same as vec_i8_cnt_dosage2, but output in 32-bit integers
+void vec_i8_cnt_dosage2_i32(const int8_t *p, int32_t *out, size_t n,
+	int8_t val, int8_t missing, int32_t missing_substitute)
+{
+#ifdef COREARRAY_SIMD_SSE2
+
+	// body, SSE2
+	const __m128i val16  = _mm_set1_epi8(val);
+	const __m128i miss16 = _mm_set1_epi8(missing);
+	const __m128i sub4   = _mm_set1_epi32(missing_substitute);
+	const __m128i mask   = _mm_set1_epi16(0x00FF);
+	const __m128i zeros  = _mm_setzero_si128();
+
+	for (; n >= 16; n-=16)
+	{
+		__m128i w1 = MM_LOADU_128((__m128i const*)p); p += 16;
+		__m128i w2 = MM_LOADU_128((__m128i const*)p); p += 16;
+
+		__m128i v1 = _mm_packus_epi16(_mm_and_si128(w1, mask), _mm_and_si128(w2, mask));
+		__m128i v2 = _mm_packus_epi16(_mm_srli_epi16(w1, 8), _mm_srli_epi16(w2, 8));
+
+		__m128i c = _mm_setzero_si128();
+		c = _mm_sub_epi8(c, _mm_cmpeq_epi8(v1, val16));
+		c = _mm_sub_epi8(c, _mm_cmpeq_epi8(v2, val16));
+
+		__m128i w = _mm_or_si128(_mm_cmpeq_epi8(v1, miss16),
+			_mm_cmpeq_epi8(v2, miss16));
+
+		// widen the counts and the missing flags to 32 bits
+		__m128i c8[2] = { _mm_unpacklo_epi8(c, zeros), _mm_unpackhi_epi8(c, zeros) };
+		__m128i w8[2] = { _mm_unpacklo_epi8(w, w), _mm_unpackhi_epi8(w, w) };
+		for (int i=0; i < 2; i++)
+		{
+			__m128i c32 = _mm_unpacklo_epi16(c8[i], zeros);
+			__m128i w32 = _mm_unpacklo_epi16(w8[i], w8[i]);
+			c32 = _mm_or_si128(_mm_and_si128(w32, sub4), _mm_andnot_si128(w32, c32));
+			_mm_storeu_si128((__m128i *)out, c32);
+			out += 4;
+			c32 = _mm_unpackhi_epi16(c8[i], zeros);
+			w32 = _mm_unpackhi_epi16(w8[i], w8[i]);
+			c32 = _mm_or_si128(_mm_and_si128(w32, sub4), _mm_andnot_si128(w32, c32));
+			_mm_storeu_si128((__m128i *)out, c32);
+			out += 4;
+		}
+	}
+
+#endif
+
+	// tail
+	for (; n > 0; n--, p+=2)
+	{
+		*out ++ = ((p[0] == missing) || (p[1] == missing)) ?
+			missing_substitute :
+			(p[0]==val ? 1 : 0) + (p[1]==val ? 1 : 0);
+	}
+}
+
+#endif  // VEC_CPU_TARGET
+
 // ===========================================================
 // functions for uint8
 // ===========================================================
 
 /// shifting *p right by 2 bits, assuming p is 2-byte aligned
-void vec_u8_shr_b2(uint8_t *p, size_t n)
+VEC_KERNEL void VEC_NAME(vec_u8_shr_b2)(uint8_t *p, size_t n)
 {
+#ifdef COREARRAY_SIMD_AVX512BW
+
+	// body, AVX512BW
+	const __m512i mask64 = _mm512_set1_epi8(0x3F);
+	for (; n >= 64; n-=64, p+=64)
+	{
+		__m512i v = _mm512_loadu_si512((void const*)p);
+		v = _mm512_and_si512(_mm512_srli_epi16(v, 2), mask64);
+		_mm512_storeu_si512((void*)p, v);
+	}
+
+#endif
+
 #ifdef COREARRAY_SIMD_SSE2
 
 	// header 1, 16-byte aligned
@@ -788,6 +1002,184 @@ void vec_u8_shr_b2(uint8_t *p, size_t n)
 	for (; n > 0; n--) *p++ >>= 2;
 }
 
+#ifndef VEC_CPU_TARGET
+
+/// packing n 2-bit values into (n+3)/4 bytes, values > 3 are set to 3
+void vec_u8_pack_b2(const uint8_t *s, size_t n, uint8_t *out)
+{
+#ifdef COREARRAY_SIMD_SSE2
+
+	// body, SSE2
+	const __m128i three = _mm_set1_epi8(3);
+	const __m128i mask = _mm_set1_epi32(0xFF);
+	for (; n >= 16; n-=16, s+=16, out+=4)
+	{
+		__m128i v = _mm_min_epu8(MM_LOADU_128((__m128i const*)s), three);
+		// b0 | b1<<2 | b2<<4 | b3<<6 in the lowest byte of each 32-bit lane
+		v = _mm_or_si128(v, _mm_srli_epi32(v, 6));
+		v = _mm_or_si128(v, _mm_srli_epi32(v, 12));
+		v = _mm_and_si128(v, mask);
+		v = _mm_packs_epi32(v, v);
+		v = _mm_packus_epi16(v, v);
+		*((int32_t*)out) = _mm_cvtsi128_si32(v);
+	}
+
+#endif
+
+	// tail
+	for (; n >= 4; n-=4, s+=4)
+	{
+		*out++ = (s[0]<3 ? s[0] : 3) | ((s[1]<3 ? s[1] : 3) << 2) |
+			((s[2]<3 ? s[2] : 3) << 4) | ((s[3]<3 ? s[3] : 3) << 6);
+	}
+	if (n > 0)
+	{
+		uint8_t v = 0;
+		for (int shift=0; n > 0; n--, shift+=2, s++)
+			v |= (*s<3 ? *s : 3) << shift;
+		*out = v;
+	}
+}
+
+
+/// packing n boolean bytes into (n+63)/64 words, returning the number of non-zeros
+size_t vec_u8_pack_bool(const uint8_t *s, size_t n, uint64_t *out)
+{
+	size_t cnt = 0;
+
+#ifdef COREARRAY_SIMD_SSE2
+
+	// body, SSE2
+	const __m128i zero = _mm_setzero_si128();
+	for (; n >= 64; n-=64, s+=64)
+	{
+		uint64_t w = 0;
+		int k;
+		for (k=0; k < 4; k++)
+		{
+			__m128i v = _mm_cmpeq_epi8(MM_LOADU_128(s + 16*k), zero);
+			w |= (uint64_t)((~_mm_movemask_epi8(v)) & 0xFFFF) << (16*k);
+		}
+		*out++ = w;
+		cnt += POPCNT_U64(w);
+	}
+
+#endif
+
+	// tail
+	while (n > 0)
+	{
+		uint64_t w = 0;
+		size_t m = (n < 64) ? n : 64;
+		size_t k;
+		for (k=0; k < m; k++)
+			if (s[k]) w |= (uint64_t)1 << k;
+		*out++ = w;
+		cnt += POPCNT_U64(w);
+		s += m; n -= m;
+	}
+	return cnt;
+}
+
+/// unpacking n bits into the bytes 0 or 1
+void vec_u8_unpack_bool(const uint64_t *s, size_t n, uint8_t *out)
+{
+	for (; n >= 64; n-=64)
+	{
+		uint64_t w = *s++;
+		if (w == 0)
+		{
+			memset(out, 0, 64);
+		} else if (w == ~(uint64_t)0)
+		{
+			memset(out, 1, 64);
+		} else {
+			int k;
+			for (k=0; k < 64; k++) out[k] = (w >> k) & 0x01;
+		}
+		out += 64;
+	}
+	if (n > 0)
+	{
+		uint64_t w = *s;
+		size_t k;
+		for (k=0; k < n; k++) out[k] = (w >> k) & 0x01;
+	}
+}
+
+/// the indices of non-zeros, scanning 8 bytes at a time
+size_t vec_u8_nonzero_index(const uint8_t *p, size_t n, int32_t *out)
+{
+	const int32_t *base = out;
+	size_t i = 0;
+	for (; i+8 <= n; i+=8)
+	{
+		uint64_t w;
+		memcpy(&w, p + i, 8);
+	#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+		if (w)
+		{
+			int k;
+			for (k=0; k < 8; k++)
+				if (p[i+k]) *out++ = i + k;
+		}
+	#else
+		while (w)
+		{
+			int k = CTZ_U64(w) >> 3;
+			*out++ = i + k;
+			w &= ~((uint64_t)0xFF << (k << 3));
+		}
+	#endif
+	}
+	for (; i < n; i++)
+		if (p[i]) *out++ = i;
+	return out - base;
+}
+
+#endif  // VEC_CPU_TARGET
+
+
+
+/// gathering out[i] = s[idx[i]]
+VEC_KERNEL void VEC_NAME(vec_u8_gather)(const uint8_t *s, const int32_t *idx,
+	size_t n, uint8_t *out)
+{
+#if defined(COREARRAY_SIMD_AVX512BW)
+
+	// body, AVX512, gather 32-bit words and truncate to the lowest bytes
+	for (; n >= 16; n-=16, idx+=16, out+=16)
+	{
+		__m512i i = _mm512_loadu_si512((void const*)idx);
+		__m512i v = _mm512_i32gather_epi32(i, (void const*)s, 1);
+		_mm_storeu_si128((__m128i*)out, _mm512_cvtepi32_epi8(v));
+	}
+
+#endif
+#if defined(COREARRAY_SIMD_AVX2)
+
+	// body, AVX2, gather 32-bit words and keep the lowest bytes
+	const __m256i mask = _mm256_set1_epi32(0xFF);
+	for (; n >= 8; n-=8, idx+=8, out+=8)
+	{
+		__m256i i = _mm256_loadu_si256((__m256i const*)idx);
+		__m256i v = _mm256_and_si256(
+			_mm256_i32gather_epi32((int const*)s, i, 1), mask);
+		__m128i w = _mm_packus_epi32(_mm256_castsi256_si128(v),
+			_mm256_extracti128_si256(v, 1));
+		_mm_storel_epi64((__m128i*)out, _mm_packus_epi16(w, w));
+	}
+
+#endif
+
+	// tail
+	for (; n >= 4; n-=4, idx+=4, out+=4)
+	{
+		out[0] = s[idx[0]]; out[1] = s[idx[1]];
+		out[2] = s[idx[2]]; out[3] = s[idx[3]];
+	}
+	for (; n > 0; n--) *out++ = s[*idx++];
+}
 
 
 // ===========================================================
@@ -795,8 +1187,19 @@ void vec_u8_shr_b2(uint8_t *p, size_t n)
 // ===========================================================
 
 /// shifting *p right by 2 bits, assuming p is 2-byte aligned
-void vec_i16_shr_b2(int16_t *p, size_t n)
+VEC_KERNEL void VEC_NAME(vec_i16_shr_b2)(int16_t *p, size_t n)
 {
+#ifdef COREARRAY_SIMD_AVX512BW
+
+	// body, AVX512BW
+	for (; n >= 32; n-=32, p+=32)
+	{
+		__m512i v = _mm512_loadu_si512((void const*)p);
+		_mm512_storeu_si512((void*)p, _mm512_srli_epi16(v, 2));
+	}
+
+#endif
+
 #ifdef COREARRAY_SIMD_SSE2
 
 	// header 1, 16-byte aligned
@@ -824,7 +1227,8 @@ void vec_i16_shr_b2(int16_t *p, size_t n)
 // ===========================================================
 
 /// count how many val in p, assuming p is 4-byte aligned
-size_t vec_i32_count(const int32_t *p, size_t n, int32_t val)
+VEC_KERNEL size_t VEC_NAME(vec_i32_count)(const int32_t *p, size_t n,
+	int32_t val)
 {
 	size_t ans = 0;
 
@@ -841,6 +1245,18 @@ size_t vec_i32_count(const int32_t *p, size_t n, int32_t val)
 	}
 #endif
 
+#ifdef COREARRAY_SIMD_AVX512BW
+
+	// body, AVX512BW
+	const __m512i val16 = _mm512_set1_epi32(val);
+	for (; n >= 16; n-=16, p+=16)
+	{
+		__m512i v = _mm512_loadu_si512((void const*)p);
+		ans += POPCNT_U32(_mm512_cmpeq_epi32_mask(v, val16));
+	}
+
+#endif
+
 #ifdef COREARRAY_SIMD_SSE2
 
 	// header 1, 16-byte aligned
@@ -901,8 +1317,8 @@ size_t vec_i32_count(const int32_t *p, size_t n, int32_t val)
 
 
 /// count how many val1 and val2 in p, assuming p is 4-byte aligned
-void vec_i32_count2(const int32_t *p, size_t n, int32_t val1, int32_t val2,
-	size_t *out_n1, size_t *out_n2)
+VEC_KERNEL void VEC_NAME(vec_i32_count2)(const int32_t *p, size_t n,
+	int32_t val1, int32_t val2, size_t *out_n1, size_t *out_n2)
 {
 	size_t n1 = 0, n2 = 0;
 
@@ -923,6 +1339,20 @@ void vec_i32_count2(const int32_t *p, size_t n, int32_t val1, int32_t val2,
 	}
 #endif
 
+#ifdef COREARRAY_SIMD_AVX512BW
+
+	// body, AVX512BW
+	const __m512i val16_1 = _mm512_set1_epi32(val1);
+	const __m512i val16_2 = _mm512_set1_epi32(val2);
+	for (; n >= 16; n-=16, p+=16)
+	{
+		__m512i v = _mm512_loadu_si512((void const*)p);
+		n1 += POPCNT_U32(_mm512_cmpeq_epi32_mask(v, val16_1));
+		n2 += POPCNT_U32(_mm512_cmpeq_epi32_mask(v, val16_2));
+	}
+
+#endif
+
 #ifdef COREARRAY_SIMD_SSE2
 
 	// header 1, 16-byte aligned
@@ -1010,8 +1440,9 @@ void vec_i32_count2(const int32_t *p, size_t n, int32_t val1, int32_t val2,
 
 
 /// count how many val1, val2 and val3 in p, assuming p is 4-byte aligned
-void vec_i32_count3(const int32_t *p, size_t n, int32_t val1, int32_t val2,
-	int32_t val3, size_t *out_n1, size_t *out_n2, size_t *out_n3)
+VEC_KERNEL void VEC_NAME(vec_i32_count3)(const int32_t *p, size_t n,
+	int32_t val1, int32_t val2, int32_t val3, size_t *out_n1, size_t *out_n2,
+	size_t *out_n3)
 {
 	size_t n1 = 0, n2 = 0, n3 = 0;
 
@@ -1033,6 +1464,22 @@ void vec_i32_count3(const int32_t *p, size_t n, int32_t val1, int32_t val2,
 	}
 #endif
 
+#ifdef COREARRAY_SIMD_AVX512BW
+
+	// body, AVX512BW
+	const __m512i val16_1 = _mm512_set1_epi32(val1);
+	const __m512i val16_2 = _mm512_set1_epi32(val2);
+	const __m512i val16_3 = _mm512_set1_epi32(val3);
+	for (; n >= 16; n-=16, p+=16)
+	{
+		__m512i v = _mm512_loadu_si512((void const*)p);
+		n1 += POPCNT_U32(_mm512_cmpeq_epi32_mask(v, val16_1));
+		n2 += POPCNT_U32(_mm512_cmpeq_epi32_mask(v, val16_2));
+		n3 += POPCNT_U32(_mm512_cmpeq_epi32_mask(v, val16_3));
+	}
+
+#endif
+
 #ifdef COREARRAY_SIMD_SSE2
 
 	// header 1, 16-byte aligned
@@ -1133,15 +1580,32 @@ void vec_i32_count3(const int32_t *p, size_t n, int32_t val1, int32_t val2,
 }
 
 
+#ifndef VEC_CPU_TARGET
 void vec_int32_set(int32_t *p, size_t n, int32_t val)
 {
 	for (; n > 0; n--) *p++ = val;
 }
+#endif
 
 
 /// replace 'val' in the array of 'p' by 'substitute', assuming 'p' is 4-byte aligned
-void vec_i32_replace(int32_t *p, size_t n, int32_t val, int32_t substitute)
+VEC_KERNEL void VEC_NAME(vec_i32_replace)(int32_t *p, size_t n, int32_t val,
+	int32_t substitute)
 {
+#ifdef COREARRAY_SIMD_AVX512BW
+
+	// body, AVX512BW
+	const __m512i val16 = _mm512_set1_epi32(val);
+	const __m512i sub16 = _mm512_set1_epi32(substitute);
+	for (; n >= 16; n-=16, p+=16)
+	{
+		__m512i v = _mm512_loadu_si512((void const*)p);
+		__mmask16 c = _mm512_cmpeq_epi32_mask(v, val16);
+		if (c) _mm512_mask_storeu_epi32(p, c, sub16);
+	}
+
+#endif
+
 #ifdef COREARRAY_SIMD_SSE2
 
 	// header 1, 16-byte aligned
@@ -1195,9 +1659,37 @@ void vec_i32_replace(int32_t *p, size_t n, int32_t val, int32_t substitute)
 
 
 /// assuming 'out' is 4-byte aligned, output (p[0]==val) + (p[1]==val) or missing_substitute
-void vec_i32_cnt_dosage2(const int32_t *p, int32_t *out, size_t n, int32_t val,
-	int32_t missing, int32_t missing_substitute)
+VEC_KERNEL void VEC_NAME(vec_i32_cnt_dosage2)(const int32_t *p, int32_t *out,
+	size_t n, int32_t val, int32_t missing, int32_t missing_substitute)
 {
+#ifdef COREARRAY_SIMD_AVX512BW
+
+	// body, AVX512BW
+	const __m512i val16  = _mm512_set1_epi32(val);
+	const __m512i miss16 = _mm512_set1_epi32(missing);
+	const __m512i sub16  = _mm512_set1_epi32(missing_substitute);
+	const __m512i one16  = _mm512_set1_epi32(1);
+	const __m512i even = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14,
+		16, 18, 20, 22, 24, 26, 28, 30);
+	const __m512i odd = _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15,
+		17, 19, 21, 23, 25, 27, 29, 31);
+	for (; n >= 16; n-=16, p+=32, out+=16)
+	{
+		__m512i w1 = _mm512_loadu_si512((void const*)p);
+		__m512i w2 = _mm512_loadu_si512((void const*)(p + 16));
+		// the first and second entries of each pair
+		__m512i v1 = _mm512_permutex2var_epi32(w1, even, w2);
+		__m512i v2 = _mm512_permutex2var_epi32(w1, odd, w2);
+		__m512i c = _mm512_add_epi32(
+			_mm512_maskz_mov_epi32(_mm512_cmpeq_epi32_mask(v1, val16), one16),
+			_mm512_maskz_mov_epi32(_mm512_cmpeq_epi32_mask(v2, val16), one16));
+		__mmask16 m = _mm512_cmpeq_epi32_mask(v1, miss16) |
+			_mm512_cmpeq_epi32_mask(v2, miss16);
+		_mm512_storeu_si512((void*)out, _mm512_mask_mov_epi32(c, m, sub16));
+	}
+
+#endif
+
 #ifdef COREARRAY_SIMD_SSE2
 
 	// header 1, 16-byte aligned
@@ -1323,8 +1815,19 @@ void vec_i32_cnt_dosage2(const int32_t *p, int32_t *out, size_t n, int32_t val,
 
 
 /// shifting *p right by 2 bits, assuming p is 2-byte aligned
-void vec_i32_shr_b2(int32_t *p, size_t n)
+VEC_KERNEL void VEC_NAME(vec_i32_shr_b2)(int32_t *p, size_t n)
 {
+#ifdef COREARRAY_SIMD_AVX512BW
+
+	// body, AVX512BW
+	for (; n >= 16; n-=16, p+=16)
+	{
+		__m512i v = _mm512_loadu_si512((void const*)p);
+		_mm512_storeu_si512((void*)p, _mm512_srli_epi32(v, 2));
+	}
+
+#endif
+
 #ifdef COREARRAY_SIMD_SSE2
 
 	// header 1, 16-byte aligned
@@ -1351,6 +1854,8 @@ void vec_i32_shr_b2(int32_t *p, size_t n)
 // functions for char
 // ===========================================================
 
+#ifndef VEC_CPU_TARGET
+
 const char *vec_char_find_CRLF(const char *p, size_t n)
 {
 #ifdef COREARRAY_SIMD_SSE2
@@ -1413,3 +1918,199 @@ tail:
 
 	return p;
 }
+
+#endif  // VEC_CPU_TARGET
+
+
+
+// ===========================================================
+// runtime dispatch
+// ===========================================================
+
+#ifdef COREARRAY_SIMD_DISPATCH
+
+/// the kernels compiled for the current target
+const struct TVecKernels VEC_NAME(vec_kernels) =
+{
+	VEC_NAME(vec_i8_cnt_nonzero), VEC_NAME(vec_i8_count),
+	VEC_NAME(vec_i8_count2), VEC_NAME(vec_i8_count3),
+	VEC_NAME(vec_i8_replace), VEC_NAME(vec_i8_cnt_dosage2),
+	VEC_NAME(vec_u8_shr_b2), VEC_NAME(vec_u8_gather),
+	VEC_NAME(vec_i16_shr_b2), VEC_NAME(vec_i32_count),
+	VEC_NAME(vec_i32_count2), VEC_NAME(vec_i32_count3),
+	VEC_NAME(vec_i32_replace), VEC_NAME(vec_i32_cnt_dosage2),
+	VEC_NAME(vec_i32_shr_b2)
+};
+
+#endif
+
+
+#ifndef VEC_CPU_TARGET
+
+/// the name of instruction set used in the default kernels
+static const char *vec_simd_default_name()
+{
+#if defined(COREARRAY_SIMD_AVX512BW)
+	return "AVX512BW";
+#elif defined(COREARRAY_SIMD_AVX2)
+	return "AVX2";
+#elif defined(COREARRAY_SIMD_AVX)
+	return "AVX";
+#elif defined(COREARRAY_SIMD_SSE2)
+	return "SSE2";
+#else
+	return "none";
+#endif
+}
+
+#ifdef COREARRAY_SIMD_DISPATCH
+
+extern const struct TVecKernels vec_kernels_avx2;
+extern const struct TVecKernels vec_kernels_avx512bw;
+
+/// the kernels in use and their SIMD level
+static const struct TVecKernels *vec_kernels = &vec_kernels_def;
+static int vec_kernels_level = VEC_SIMD_DEFAULT;
+
+const char *vec_simd_name()
+{
+	switch (vec_kernels_level)
+	{
+		case VEC_SIMD_AVX2:     return "AVX2";
+		case VEC_SIMD_AVX512BW: return "AVX512BW";
+		default:                return vec_simd_default_name();
+	}
+}
+
+int vec_simd_select(int level)
+{
+	__builtin_cpu_init();
+	int best = VEC_SIMD_DEFAULT;
+	if (__builtin_cpu_supports("popcnt") && __builtin_cpu_supports("avx2"))
+	{
+		best = VEC_SIMD_AVX2;
+		if (__builtin_cpu_supports("avx512f") &&
+				__builtin_cpu_supports("avx512bw"))
+			best = VEC_SIMD_AVX512BW;
+	}
+	if (level < 0) level = best;
+	if (level > best) return -1;
+
+	switch (level)
+	{
+		case VEC_SIMD_AVX2:
+			vec_kernels = &vec_kernels_avx2; break;
+		case VEC_SIMD_AVX512BW:
+			vec_kernels = &vec_kernels_avx512bw; break;
+		default:
+			vec_kernels = &vec_kernels_def;
+	}
+	vec_kernels_level = level;
+	return level;
+}
+
+/// select the best kernels when the library is loaded
+__attribute__((constructor)) static void vec_simd_init()
+{
+	vec_simd_select(-1);
+}
+
+
+size_t vec_i8_cnt_nonzero(const int8_t *p, size_t n)
+{
+	return (*vec_kernels->i8_cnt_nonzero)(p, n);
+}
+
+size_t vec_i8_count(const char *p, size_t n, char val)
+{
+	return (*vec_kernels->i8_count)(p, n, val);
+}
+
+void vec_i8_count2(const char *p, size_t n, char val1, char val2,
+	size_t *out_n1, size_t *out_n2)
+{
+	(*vec_kernels->i8_count2)(p, n, val1, val2, out_n1, out_n2);
+}
+
+void vec_i8_count3(const char *p, size_t n, char val1, char val2, char val3,
+	size_t *out_n1, size_t *out_n2, size_t *out_n3)
+{
+	(*vec_kernels->i8_count3)(p, n, val1, val2, val3, out_n1, out_n2, out_n3);
+}
+
+void vec_i8_replace(int8_t *p, size_t n, int8_t val, int8_t substitute)
+{
+	(*vec_kernels->i8_replace)(p, n, val, substitute);
+}
+
+void vec_i8_cnt_dosage2(const int8_t *p, int8_t *out, size_t n, int8_t val,
+	int8_t missing, int8_t missing_substitute)
+{
+	(*vec_kernels->i8_cnt_dosage2)(p, out, n, val, missing, missing_substitute);
+}
+
+void vec_u8_shr_b2(uint8_t *p, size_t n)
+{
+	(*vec_kernels->u8_shr_b2)(p, n);
+}
+
+void vec_u8_gather(const uint8_t *s, const int32_t *idx, size_t n,
+	uint8_t *out)
+{
+	(*vec_kernels->u8_gather)(s, idx, n, out);
+}
+
+void vec_i16_shr_b2(int16_t *p, size_t n)
+{
+	(*vec_kernels->i16_shr_b2)(p, n);
+}
+
+size_t vec_i32_count(const int32_t *p, size_t n, int32_t val)
+{
+	return (*vec_kernels->i32_count)(p, n, val);
+}
+
+void vec_i32_count2(const int32_t *p, size_t n, int32_t val1, int32_t val2,
+	size_t *out_n1, size_t *out_n2)
+{
+	(*vec_kernels->i32_count2)(p, n, val1, val2, out_n1, out_n2);
+}
+
+void vec_i32_count3(const int32_t *p, size_t n, int32_t val1, int32_t val2,
+	int32_t val3, size_t *out_n1, size_t *out_n2, size_t *out_n3)
+{
+	(*vec_kernels->i32_count3)(p, n, val1, val2, val3, out_n1, out_n2, out_n3);
+}
+
+void vec_i32_replace(int32_t *p, size_t n, int32_t val, int32_t substitute)
+{
+	(*vec_kernels->i32_replace)(p, n, val, substitute);
+}
+
+void vec_i32_cnt_dosage2(const int32_t *p, int32_t *out, size_t n, int32_t val,
+	int32_t missing, int32_t missing_substitute)
+{
+	(*vec_kernels->i32_cnt_dosage2)(p, out, n, val, missing,
+		missing_substitute);
+}
+
+void vec_i32_shr_b2(int32_t *p, size_t n)
+{
+	(*vec_kernels->i32_shr_b2)(p, n);
+}
+
+#else
+
+const char *vec_simd_name()
+{
+	return vec_simd_default_name();
+}
+
+int vec_simd_select(int level)
+{
+	return (level <= VEC_SIMD_DEFAULT) ? VEC_SIMD_DEFAULT : -1;
+}
+
+#endif  // COREARRAY_SIMD_DISPATCH
+
+#endif  // VEC_CPU_TARGET
@@ -59,10 +59,25 @@
 #       include <nmmintrin.h>  // COREARRAY_SIMD_SSE4_2, for POPCNT
 #   endif
 
-#   if defined(COREARRAY_SIMD_AVX) || defined(COREARRAY_SIMD_AVX2)
-#       include <immintrin.h>  // AVX, AVX2
+#   if defined(__AVX512BW__) && !defined(COREARRAY_SIMD_AVX512BW)
+#       define COREARRAY_SIMD_AVX512BW
 #   endif
 
+#   if defined(COREARRAY_SIMD_AVX) || defined(COREARRAY_SIMD_AVX2) || \
+		defined(COREARRAY_SIMD_AVX512BW)
+#       include <immintrin.h>  // AVX, AVX2, AVX512BW
+#   endif
+
+#endif
+
+
+// runtime dispatch of the kernels by CPU features (GCC >= 5 or clang on x86),
+// the AVX2 and AVX512BW variants are compiled in vectorization_avx2.c and
+// vectorization_avx512bw.c
+#if (defined(__x86_64__) || defined(__i386__)) && \
+	(defined(__clang__) || (defined(__GNUC__) && (__GNUC__ >= 5))) && \
+	!defined(COREARRAY_NO_SIMD_DISPATCH)
+#   define COREARRAY_SIMD_DISPATCH
 #endif
 
 
@@ -198,6 +213,20 @@ inline static int POPCNT_U64(uint64_t x)
 #endif
 
 
+#if defined(__GNUC__) || defined(__clang__)
+#   define CTZ_U64(x)    __builtin_ctzll((uint64_t)(x))
+#else
+/// the number of trailing zeros, x should not be zero
+inline static int CTZ_U64(uint64_t x)
+{
+	int n = 0;
+	for (; (x & 0xFF) == 0; x >>= 8) n += 8;
+	for (; (x & 1) == 0; x >>= 1) n ++;
+	return n;
+}
+#endif
+
+
 
 // ===========================================================
 
@@ -292,6 +321,22 @@ COREARRAY_DLL_DEFAULT const int8_t *vec_i8_cnt_nonzero_ptr(const int8_t *p,
 
 
 
+// ===========================================================
+// runtime dispatch
+// ===========================================================
+
+/// the SIMD levels of the kernels with runtime dispatch
+enum { VEC_SIMD_DEFAULT = 0, VEC_SIMD_AVX2 = 1, VEC_SIMD_AVX512BW = 2 };
+
+/// the name of instruction set used by the kernels with runtime dispatch
+COREARRAY_DLL_DEFAULT const char *vec_simd_name();
+
+/// select the kernels by SIMD level (-1 for the best level supported by the
+/// CPU), returning the level selected or -1 if it is not supported
+COREARRAY_DLL_DEFAULT int vec_simd_select(int level);
+
+
+
 // ===========================================================
 // functions for int8
 // ===========================================================
@@ -320,6 +365,11 @@ COREARRAY_DLL_DEFAULT void vec_i8_cnt_dosage2(const int8_t *p,
 	int8_t *out, size_t n, int8_t val, int8_t missing,
 	int8_t missing_substitute);
 
+/// the same as vec_i8_cnt_dosage2, but output in 32-bit integers
+COREARRAY_DLL_DEFAULT void vec_i8_cnt_dosage2_i32(const int8_t *p,
+	int32_t *out, size_t n, int8_t val, int8_t missing,
+	int32_t missing_substitute);
+
 
 
 // ===========================================================
@@ -329,6 +379,31 @@ COREARRAY_DLL_DEFAULT void vec_i8_cnt_dosage2(const int8_t *p,
 /// shifting *p right by 2 bits, assuming p is 2-byte aligned
 COREARRAY_DLL_DEFAULT void vec_u8_shr_b2(uint8_t *p, size_t n);
 
+/// packing n 2-bit values of 's' into (n+3)/4 bytes of 'out', the i-th value
+/// is stored in the bits (2*(i%4), 2*(i%4)+1) of out[i/4], values > 3 are set to 3
+COREARRAY_DLL_DEFAULT void vec_u8_pack_b2(const uint8_t *s, size_t n,
+	uint8_t *out);
+
+/// packing n boolean bytes of 's' into (n+63)/64 words of 'out', the i-th value
+/// is stored in the bit (i%64) of out[i/64], returning the number of non-zeros
+COREARRAY_DLL_DEFAULT size_t vec_u8_pack_bool(const uint8_t *s, size_t n,
+	uint64_t *out);
+
+/// unpacking n bits of 's' (see vec_u8_pack_bool) into the bytes 0 or 1 of 'out'
+COREARRAY_DLL_DEFAULT void vec_u8_unpack_bool(const uint64_t *s, size_t n,
+	uint8_t *out);
+
+/// storing the indices of non-zeros of 'p' in 'out', returning the number of
+/// non-zeros
+COREARRAY_DLL_DEFAULT size_t vec_u8_nonzero_index(const uint8_t *p, size_t n,
+	int32_t *out);
+
+/// gathering out[i] = s[idx[i]] for i in [0, n), where 's' should be
+/// readable at 3 bytes past the largest index (4-byte gather with AVX2 and
+/// AVX512)
+COREARRAY_DLL_DEFAULT void vec_u8_gather(const uint8_t *s, const int32_t *idx,
+	size_t n, uint8_t *out);
+
 
 
 // ===========================================================
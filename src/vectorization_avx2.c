@@ -0,0 +1,49 @@
+// ===========================================================
+//
+// vectorization_avx2.c: the kernels compiled for AVX2 with runtime dispatch
+//
+// Copyright (C) 2017    Xiuwen Zheng
+//
+// This file is part of PySeqArray.
+//
+// PySeqArray is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License Version 3 as
+// published by the Free Software Foundation.
+//
+// PySeqArray is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with PySeqArray.
+// If not, see <http://www.gnu.org/licenses/>.
+
+// the same condition as COREARRAY_SIMD_DISPATCH in vectorization.h
+#if (defined(__x86_64__) || defined(__i386__)) && \
+	(defined(__clang__) || (defined(__GNUC__) && (__GNUC__ >= 5))) && \
+	!defined(COREARRAY_NO_SIMD_DISPATCH)
+
+#   if defined(__clang__)
+#       pragma clang attribute push (__attribute__((target("popcnt,avx2"))), apply_to=function)
+#   else
+#       pragma GCC target("popcnt,avx2")
+#   endif
+
+#   define COREARRAY_SIMD_SSE
+#   define COREARRAY_SIMD_SSE2
+#   define COREARRAY_SIMD_SSE3
+#   define COREARRAY_SIMD_SSSE3
+#   define COREARRAY_SIMD_SSE4_1
+#   define COREARRAY_SIMD_SSE4_2
+#   define COREARRAY_SIMD_AVX
+#   define COREARRAY_SIMD_AVX2
+
+#   define VEC_CPU_TARGET    _avx2
+#   include "vectorization.c"
+
+#   if defined(__clang__)
+#       pragma clang attribute pop
+#   endif
+
+#endif
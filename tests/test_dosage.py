@@ -0,0 +1,74 @@
+# ===========================================================================
+#
+# test_dosage.py: tests of dosages counted from the raw bit layers
+#
+# Copyright (C) 2017    Xiuwen Zheng
+#
+# This file is part of PySeqArray.
+#
+# PySeqArray is free software: you can redistribute it and/or modify it
+# under the terms of the GNU General Public License Version 3 as
+# published by the Free Software Foundation.
+#
+# PySeqArray is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with PySeqArray.
+# If not, see <http://www.gnu.org/licenses/>.
+
+"""Run with: python -m unittest discover tests"""
+
+import unittest
+import numpy as np
+import PySeqArray as ps
+
+
+# the number of reference alleles from the decoded genotypes
+def _dosage(g):
+	d = (g == 0).sum(axis=2).astype(np.uint8)
+	d[(g == 0xFF).any(axis=2)] = 0xFF
+	return d
+
+
+class TestDosage(unittest.TestCase):
+	def setUp(self):
+		self.f = ps.SeqArrayFile()
+		self.f.open(ps.seqExample('1KG_phase1_release_v3_chr22.gds'))
+
+	def tearDown(self):
+		self.f.close()
+
+	def check(self):
+		f = self.f
+		g = f.GetData('genotype')
+		d = f.GetData('$dosage')
+		np.testing.assert_array_equal(d, _dosage(g))
+		# the block reader of Apply
+		lst = f.Apply('$dosage', lambda x: x.copy(), asis='list', bsize=100)
+		np.testing.assert_array_equal(np.concatenate(lst), d)
+
+	def test_all(self):
+		self.check()
+
+	def test_sample_subset(self):
+		nsamp = len(self.f.FilterGet(True))
+		rs = np.random.RandomState(1000)
+		# a dense subset, and a sparse subset using the gather path
+		for n in (nsamp // 2, nsamp // 10):
+			self.f.FilterSet2(sample=np.sort(rs.choice(nsamp, n, replace=False)),
+				verbose=False)
+			self.check()
+
+	def test_variant_subset(self):
+		nvar = len(self.f.FilterGet(False))
+		rs = np.random.RandomState(1000)
+		self.f.FilterSet2(variant=np.sort(rs.choice(nvar, nvar // 3,
+			replace=False)), verbose=False)
+		self.check()
+
+
+if __name__ == '__main__':
+	unittest.main()
@@ -0,0 +1,99 @@
+# ===========================================================================
+#
+# test_parallel.py: tests of native methods in RunParallel
+#
+# Copyright (C) 2017    Xiuwen Zheng
+#
+# This file is part of PySeqArray.
+#
+# PySeqArray is free software: you can redistribute it and/or modify it
+# under the terms of the GNU General Public License Version 3 as
+# published by the Free Software Foundation.
+#
+# PySeqArray is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with PySeqArray.
+# If not, see <http://www.gnu.org/licenses/>.
+
+"""Run with: python -m unittest discover tests"""
+
+import unittest
+import numpy as np
+import PySeqArray as ps
+
+
+REDUCE_NAMES = [ 'variant.dosage_count', 'variant.dosage_sum', 'variant.nonmiss' ]
+
+
+# a worker of RunParallel, which reduces in the calling thread while the
+# other workers decode genotypes in ThreadGetData() without the GIL
+def _reduce_worker(f, param):
+	if param == 'mixed':
+		f.GetData('$dosage', nthread=1)
+	v = f.Reduce(REDUCE_NAMES, nthread=1)
+	af = f.AlleleFreq(nthread=1)
+	return (v, af)
+
+
+class TestRunParallelThreads(unittest.TestCase):
+	def setUp(self):
+		self.f = ps.SeqArrayFile()
+		self.f.open(ps.seqExample('1KG_phase1_release_v3_chr22.gds'))
+
+	def tearDown(self):
+		self.f.close()
+
+	def check(self, param):
+		f = self.f
+		v0 = f.Reduce(REDUCE_NAMES, nthread=1)
+		af0 = f.AlleleFreq(nthread=1)
+		for ncpu in (2, 4):
+			for rep in range(3):
+				lst = f.RunParallel(_reduce_worker, param, ncpu=ncpu,
+					combine='list', backend='threads')
+				self.assertEqual(len(lst), ncpu)
+				for nm in REDUCE_NAMES:
+					v = np.concatenate([ x[0][nm] for x in lst ])
+					np.testing.assert_array_equal(v, v0[nm])
+				af = np.concatenate([ x[1] for x in lst ])
+				np.testing.assert_array_equal(af, af0)
+
+	def test_reduce(self):
+		self.check(None)
+
+	def test_reduce_with_get_data(self):
+		self.check('mixed')
+
+
+# a worker of RunParallel, returning a list with a value per variant
+def _af_worker(f, param):
+	return f.AlleleFreq(nthread=1).tolist()
+
+
+class TestRunParallelShared(unittest.TestCase):
+	def setUp(self):
+		self.f = ps.SeqArrayFile()
+		self.f.open(ps.seqExample('1KG_phase1_release_v3_chr22.gds'))
+
+	def tearDown(self):
+		self.f.close()
+
+	def test_shared(self):
+		f = self.f
+		af0 = f.AlleleFreq(nthread=1)
+		for backend in ('threads', 'processes'):
+			for ncpu in (1, 2):
+				v = f.RunParallel(_af_worker, ncpu=ncpu, backend=backend,
+					shared='float64')
+				self.assertIsInstance(v, np.ndarray)
+				self.assertEqual(v.dtype, np.float64)
+				self.assertEqual(v.shape, af0.shape)
+				np.testing.assert_array_equal(v, af0)
+
+
+if __name__ == '__main__':
+	unittest.main()